@@ -0,0 +1,454 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analyses.h"
+#include "mount-table.h"
+
+// Parses a comma separated list of table sizes into sizes, returning how
+// many there were or -1 if one is invalid.
+static int parse_sizes(const char *list, unsigned long *sizes, int max) {
+    int n = 0;
+    char *end;
+
+    while (*list) {
+        if (n == max) {
+            fprintf(stderr, "At most %d table sizes can be audited\n", max);
+            return -1;
+        }
+
+        sizes[n] = strtoul(list, &end, 10);
+        if (end == list || sizes[n] == 0 || (*end && *end != ',')) {
+            fprintf(stderr, "Invalid table size list: %s\n", list);
+            return -1;
+        }
+        n++;
+        list = *end ? end + 1 : end;
+    }
+
+    return n;
+}
+
+int analyses_option(struct analyses *an, int ch, const char *arg) {
+    switch (ch) {
+        case 'A':
+            an->want_audit = 1;
+            break;
+        case 'D':
+            an->want_distinct = 1;
+            break;
+        case 'm':
+            an->by_mount = 1;
+            break;
+        case 'M':
+            an->by_mount = 1;
+            an->mount_file = arg;
+            break;
+        case 'S':
+            an->want_states = 1;
+            break;
+        case 'T':
+            an->top = atoi(arg);
+            if (an->top < 1) {
+                fprintf(stderr, "Invalid top-K size: %s\n", arg);
+                return -1;
+            }
+            break;
+        case OPT_TOP_PREFIX:
+            an->top_prefix = strtoul(arg, NULL, 10);
+            if (an->top_prefix < 1 || an->top_prefix > FID_BYTES) {
+                fprintf(stderr, "The fid prefix must be between 1 and %zu bytes\n", FID_BYTES);
+                return -1;
+            }
+            break;
+        case OPT_DUPLICATES:
+            an->want_distinct = 1;
+            an->want_exact = 1;
+            break;
+        case OPT_AUDIT_SIZES:
+            an->audit_nsizes = parse_sizes(arg, an->audit_sizes, AUDIT_MAX_SIZES);
+            if (an->audit_nsizes < 0) {
+                return -1;
+            }
+            an->want_audit = 1;
+            break;
+        case OPT_AUDIT_TARGET:
+            an->audit_target = strtoul(arg, NULL, 10);
+            break;
+        default:
+            return 0;
+    }
+    return 1;
+}
+
+unsigned int analyses_fields(const struct analyses *an) {
+    unsigned int fields = 0;
+
+    if (an->by_mount || an->want_by_fsid) {
+        fields |= LF_BIT(LF_FSID);
+    }
+    if (an->want_states) {
+        fields |= LF_FIELDS_STATE;
+    }
+    if (an->top || an->want_distinct || an->want_audit || an->gen || an->resolver) {
+        fields |= LF_BIT(LF_FH);
+    }
+    if (an->emitter || an->snapshot) {
+        fields |= LF_FIELDS_STATE | LF_BIT(LF_FH);
+    }
+    return fields;
+}
+
+int analyses_init(struct analyses *an, int hashsize) {
+    an->hashsize = hashsize;
+
+    if (an->by_mount || an->want_by_fsid) {
+        an->by_fsid = malloc(sizeof *an->by_fsid);
+        if (!an->by_fsid || fsid_stats_init(an->by_fsid) < 0) {
+            fprintf(stderr, "Failed to allocate the fsid table\n");
+            return -1;
+        }
+    }
+
+    if (an->want_states) {
+        an->states = calloc(LF_NSTATES, sizeof *an->states);
+        if (!an->states) {
+            fprintf(stderr, "Failed to allocate the state counters\n");
+            return -1;
+        }
+    }
+
+    if (an->top) {
+        int counters = an->top * TOPK_COUNTERS_PER_ENTRY;
+
+        if (!an->top_prefix) {
+            an->top_prefix = FID_BYTES;
+        }
+        an->top_fid = malloc(sizeof *an->top_fid);
+        an->top_fsid = malloc(sizeof *an->top_fsid);
+        if (!an->top_fid || !an->top_fsid || topk_init(an->top_fid, counters, sizeof(fsid_t) + an->top_prefix) < 0 ||
+            topk_init(an->top_fsid, counters, sizeof(fsid_t)) < 0) {
+            fprintf(stderr, "Failed to allocate top-K sketches\n");
+            return -1;
+        }
+    }
+
+    if (an->want_distinct) {
+        an->distinct = malloc(sizeof *an->distinct);
+        if (!an->distinct || hll_init(an->distinct, HLL_DEFAULT_PRECISION) < 0) {
+            fprintf(stderr, "Failed to allocate the handle sketches\n");
+            return -1;
+        }
+        if (an->want_exact) {
+            an->exact = malloc(sizeof *an->exact);
+            if (!an->exact || fh_set_init(an->exact) < 0) {
+                fprintf(stderr, "Failed to allocate the handle sketches\n");
+                return -1;
+            }
+        }
+    }
+
+    if (an->want_audit) {
+        an->audit = malloc(sizeof *an->audit);
+        if (!an->audit || hash_audit_init(an->audit) < 0) {
+            fprintf(stderr, "Failed to allocate the hash audit\n");
+            return -1;
+        }
+        if (!an->audit_nsizes) {
+            for (unsigned long m = 1; m <= AUDIT_MAX_MULTIPLE; m *= 2) {
+                an->audit_sizes[an->audit_nsizes++] = m * hashsize;
+            }
+        }
+        if (!an->audit_target) {
+            an->audit_target = DEFAULT_AUDIT_TARGET;
+        }
+    }
+
+    return 0;
+}
+
+void analyses_free(struct analyses *an) {
+    if (an->by_fsid) {
+        fsid_stats_free(an->by_fsid);
+        free(an->by_fsid);
+    }
+    free(an->states);
+    if (an->top_fid) {
+        topk_free(an->top_fid);
+        topk_free(an->top_fsid);
+        free(an->top_fid);
+        free(an->top_fsid);
+    }
+    if (an->distinct) {
+        hll_free(an->distinct);
+        free(an->distinct);
+    }
+    if (an->exact) {
+        fh_set_free(an->exact);
+        free(an->exact);
+    }
+    if (an->audit) {
+        hash_audit_free(an->audit);
+        free(an->audit);
+    }
+}
+
+int analyses_visit(const struct lf_node *node, void *arg) {
+    struct analyses *an = arg;
+
+    if (an->emitter && emitter_node(an->emitter, node) < 0) {
+        return -1;
+    }
+
+    if (an->snapshot && snapshot_writer_add(an->snapshot, node) < 0) {
+        fprintf(stderr, "Failed to grow the snapshot\n");
+        return -1;
+    }
+
+    if (an->by_fsid && fsid_stats_add(an->by_fsid, &node->fh.fh_fsid, lf_is_lost(node)) < 0) {
+        fprintf(stderr, "Failed to grow the fsid table\n");
+        return -1;
+    }
+
+    if (an->states) {
+        an->states[lf_state(node)]++;
+    }
+
+    if (an->top_fid && lf_is_lost(node)) {
+        unsigned char key[sizeof(fsid_t) + FID_BYTES];
+
+        memcpy(key, &node->fh.fh_fsid, sizeof(fsid_t));
+        memcpy(key + sizeof(fsid_t), &node->fh.fh_fid.fid_data0, an->top_prefix);
+        topk_add(an->top_fid, key);
+        topk_add(an->top_fsid, &node->fh.fh_fsid);
+    }
+
+    if (an->distinct) {
+        uint64_t hash = lf_fh_hash(&node->fh);
+
+        hll_add(an->distinct, hash);
+        if (an->exact && fh_set_add(an->exact, &node->fh, hash, node->addr, node->bucket) < 0) {
+            fprintf(stderr, "Failed to grow the handle set\n");
+            return -1;
+        }
+    }
+
+    if (an->gen && lf_is_lost(node) && gen_add(an->gen, node->addr, &node->fh) < 0) {
+        fprintf(stderr, "Failed to grow the generation\n");
+        return -1;
+    }
+
+    if (an->resolver && lf_is_lost(node) && resolver_add(an->resolver, &node->fh) < 0) {
+        fprintf(stderr, "Failed to grow the handle list\n");
+        return -1;
+    }
+
+    if (an->audit) {
+        uint32_t hash = lf_kernel_hash(&node->fh);
+
+        if (hash % an->hashsize != (uint32_t)node->bucket) {
+            an->misplaced++;
+        }
+        if (hash_audit_add(an->audit, hash) < 0) {
+            fprintf(stderr, "Failed to grow the hash audit\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int report_by_fsid(const struct fsid_stats *by_fsid, const char *mount_file) {
+    struct mount_table mounts;
+    struct fsid_entry *entries;
+    size_t count;
+    int rc;
+
+    rc = mount_file ? mount_table_load_file(&mounts, mount_file) : mount_table_load(&mounts);
+    if (rc < 0) {
+        return -1;
+    }
+
+    entries = fsid_stats_sorted(by_fsid, &count);
+    if (!entries) {
+        mount_table_free(&mounts);
+        return -1;
+    }
+
+    printf("\n%10s %10s  %-17s  %s\n", "LOST", "TOTAL", "FSID", "MOUNT");
+    for (size_t i = 0; i < count; i++) {
+        const char *path = mount_table_lookup(&mounts, &entries[i].fsid);
+        char fsid[32];
+
+        mount_format_fsid(&entries[i].fsid, fsid, sizeof fsid);
+        printf("%10lu %10lu  %-17s  %s\n", entries[i].lost, entries[i].total, fsid, path ? path : "(not mounted)");
+    }
+
+    free(entries);
+    mount_table_free(&mounts);
+    return 0;
+}
+
+static void report_states(const unsigned long *states) {
+    int order[LF_NSTATES];
+    int n = 0;
+
+    for (int state = 0; state < LF_NSTATES; state++) {
+        if (states[state]) {
+            order[n++] = state;
+        }
+    }
+
+    // Few masks occur in practice, so a simple insertion sort by count will do.
+    for (int i = 1; i < n; i++) {
+        int state = order[i];
+        int j = i;
+
+        while (j > 0 && states[order[j - 1]] < states[state]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = state;
+    }
+
+    printf("\n%10s  %s\n", "COUNT", "STATE");
+    for (int i = 0; i < n; i++) {
+        char name[128];
+
+        lf_state_format(order[i], name, sizeof name);
+        printf("%10lu  %s\n", states[order[i]], name);
+    }
+}
+
+static int report_top(const struct analyses *an) {
+    struct topk_counter *top;
+    int count;
+
+    top = topk_sorted(an->top_fid, &count);
+    if (!top) {
+        return -1;
+    }
+
+    printf("\nTop lost handles by fsid and %zu byte fid prefix (of %lu lost):\n", an->top_prefix, an->top_fid->seen);
+    printf("%10s %10s  %-17s  %s\n", "COUNT", "ERROR", "FSID", "FID");
+    for (int i = 0; i < count && i < an->top; i++) {
+        char fsid[32];
+        fsid_t id;
+
+        memcpy(&id, top[i].key, sizeof id);
+        mount_format_fsid(&id, fsid, sizeof fsid);
+        printf("%10lu %10lu  %-17s  ", top[i].count, top[i].error, fsid);
+        for (size_t b = 0; b < an->top_prefix; b++) {
+            printf("%02x", top[i].key[sizeof(fsid_t) + b]);
+        }
+        printf("\n");
+    }
+    free(top);
+
+    top = topk_sorted(an->top_fsid, &count);
+    if (!top) {
+        return -1;
+    }
+
+    printf("\nTop lost handles by fsid:\n");
+    printf("%10s %10s  %s\n", "COUNT", "ERROR", "FSID");
+    for (int i = 0; i < count && i < an->top; i++) {
+        char fsid[32];
+        fsid_t id;
+
+        memcpy(&id, top[i].key, sizeof id);
+        mount_format_fsid(&id, fsid, sizeof fsid);
+        printf("%10lu %10lu  %s\n", top[i].count, top[i].error, fsid);
+    }
+    free(top);
+
+    return 0;
+}
+
+static void report_distinct(const struct analyses *an, unsigned long visited) {
+    printf("\nDistinct handles (HyperLogLog, %u registers): %.0f of %lu entries (+/- %.1f%%)\n",
+           an->distinct->nregisters, hll_estimate(an->distinct), visited, 100 * hll_error(an->distinct));
+
+    if (!an->exact) {
+        return;
+    }
+
+    printf("Exact distinct handles: %zu of %lu entries, %zu duplicates\n",
+           an->exact->count, visited, an->exact->ndups);
+    for (size_t i = 0; i < an->exact->ndups && i < MAX_LISTED_DUPLICATES; i++) {
+        const struct fh_dup *dup = &an->exact->dups[i];
+        char handle[128];
+
+        mount_format_handle(&dup->fh, handle, sizeof handle);
+        printf("Duplicate handle %s: bucket %d at %#lx, first seen in bucket %d at %#lx\n",
+               handle, dup->bucket, dup->addr, dup->first_bucket, dup->first_addr);
+    }
+    if (an->exact->ndups > MAX_LISTED_DUPLICATES) {
+        printf("... and %zu more duplicates\n", an->exact->ndups - MAX_LISTED_DUPLICATES);
+    }
+}
+
+static int report_audit(const struct analyses *an, int complete) {
+    struct hash_audit_result r;
+    unsigned long recommended = 0;
+
+    printf("\nHash audit of %zu entries", an->audit->count);
+    if (!complete) {
+        printf(" (partial scan; chains scale with the entries not visited)");
+    }
+    printf("\n");
+    if (an->misplaced) {
+        printf("Warning: %lu entries are not in the bucket the kernel hash places them in\n", an->misplaced);
+    }
+
+    printf("%10s %12s %10s %8s %10s\n", "Buckets", "Mean chain", "Max chain", "CV", "Chi2/df");
+    for (int i = 0; i < an->audit_nsizes; i++) {
+        if (hash_audit_replay(an->audit, an->audit_sizes[i], &r) < 0) {
+            fprintf(stderr, "Failed to allocate %lu buckets for the hash audit\n", an->audit_sizes[i]);
+            return -1;
+        }
+
+        printf("%10lu %12.1f %10lu %8.3f %10.2f%s\n", r.size, r.mean, r.max, r.cv, r.chi2,
+               r.size == (unsigned long)an->hashsize ? "  (current)" : "");
+        if (r.max <= an->audit_target && (!recommended || r.size < recommended)) {
+            recommended = r.size;
+        }
+    }
+
+    // The mean chain is what a miss costs when the hash spreads evenly. A
+    // chi-squared per degree of freedom well above 1 means it does not, and
+    // the worst bucket is the one to size for.
+    if (recommended) {
+        printf("Smallest audited size with no chain over %lu entries: vfs.nfsd.fhhashsize=%lu\n",
+               an->audit_target, recommended);
+    } else {
+        printf("No audited size keeps every chain within %lu entries\n", an->audit_target);
+    }
+
+    return 0;
+}
+
+int analyses_report(const struct analyses *an, unsigned long visited, int complete) {
+    if (an->by_mount && report_by_fsid(an->by_fsid, an->mount_file) < 0) {
+        return -1;
+    }
+
+    if (an->states) {
+        report_states(an->states);
+    }
+
+    if (an->top_fid && report_top(an) < 0) {
+        fprintf(stderr, "Failed to sort top-K sketches\n");
+        return -1;
+    }
+
+    if (an->distinct) {
+        report_distinct(an, visited);
+    }
+
+    if (an->audit && report_audit(an, complete) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+#ifndef ANALYSES_H
+#define ANALYSES_H
+
+#include <stddef.h>
+
+#include "emit.h"
+#include "fh-resolve.h"
+#include "fh-set.h"
+#include "fsid-stats.h"
+#include "generations.h"
+#include "hash-audit.h"
+#include "hll.h"
+#include "lockfile.h"
+#include "snapshot.h"
+#include "topk.h"
+
+// The per-node analyses of nfs-lockfile-counter, shared with
+// nfs-lockfile-snapshot so a captured table can be analysed the same way as a
+// live one. Neither the analyses nor their reports touch the kernel.
+//
+// The caller sets the options, directly or with analyses_option(), and then
+// calls analyses_init() to allocate whatever they enable. Every node is then
+// passed to analyses_visit(), and analyses_report() prints the results. The
+// generation store, resolver, emitter and snapshot writer are owned by the
+// counter, which hooks them in through their pointers before the scan.
+
+// Counters monitored per reported entry of a top-K sketch. More counters give
+// tighter error bounds for the same K.
+#define TOPK_COUNTERS_PER_ENTRY 20
+
+// Duplicates listed individually before the rest are only counted.
+#define MAX_LISTED_DUPLICATES 100
+
+// Table sizes replayed by -A without --audit-sizes, as multiples of the
+// current size, and the worst-case chain length a size must stay within to be
+// recommended.
+#define AUDIT_MAX_MULTIPLE 1024
+#define AUDIT_MAX_SIZES 64
+#define DEFAULT_AUDIT_TARGET 100
+
+// Long options handled by analyses_option(), numbered clear of the options of
+// either program.
+enum {
+    OPT_TOP_PREFIX = 512,
+    OPT_DUPLICATES,
+    OPT_AUDIT_SIZES,
+    OPT_AUDIT_TARGET,
+};
+
+// The short options handled by analyses_option().
+#define ANALYSES_SHORT_OPTIONS "ADmM:ST:"
+
+struct analyses {
+    // Options, set before analyses_init().
+    int by_mount;               // Report counts per fsid and mount point
+    const char *mount_file;     // Stand-in mount table for by_mount
+    int want_by_fsid;           // Count per fsid even if it is not reported
+    int want_states;
+    int top;                    // Entries reported per top-K sketch, or 0
+    size_t top_prefix;
+    int want_distinct;
+    int want_exact;
+    int want_audit;
+    unsigned long audit_sizes[AUDIT_MAX_SIZES];
+    int audit_nsizes;
+    unsigned long audit_target;
+    int hashsize;
+
+    struct fsid_stats *by_fsid;
+    unsigned long *states;      // LF_NSTATES counters, indexed by lf_state()
+    struct topk *top_fid;       // Lost entries by fsid and fid prefix
+    struct topk *top_fsid;      // Lost entries by fsid
+    struct hll *distinct;
+    struct fh_set *exact;
+    struct hash_audit *audit;
+    unsigned long misplaced;    // Nodes whose replayed bucket is not the one they were found in
+    struct generation *gen;     // Lost entries of this scan
+    struct resolver *resolver;
+    struct emitter *emitter;
+    struct snapshot_writer *snapshot;
+};
+
+// Applies the option ch with argument arg. Returns 1 if it was one of the
+// options above, 0 if it was not, or -1 if its argument is invalid.
+int analyses_option(struct analyses *an, int ch, const char *arg);
+
+// Returns the lf_field bits the enabled analyses need decoded.
+unsigned int analyses_fields(const struct analyses *an);
+
+// Allocates the enabled analyses for a table of hashsize buckets.
+int analyses_init(struct analyses *an, int hashsize);
+void analyses_free(struct analyses *an);
+
+// Feeds one node to every enabled analysis. Matches the visit callback of a
+// scan, with a struct analyses as arg.
+int analyses_visit(const struct lf_node *node, void *arg);
+
+// Prints the report of every enabled analysis. visited is the number of nodes
+// fed in, and complete says whether they make up the whole table.
+int analyses_report(const struct analyses *an, unsigned long visited, int complete);
+
+#endif
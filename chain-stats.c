@@ -0,0 +1,108 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chain-stats.h"
+
+#define BAR_WIDTH 40
+
+static int compare_ulong(const void *a, const void *b) {
+    unsigned long la = *(const unsigned long *)a;
+    unsigned long lb = *(const unsigned long *)b;
+
+    return (la > lb) - (la < lb);
+}
+
+// Nearest-rank percentile of a sorted array.
+static unsigned long percentile(const unsigned long *sorted, int n, int pct) {
+    int rank = (pct * n + 99) / 100;
+
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+int chain_stats_compute(const unsigned long *len, const unsigned char *include, int nbuckets,
+                        struct chain_stats *cs) {
+    unsigned long *sorted;
+    double sumsq = 0;
+    double hits = 0;
+    int n = 0;
+
+    memset(cs, 0, sizeof *cs);
+
+    sorted = malloc((nbuckets ? nbuckets : 1) * sizeof *sorted);
+    if (!sorted) {
+        return -1;
+    }
+
+    for (int bucket = 0; bucket < nbuckets; bucket++) {
+        unsigned long l = len[bucket];
+
+        if (include && !include[bucket]) {
+            continue;
+        }
+
+        sorted[n++] = l;
+        cs->total += l;
+        sumsq += (double)l * l;
+        hits += (double)l * (l + 1) / 2;
+    }
+
+    cs->nbuckets = n;
+    if (n == 0) {
+        free(sorted);
+        return 0;
+    }
+
+    qsort(sorted, n, sizeof *sorted, compare_ulong);
+    cs->min = sorted[0];
+    cs->max = sorted[n - 1];
+    cs->p50 = percentile(sorted, n, 50);
+    cs->p90 = percentile(sorted, n, 90);
+    cs->p99 = percentile(sorted, n, 99);
+    cs->mean = (double)cs->total / n;
+    cs->stddev = sqrt(fmax(sumsq / n - cs->mean * cs->mean, 0));
+    cs->miss_compares = cs->mean;
+    cs->hit_compares = cs->total ? hits / cs->total : 0;
+
+    free(sorted);
+    return 0;
+}
+
+void chain_stats_print(const struct chain_stats *cs, FILE *out) {
+    if (cs->nbuckets == 0) {
+        fprintf(out, "No complete buckets to summarise\n");
+        return;
+    }
+
+    fprintf(out, "Chain length over %d buckets: min %lu, p50 %lu, p90 %lu, p99 %lu, max %lu\n",
+            cs->nbuckets, cs->min, cs->p50, cs->p90, cs->p99, cs->max);
+    fprintf(out, "Chain length mean: %.1f (stddev %.1f)\n", cs->mean, cs->stddev);
+    fprintf(out, "Predicted memcmp calls per nfsrv_getlockfile miss: %.1f\n", cs->miss_compares);
+    fprintf(out, "Predicted memcmp calls per nfsrv_getlockfile hit: %.1f\n", cs->hit_compares);
+}
+
+void chain_stats_print_histogram(const unsigned long *len, const unsigned char *include, int nbuckets,
+                                 FILE *out) {
+    unsigned long max = 0;
+    char bar[BAR_WIDTH + 1];
+
+    for (int bucket = 0; bucket < nbuckets; bucket++) {
+        if ((!include || include[bucket]) && len[bucket] > max) {
+            max = len[bucket];
+        }
+    }
+
+    fprintf(out, "%8s %12s\n", "BUCKET", "LENGTH");
+    for (int bucket = 0; bucket < nbuckets; bucket++) {
+        int width;
+
+        if (include && !include[bucket]) {
+            continue;
+        }
+
+        width = max ? (int)((double)len[bucket] * BAR_WIDTH / max + 0.5) : 0;
+        memset(bar, '@', width);
+        bar[width] = '\0';
+        fprintf(out, "%8d %12lu  %s\n", bucket, len[bucket], bar);
+    }
+}
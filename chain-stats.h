@@ -0,0 +1,39 @@
+#ifndef CHAIN_STATS_H
+#define CHAIN_STATS_H
+
+#include <stdio.h>
+
+// Summarises the chain length of every bucket of the table. On a lookup that
+// misses, nfsrv_getlockfile() compares the handle against every entry of the
+// bucket it hashes to, so with handles spread evenly over the buckets the
+// expected number of memcmp() calls for a miss is the mean chain length. A
+// hit on the k-th entry of a chain costs k compares, which averaged over all
+// entries is sum(L * (L + 1) / 2) / sum(L).
+
+struct chain_stats {
+    int nbuckets;           // Buckets included in the summary
+    unsigned long total;
+    unsigned long min;
+    unsigned long max;
+    unsigned long p50;
+    unsigned long p90;
+    unsigned long p99;
+    double mean;
+    double stddev;
+    double miss_compares;
+    double hit_compares;
+};
+
+// Summarises the buckets whose entry in include is set, or every bucket if
+// include is NULL. Returns -1 if memory for the percentiles is unavailable.
+int chain_stats_compute(const unsigned long *len, const unsigned char *include, int nbuckets,
+                        struct chain_stats *cs);
+
+void chain_stats_print(const struct chain_stats *cs, FILE *out);
+
+// Prints one line per bucket with its chain length and a bar scaled to the
+// longest chain.
+void chain_stats_print_histogram(const unsigned long *len, const unsigned char *include, int nbuckets,
+                                 FILE *out);
+
+#endif
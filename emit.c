@@ -0,0 +1,164 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "emit.h"
+
+#define EMIT_BUFFER_SIZE (1 << 20)
+
+// The longest NDJSON record, with room to spare.
+#define EMIT_MAX_LINE 512
+
+_Static_assert(sizeof(struct emit_record) == 56, "emit_record must not change size");
+
+static int flush(struct emitter *e) {
+    size_t done = 0;
+
+    while (done < e->len) {
+        ssize_t n = write(e->fd, e->buf + done, e->len - done);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to write records: %s\n", strerror(errno));
+            return -1;
+        }
+        done += n;
+    }
+
+    e->len = 0;
+    return 0;
+}
+
+int emitter_format(const char *name) {
+    if (strcmp(name, "ndjson") == 0) {
+        return EMIT_NDJSON;
+    }
+    if (strcmp(name, "binary") == 0) {
+        return EMIT_BINARY;
+    }
+    return -1;
+}
+
+int emitter_open(struct emitter *e, const char *path, int format) {
+    memset(e, 0, sizeof *e);
+    e->format = format;
+    e->cap = EMIT_BUFFER_SIZE;
+    e->buf = malloc(e->cap);
+    if (!e->buf) {
+        fprintf(stderr, "Failed to allocate the output buffer\n");
+        return -1;
+    }
+
+    e->fd = strcmp(path, "-") == 0 ? dup(STDOUT_FILENO) : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (e->fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        free(e->buf);
+        return -1;
+    }
+
+    if (format == EMIT_BINARY) {
+        struct emit_header h = {.version = EMIT_VERSION, .record_size = sizeof(struct emit_record)};
+
+        memcpy(h.magic, EMIT_MAGIC, sizeof h.magic);
+        memcpy(e->buf, &h, sizeof h);
+        e->len = sizeof h;
+    }
+    return 0;
+}
+
+// The fid is written from fid_data0 on, as filesystems lay it out, and as
+// mount_format_handle() spells it.
+static void format_ndjson(struct emitter *e, const struct lf_node *node) {
+    const unsigned char *data = (const unsigned char *)&node->fh.fh_fid.fid_data0;
+    size_t fid_len = node->fh.fh_fid.fid_len < FID_BYTES ? node->fh.fh_fid.fid_len : FID_BYTES;
+    unsigned int state = lf_state(node);
+    char states[128];
+    char fid[2 * FID_BYTES + 1];
+    char *line = e->buf + e->len;
+
+    for (size_t i = 0; i < fid_len; i++) {
+        snprintf(fid + 2 * i, 3, "%02x", data[i]);
+    }
+    fid[2 * fid_len] = '\0';
+    lf_state_format(state, states, sizeof states);
+
+    e->len += snprintf(line, EMIT_MAX_LINE,
+                       "{\"bucket\":%d,\"addr\":\"%#lx\",\"fsid\":\"%08x:%08x\",\"fid\":\"%s\","
+                       "\"state\":%u,\"states\":\"%s\",\"lost\":%s,\"usecount\":%d}\n",
+                       node->bucket, node->addr, (uint32_t)node->fh.fh_fsid.val[0],
+                       (uint32_t)node->fh.fh_fsid.val[1], fid, state, states,
+                       lf_is_lost(node) ? "true" : "false", node->usecount);
+}
+
+void emit_record_fill(struct emit_record *r, const struct lf_node *node) {
+    memset(r, 0, sizeof *r);
+    r->addr = node->addr;
+    r->bucket = node->bucket;
+    r->state = lf_state(node);
+    r->fid_len = node->fh.fh_fid.fid_len;
+    r->fsid[0] = node->fh.fh_fsid.val[0];
+    r->fsid[1] = node->fh.fh_fsid.val[1];
+    r->usecount = node->usecount;
+    r->lck_usecnt = node->lck_usecnt;
+    memcpy(r->fid, node->fh.fh_fid.fid_data, MAXFIDSZ);
+    r->fid_data0 = node->fh.fh_fid.fid_data0;
+    r->lck_lock = node->lck_lock;
+}
+
+void emit_record_node(const struct emit_record *r, struct lf_node *node) {
+    memset(node, 0, sizeof *node);
+    node->addr = r->addr;
+    node->bucket = r->bucket;
+    node->open = (r->state & LF_STATE_OPEN) != 0;
+    node->deleg = (r->state & LF_STATE_DELEG) != 0;
+    node->lock = (r->state & LF_STATE_LOCK) != 0;
+    node->locallock = (r->state & LF_STATE_LOCALLOCK) != 0;
+    node->rollback = (r->state & LF_STATE_ROLLBACK) != 0;
+    node->fh.fh_fsid.val[0] = r->fsid[0];
+    node->fh.fh_fsid.val[1] = r->fsid[1];
+    node->fh.fh_fid.fid_len = r->fid_len;
+    node->fh.fh_fid.fid_data0 = r->fid_data0;
+    memcpy(node->fh.fh_fid.fid_data, r->fid, MAXFIDSZ);
+    node->lck_usecnt = r->lck_usecnt;
+    node->lck_lock = r->lck_lock;
+    node->usecount = r->usecount;
+}
+
+static void format_binary(struct emitter *e, const struct lf_node *node) {
+    struct emit_record r;
+
+    emit_record_fill(&r, node);
+    memcpy(e->buf + e->len, &r, sizeof r);
+    e->len += sizeof r;
+}
+
+int emitter_node(struct emitter *e, const struct lf_node *node) {
+    if (e->cap - e->len < EMIT_MAX_LINE && flush(e) < 0) {
+        return -1;
+    }
+
+    if (e->format == EMIT_NDJSON) {
+        format_ndjson(e, node);
+    } else {
+        format_binary(e, node);
+    }
+    e->records++;
+    return 0;
+}
+
+int emitter_close(struct emitter *e) {
+    int rc = flush(e);
+
+    if (close(e->fd) < 0 && rc == 0) {
+        fprintf(stderr, "Failed to write records: %s\n", strerror(errno));
+        rc = -1;
+    }
+    free(e->buf);
+    return rc;
+}
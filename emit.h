@@ -0,0 +1,71 @@
+#ifndef EMIT_H
+#define EMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lockfile.h"
+
+// Streams one record per visited lockfile to a file or pipe for offline
+// analysis. Records are formatted into a large buffer that is written out
+// with a single write(2) whenever it fills, so emitting millions of records
+// costs a few hundred system calls rather than one per record.
+//
+// EMIT_NDJSON writes one JSON object per line. EMIT_BINARY writes an
+// emit_header followed by fixed-width emit_records in host byte order.
+
+#define EMIT_NDJSON 0
+#define EMIT_BINARY 1
+
+#define EMIT_MAGIC "NFSLKREC"
+#define EMIT_VERSION 1
+
+struct emit_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct emit_record {
+    uint64_t addr;
+    uint32_t bucket;
+    uint16_t state;         // lf_state() bits
+    uint16_t fid_len;
+    int32_t fsid[2];
+    int32_t usecount;
+    uint32_t lck_usecnt;
+    uint8_t fid[MAXFIDSZ];  // fid_data
+    uint16_t fid_data0;
+    uint8_t lck_lock;
+    uint8_t pad[5];
+};
+
+// Packs the decoded fields of a node into a record.
+void emit_record_fill(struct emit_record *r, const struct lf_node *node);
+
+// Unpacks a record into a node. The state lists hold only whether they are
+// empty, so their heads are set to 1 rather than to a kernel address.
+void emit_record_node(const struct emit_record *r, struct lf_node *node);
+
+struct emitter {
+    int fd;
+    int format;
+    char *buf;
+    size_t len;
+    size_t cap;
+    unsigned long records;
+};
+
+// Opens path for writing, or a duplicate of standard output if path is "-".
+// Returns -1 on failure after reporting why.
+int emitter_open(struct emitter *e, const char *path, int format);
+
+// Returns the format named "ndjson" or "binary", or -1.
+int emitter_format(const char *name);
+
+int emitter_node(struct emitter *e, const struct lf_node *node);
+
+// Flushes the buffer and closes the output.
+int emitter_close(struct emitter *e);
+
+#endif
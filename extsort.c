@@ -0,0 +1,229 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extsort.h"
+
+// Bytes read from a run at a time while merging.
+#define RUN_BUFFER (64 * 1024)
+
+int extsort_init(struct extsort *es, size_t size, size_t mem, int (*compare)(const void *, const void *)) {
+    memset(es, 0, sizeof *es);
+    es->size = size;
+    es->compare = compare;
+    es->fd = -1;
+    es->cap = mem / size > 1 ? mem / size : 1;
+    es->buf = malloc(es->cap * size);
+    return es->buf ? 0 : -1;
+}
+
+void extsort_free(struct extsort *es) {
+    for (size_t i = 0; i < es->nruns; i++) {
+        free(es->runs[i].buf);
+    }
+    free(es->runs);
+    free(es->heap);
+    free(es->buf);
+    if (es->fd >= 0) {
+        close(es->fd);
+    }
+    es->buf = NULL;
+    es->runs = NULL;
+    es->heap = NULL;
+    es->fd = -1;
+}
+
+// Sorts the buffer and appends it to the file as a run.
+static int spill(struct extsort *es) {
+    struct extsort_run *runs;
+    size_t len = es->count * es->size;
+    size_t done = 0;
+
+    if (es->fd < 0) {
+        char path[] = "/tmp/nfs-lockfile-sort.XXXXXX";
+        const char *dir = getenv("TMPDIR");
+        char buf[1024];
+
+        if (dir) {
+            snprintf(buf, sizeof buf, "%s/nfs-lockfile-sort.XXXXXX", dir);
+        }
+        es->fd = mkstemp(dir ? buf : path);
+        if (es->fd < 0) {
+            fprintf(stderr, "Failed to create a temporary sort file: %s\n", strerror(errno));
+            return -1;
+        }
+        unlink(dir ? buf : path);
+    }
+
+    runs = realloc(es->runs, (es->nruns + 1) * sizeof *runs);
+    if (!runs) {
+        fprintf(stderr, "Failed to allocate a sort run\n");
+        return -1;
+    }
+    es->runs = runs;
+
+    qsort(es->buf, es->count, es->size, es->compare);
+    while (done < len) {
+        ssize_t n = pwrite(es->fd, es->buf + done, len - done, es->file_len + done);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to write a sort run: %s\n", strerror(errno));
+            return -1;
+        }
+        done += n;
+    }
+
+    es->runs[es->nruns++] = (struct extsort_run){.off = es->file_len, .end = es->file_len + len};
+    es->file_len += len;
+    es->count = 0;
+    return 0;
+}
+
+int extsort_add(struct extsort *es, const void *record) {
+    if (es->count == es->cap && spill(es) < 0) {
+        return -1;
+    }
+    memcpy(es->buf + es->count++ * es->size, record, es->size);
+    es->records++;
+    return 0;
+}
+
+// Refills the buffer of a run. Returns 0 once the run is exhausted.
+static int refill(struct extsort *es, struct extsort_run *run) {
+    size_t want = RUN_BUFFER / es->size * es->size;
+    ssize_t n;
+
+    if (want == 0) {
+        want = es->size;
+    }
+    if (run->end - run->off < want) {
+        want = run->end - run->off;
+    }
+    if (want == 0) {
+        return 0;
+    }
+
+    do {
+        n = pread(es->fd, run->buf, want, run->off);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 || (size_t)n != want) {
+        fprintf(stderr, "Failed to read a sort run: %s\n", n < 0 ? strerror(errno) : "short read");
+        return -1;
+    }
+
+    run->off += want;
+    run->len = want;
+    run->pos = 0;
+    return 1;
+}
+
+static const void *run_head(const struct extsort *es, size_t i) {
+    return es->runs[i].buf + es->runs[i].pos;
+}
+
+static void sift_down(struct extsort *es, size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1;
+        size_t min = i;
+        size_t tmp;
+
+        if (l < es->nheap && es->compare(run_head(es, es->heap[l]), run_head(es, es->heap[min])) < 0) {
+            min = l;
+        }
+        if (l + 1 < es->nheap && es->compare(run_head(es, es->heap[l + 1]), run_head(es, es->heap[min])) < 0) {
+            min = l + 1;
+        }
+        if (min == i) {
+            return;
+        }
+        tmp = es->heap[i];
+        es->heap[i] = es->heap[min];
+        es->heap[min] = tmp;
+        i = min;
+    }
+}
+
+int extsort_finish(struct extsort *es) {
+    if (!es->nruns) {
+        qsort(es->buf, es->count, es->size, es->compare);
+        return 0;
+    }
+
+    if (es->count && spill(es) < 0) {
+        return -1;
+    }
+
+    // The sort buffer is no longer needed once everything is in runs.
+    free(es->buf);
+    es->buf = NULL;
+
+    es->heap = malloc(es->nruns * sizeof *es->heap);
+    if (!es->heap) {
+        fprintf(stderr, "Failed to allocate the sort merge\n");
+        return -1;
+    }
+    for (size_t i = 0; i < es->nruns; i++) {
+        int rc;
+
+        es->runs[i].buf = malloc(RUN_BUFFER > es->size ? RUN_BUFFER : es->size);
+        if (!es->runs[i].buf) {
+            fprintf(stderr, "Failed to allocate the sort merge\n");
+            return -1;
+        }
+        rc = refill(es, &es->runs[i]);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc > 0) {
+            es->heap[es->nheap++] = i;
+        }
+    }
+    for (size_t i = es->nheap / 2; i-- > 0;) {
+        sift_down(es, i);
+    }
+    return 0;
+}
+
+int extsort_next(struct extsort *es, const void **record) {
+    struct extsort_run *run;
+
+    if (!es->nruns) {
+        if (es->next == es->count) {
+            return 0;
+        }
+        *record = es->buf + es->next++ * es->size;
+        return 1;
+    }
+
+    // The record returned last is still at the head of its run, at the top
+    // of the heap. Step past it before finding the next one.
+    if (es->next) {
+        run = &es->runs[es->heap[0]];
+        run->pos += es->size;
+        if (run->pos == run->len) {
+            int rc = refill(es, run);
+
+            if (rc < 0) {
+                return -1;
+            }
+            if (rc == 0) {
+                es->heap[0] = es->heap[--es->nheap];
+            }
+        }
+        if (es->nheap) {
+            sift_down(es, 0);
+        }
+    }
+
+    if (!es->nheap) {
+        return 0;
+    }
+    es->next = 1;
+    *record = run_head(es, es->heap[0]);
+    return 1;
+}
@@ -0,0 +1,53 @@
+#ifndef EXTSORT_H
+#define EXTSORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sorts a stream of fixed-size records in bounded memory. Records are
+// collected in a buffer of at most `mem` bytes. Each time it fills, it is
+// sorted and appended to an unlinked temporary file as a run. Reading the
+// result merges the runs with a binary heap, holding one small buffer per
+// run, so a table many times larger than memory can be sorted in one pass
+// over it. When everything fits in the buffer, no file is written at all.
+//
+// The comparison is as for qsort(). Records that compare equal come out in
+// no particular order.
+
+struct extsort_run {
+    uint64_t off;       // Next byte of the run in the file
+    uint64_t end;
+    char *buf;
+    size_t len;         // Bytes in buf
+    size_t pos;         // Next record in buf
+};
+
+struct extsort {
+    size_t size;
+    int (*compare)(const void *, const void *);
+    char *buf;
+    size_t count;
+    size_t cap;         // Records that fit in buf
+    int fd;             // Temporary file holding the runs, or -1
+    uint64_t file_len;
+    struct extsort_run *runs;
+    size_t nruns;
+    size_t *heap;       // Indexes of the runs, ordered by their next record
+    size_t nheap;
+    size_t next;        // Next record of buf when there are no runs
+    uint64_t records;
+};
+
+int extsort_init(struct extsort *es, size_t size, size_t mem, int (*compare)(const void *, const void *));
+void extsort_free(struct extsort *es);
+
+int extsort_add(struct extsort *es, const void *record);
+
+// Ends the input and prepares to read the records in order.
+int extsort_finish(struct extsort *es);
+
+// Points record at the next record in order, valid until the next call.
+// Returns 1, 0 after the last record, or -1 if a run cannot be read.
+int extsort_next(struct extsort *es, const void **record);
+
+#endif
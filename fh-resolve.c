@@ -0,0 +1,458 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/user.h>
+#include <fcntl.h>
+#endif
+
+#include "fh-resolve.h"
+#include "mount-table.h"
+
+#define CACHE_MAGIC "nfs-lockfile-counter resolve cache"
+#define CACHE_VERSION 2
+
+// Handles claimed by a worker at a time.
+#define RESOLVE_BATCH 64
+
+#ifdef __FreeBSD__
+static int fhstat_open(const char *arg, void **state) {
+    (void)arg;
+    *state = NULL;
+    return 0;
+}
+
+static int fhstat_resolve(void *state, const fhandle_t *fh, struct fh_info *info) {
+    struct kinfo_file kif;
+    struct stat st;
+    int fd;
+
+    (void)state;
+    if (fhstat(fh, &st) < 0) {
+        info->error = errno;
+        return 0;
+    }
+    info->ino = st.st_ino;
+    info->mode = st.st_mode;
+
+    // The path is only known while the name cache holds the vnode's name, so
+    // it is not an error to go without.
+    fd = fhopen(fh, O_RDONLY | O_NONBLOCK);
+    if (fd >= 0) {
+        kif.kf_structsize = sizeof kif;
+        if (fcntl(fd, F_KINFO, &kif) == 0 && kif.kf_path[0]) {
+            info->path = strdup(kif.kf_path);
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static void fhstat_close(void *state) {
+    (void)state;
+}
+#endif
+
+struct table_entry {
+    char *handle;
+    uint64_t ino;
+    char *path;         // NULL for a stale handle
+};
+
+struct table {
+    struct table_entry *entries;
+    size_t count;
+};
+
+static int compare_table_entries(const void *a, const void *b) {
+    return strcmp(((const struct table_entry *)a)->handle, ((const struct table_entry *)b)->handle);
+}
+
+static void table_close(void *state) {
+    struct table *t = state;
+
+    for (size_t i = 0; i < t->count; i++) {
+        free(t->entries[i].handle);
+        free(t->entries[i].path);
+    }
+    free(t->entries);
+    free(t);
+}
+
+static int table_open(const char *arg, void **state) {
+    struct table *t;
+    char line[PATH_MAX + 256];
+    size_t cap = 0;
+    FILE *f;
+
+    if (!arg) {
+        fprintf(stderr, "The table resolver needs a file, as table:FILE\n");
+        return -1;
+    }
+
+    f = fopen(arg, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open handle table %s: %s\n", arg, strerror(errno));
+        return -1;
+    }
+
+    t = calloc(1, sizeof *t);
+    if (!t) {
+        fclose(f);
+        return -1;
+    }
+
+    while (fgets(line, sizeof line, f)) {
+        char handle[256];
+        char path[PATH_MAX];
+        struct table_entry *e;
+        int n;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+
+        if (t->count == cap) {
+            struct table_entry *entries;
+
+            cap = cap ? cap * 2 : 256;
+            entries = realloc(t->entries, cap * sizeof *entries);
+            if (!entries) {
+                fclose(f);
+                table_close(t);
+                return -1;
+            }
+            t->entries = entries;
+        }
+
+        e = &t->entries[t->count];
+        memset(e, 0, sizeof *e);
+        n = sscanf(line, "%255s %" SCNu64 " %[^\n]", handle, &e->ino, path);
+        if (n != 3 && !(sscanf(line, "%255s %255s", handle, path) == 2 && strcmp(path, "stale") == 0)) {
+            fprintf(stderr, "Invalid handle table line: %s\n", line);
+            fclose(f);
+            table_close(t);
+            return -1;
+        }
+
+        e->handle = strdup(handle);
+        e->path = n == 3 ? strdup(path) : NULL;
+        t->count++;
+    }
+
+    fclose(f);
+    qsort(t->entries, t->count, sizeof *t->entries, compare_table_entries);
+    *state = t;
+    return 0;
+}
+
+static int table_resolve(void *state, const fhandle_t *fh, struct fh_info *info) {
+    struct table *t = state;
+    struct table_entry key;
+    struct table_entry *e;
+    char handle[256];
+
+    mount_format_handle(fh, handle, sizeof handle);
+    key.handle = handle;
+    e = bsearch(&key, t->entries, t->count, sizeof *t->entries, compare_table_entries);
+    if (!e || !e->path) {
+        info->error = ESTALE;
+        return 0;
+    }
+
+    info->ino = e->ino;
+    info->path = strdup(e->path);
+    return info->path ? 0 : -1;
+}
+
+static const struct resolver_backend resolver_backends[] = {
+#ifdef __FreeBSD__
+        {"fhstat", fhstat_open, fhstat_resolve, fhstat_close},
+#endif
+        {"table", table_open, table_resolve, table_close},
+        {NULL},
+};
+
+int resolver_init(struct resolver *r, const char *spec, int nworkers) {
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+
+    memset(r, 0, sizeof *r);
+    r->nworkers = nworkers;
+
+    for (const struct resolver_backend *b = resolver_backends; b->name; b++) {
+        if (strlen(b->name) == len && strncmp(b->name, spec, len) == 0) {
+            r->backend = b;
+        }
+    }
+    if (!r->backend) {
+        fprintf(stderr, "Unknown resolver: %.*s\n", (int)len, spec);
+        return -1;
+    }
+
+    return r->backend->open(colon ? colon + 1 : NULL, &r->state);
+}
+
+void resolver_free(struct resolver *r) {
+    if (r->info) {
+        for (size_t i = 0; i < r->count; i++) {
+            free(r->info[i].path);
+        }
+    }
+    if (r->backend) {
+        r->backend->close(r->state);
+    }
+    free(r->items);
+    free(r->info);
+    free(r->pending);
+}
+
+int resolver_add(struct resolver *r, const fhandle_t *fh) {
+    if (r->count == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 4096;
+        struct resolve_item *items = realloc(r->items, cap * sizeof *items);
+
+        if (!items) {
+            return -1;
+        }
+        r->items = items;
+        r->cap = cap;
+    }
+
+    r->items[r->count++] = (struct resolve_item){.fh = *fh, .count = 1};
+    return 0;
+}
+
+static int compare_items(const void *a, const void *b) {
+    return lf_fh_compare(&((const struct resolve_item *)a)->fh, &((const struct resolve_item *)b)->fh);
+}
+
+// Sorts the items by handle and folds equal handles into one.
+static void dedupe(struct resolver *r) {
+    size_t n = 0;
+
+    qsort(r->items, r->count, sizeof *r->items, compare_items);
+    for (size_t i = 0; i < r->count; i++) {
+        if (n && compare_items(&r->items[n - 1], &r->items[i]) == 0) {
+            r->items[n - 1].count++;
+        } else {
+            r->items[n++] = r->items[i];
+        }
+    }
+    r->count = n;
+}
+
+static struct resolve_item *find_item(struct resolver *r, const fhandle_t *fh) {
+    struct resolve_item key = {.fh = *fh};
+
+    return bsearch(&key, r->items, r->count, sizeof *r->items, compare_items);
+}
+
+// The cache spells a handle as the hex of all its bytes, so that it matches
+// only the handle it was looked up for.
+static void format_key(const fhandle_t *fh, char *buf) {
+    const unsigned char *p = (const unsigned char *)fh;
+
+    for (size_t i = 0; i < sizeof *fh; i++) {
+        sprintf(buf + 2 * i, "%02x", p[i]);
+    }
+}
+
+static int parse_key(const char *key, fhandle_t *fh) {
+    unsigned char *p = (unsigned char *)fh;
+
+    if (strlen(key) != 2 * sizeof *fh) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof *fh; i++) {
+        unsigned int byte;
+
+        if (sscanf(key + 2 * i, "%2x", &byte) != 1) {
+            return -1;
+        }
+        p[i] = byte;
+    }
+    return 0;
+}
+
+// Fills in the items found in the cache. Entries for handles that are not
+// in this scan are dropped, so the cache only holds the current leak.
+static int load_cache(struct resolver *r, const char *path) {
+    char line[PATH_MAX + 128];
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "Failed to open resolve cache %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (!fgets(line, sizeof line, f) || strncmp(line, CACHE_MAGIC " ", strlen(CACHE_MAGIC) + 1) != 0) {
+        fprintf(stderr, "%s is not a resolve cache\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    // Version 1 keyed entries on a hash of the handle that left out part of
+    // the fid, so its handles are looked up again.
+    if (atoi(line + strlen(CACHE_MAGIC) + 1) != CACHE_VERSION) {
+        fclose(f);
+        return 0;
+    }
+
+    while (fgets(line, sizeof line, f)) {
+        struct resolve_item *item;
+        struct fh_info *info;
+        fhandle_t fh;
+        char key[2 * sizeof(fhandle_t) + 1];
+        uint64_t ino;
+        unsigned int mode;
+        char name[PATH_MAX];
+        int error;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%56s %d %" SCNu64 " %o %[^\n]", key, &error, &ino, &mode, name) != 5 ||
+            parse_key(key, &fh) < 0) {
+            fprintf(stderr, "Invalid resolve cache line: %s\n", line);
+            fclose(f);
+            return -1;
+        }
+
+        item = find_item(r, &fh);
+        if (!item) {
+            continue;
+        }
+
+        info = &r->info[item - r->items];
+        if (info->error < 0) {
+            info->error = error;
+            info->ino = ino;
+            info->mode = mode;
+            info->path = strcmp(name, "-") != 0 ? strdup(name) : NULL;
+            r->from_cache++;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static int save_cache(const struct resolver *r, const char *path) {
+    FILE *f;
+
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to write resolve cache %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "%s %d\n", CACHE_MAGIC, CACHE_VERSION);
+    for (size_t i = 0; i < r->count; i++) {
+        const struct fh_info *info = &r->info[i];
+
+        // Lookups that failed for another reason than a stale handle may
+        // succeed next time, so they are not cached.
+        if (info->error == 0 || info->error == ESTALE) {
+            char key[2 * sizeof(fhandle_t) + 1];
+
+            format_key(&r->items[i].fh, key);
+            fprintf(f, "%s %d %" PRIu64 " %o %s\n", key, info->error, info->ino,
+                    (unsigned int)info->mode, info->path ? info->path : "-");
+        }
+    }
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Failed to write resolve cache %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void *resolve_worker(void *arg) {
+    struct resolver *r = arg;
+
+    for (;;) {
+        size_t first = atomic_fetch_add(&r->cursor, RESOLVE_BATCH);
+
+        if (first >= r->npending) {
+            return NULL;
+        }
+
+        for (size_t i = first; i < first + RESOLVE_BATCH && i < r->npending; i++) {
+            size_t item = r->pending[i];
+
+            r->info[item].error = 0;
+            if (r->backend->resolve(r->state, &r->items[item].fh, &r->info[item]) < 0) {
+                r->info[item].error = ENOMEM;
+            }
+        }
+    }
+}
+
+int resolver_run(struct resolver *r, const char *cache_path) {
+    pthread_t *threads;
+    int started = 0;
+
+    dedupe(r);
+
+    r->info = calloc(r->count ? r->count : 1, sizeof *r->info);
+    r->pending = malloc((r->count ? r->count : 1) * sizeof *r->pending);
+    if (!r->info || !r->pending) {
+        fprintf(stderr, "Failed to allocate %zu resolver results\n", r->count);
+        return -1;
+    }
+
+    // A negative error marks a handle that has not been resolved yet.
+    for (size_t i = 0; i < r->count; i++) {
+        r->info[i].error = -1;
+    }
+
+    if (cache_path && load_cache(r, cache_path) < 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < r->count; i++) {
+        if (r->info[i].error < 0) {
+            r->pending[r->npending++] = i;
+        }
+    }
+    r->looked_up = r->npending;
+    atomic_init(&r->cursor, 0);
+
+    threads = malloc(r->nworkers * sizeof *threads);
+    if (!threads) {
+        fprintf(stderr, "Failed to allocate resolver workers\n");
+        return -1;
+    }
+
+    for (int i = 0; i < r->nworkers; i++) {
+        if (pthread_create(&threads[i], NULL, resolve_worker, r) != 0) {
+            fprintf(stderr, "Failed to start resolver worker %d\n", i);
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    if (!started) {
+        return -1;
+    }
+
+    return cache_path ? save_cache(r, cache_path) : 0;
+}
@@ -0,0 +1,76 @@
+#ifndef FH_RESOLVE_H
+#define FH_RESOLVE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lockfile.h"
+
+// Resolves the handles of lost lockfiles to the files they belong to.
+//
+// Handles are collected during the scan, deduplicated by lf_fh_compare(), and
+// handed to a backend from a pool of worker threads that claim them in
+// batches. The number of workers bounds the lookups in flight against the
+// filesystems. Results, including handles that are stale because their file
+// was removed, are kept in a cache file so later scans only look up handles
+// they have not seen before.
+//
+// Backends are selected by name, with an optional argument after a colon:
+//
+//   fhstat        fhstat(2) and fhopen(2) on the NFS server itself, naming
+//                 the file with F_KINFO where the kernel still knows the path.
+//                 FreeBSD only, and needs root.
+//   table:FILE    A stand-in table with one "HANDLE INO PATH" or
+//                 "HANDLE stale" line per file, with handles spelled as by
+//                 mount_format_handle(). Handles not listed are stale.
+
+struct fh_info {
+    int error;          // 0, or the errno of the lookup
+    uint64_t ino;
+    uint32_t mode;
+    char *path;         // NULL if the backend cannot name the file
+};
+
+struct resolver_backend {
+    const char *name;
+    int (*open)(const char *arg, void **state);
+    // Must be safe to call from several threads at once.
+    int (*resolve)(void *state, const fhandle_t *fh, struct fh_info *info);
+    void (*close)(void *state);
+};
+
+struct resolve_item {
+    fhandle_t fh;
+    unsigned long count;    // Lost entries with this handle
+};
+
+struct resolver {
+    const struct resolver_backend *backend;
+    void *state;
+    int nworkers;
+
+    struct resolve_item *items;
+    size_t count;
+    size_t cap;
+    struct fh_info *info;   // One per item once resolver_run() has deduplicated them
+
+    unsigned long from_cache;
+    unsigned long looked_up;
+
+    size_t *pending;        // Items not in the cache
+    size_t npending;
+    atomic_size_t cursor;
+};
+
+// Opens the backend named by spec, "NAME" or "NAME:ARG".
+int resolver_init(struct resolver *r, const char *spec, int nworkers);
+void resolver_free(struct resolver *r);
+
+int resolver_add(struct resolver *r, const fhandle_t *fh);
+
+// Deduplicates the collected handles and resolves each of them, through the
+// cache at cache_path if one is given, which is then rewritten.
+int resolver_run(struct resolver *r, const char *cache_path);
+
+#endif
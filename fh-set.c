@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fh-set.h"
+
+#define INITIAL_CAP 1024
+
+int fh_set_init(struct fh_set *set) {
+    set->cap = INITIAL_CAP;
+    set->count = 0;
+    set->handles = NULL;
+    set->handles_cap = 0;
+    set->slots = calloc(set->cap, sizeof *set->slots);
+    set->dups = NULL;
+    set->ndups = 0;
+    set->dups_cap = 0;
+    return set->slots ? 0 : -1;
+}
+
+void fh_set_free(struct fh_set *set) {
+    free(set->slots);
+    free(set->handles);
+    free(set->dups);
+    set->slots = NULL;
+    set->handles = NULL;
+    set->dups = NULL;
+}
+
+// Returns the slot holding fh, or the empty slot where it belongs. The hashes
+// are already well mixed, so the low bits index the table, and the handles are
+// only compared when their hashes are equal.
+static struct fh_slot *find(struct fh_slot *slots, size_t cap, const fhandle_t *handles, const fhandle_t *fh,
+                            uint64_t hash) {
+    size_t i = hash & (cap - 1);
+
+    while (slots[i].handle &&
+           (slots[i].hash != hash || lf_fh_compare(&handles[slots[i].handle - 1], fh) != 0)) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &slots[i];
+}
+
+static int grow(struct fh_set *set) {
+    size_t cap = set->cap * 2;
+    struct fh_slot *slots = calloc(cap, sizeof *slots);
+
+    if (!slots) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < set->cap; i++) {
+        if (set->slots[i].handle) {
+            const fhandle_t *fh = &set->handles[set->slots[i].handle - 1];
+
+            *find(slots, cap, set->handles, fh, set->slots[i].hash) = set->slots[i];
+        }
+    }
+
+    free(set->slots);
+    set->slots = slots;
+    set->cap = cap;
+    return 0;
+}
+
+int fh_set_add(struct fh_set *set, const fhandle_t *fh, uint64_t hash, unsigned long addr, int bucket) {
+    struct fh_slot *slot;
+
+    // Keep the load factor below 0.7.
+    if ((set->count + 1) * 10 > set->cap * 7 && grow(set) < 0) {
+        return -1;
+    }
+
+    slot = find(set->slots, set->cap, set->handles, fh, hash);
+    if (!slot->handle) {
+        if (set->count == UINT32_MAX) {
+            return -1;
+        }
+        if (set->count == set->handles_cap) {
+            size_t cap = set->handles_cap ? set->handles_cap * 2 : INITIAL_CAP;
+            fhandle_t *handles = realloc(set->handles, cap * sizeof *handles);
+
+            if (!handles) {
+                return -1;
+            }
+            set->handles = handles;
+            set->handles_cap = cap;
+        }
+
+        set->handles[set->count] = *fh;
+        slot->handle = set->count + 1;
+        slot->hash = hash;
+        slot->addr = addr;
+        slot->bucket = bucket;
+        set->count++;
+        return 0;
+    }
+
+    if (set->ndups == set->dups_cap) {
+        size_t cap = set->dups_cap ? set->dups_cap * 2 : 16;
+        struct fh_dup *dups = realloc(set->dups, cap * sizeof *dups);
+
+        if (!dups) {
+            return -1;
+        }
+        set->dups = dups;
+        set->dups_cap = cap;
+    }
+
+    set->dups[set->ndups++] = (struct fh_dup) {
+            .fh = *fh,
+            .first_addr = slot->addr,
+            .first_bucket = slot->bucket,
+            .addr = addr,
+            .bucket = bucket,
+    };
+    return 0;
+}
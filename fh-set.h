@@ -0,0 +1,53 @@
+#ifndef FH_SET_H
+#define FH_SET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lockfile.h"
+
+// An exact set of file handles, used to find handles that appear more than
+// once in the table. The handles are kept once each in an array, and each
+// slot of the open-addressing table holds the 64-bit lf_fh_hash() of one of
+// them, its index and where it was first seen. The hash settles almost every
+// probe; a handle is only a duplicate once lf_fh_compare() finds it equal to
+// the stored one, so a hash collision between distinct handles is never
+// reported as the kernel inserting a handle twice. Duplicates are rare, so
+// they keep a copy of the handle for reporting.
+
+struct fh_slot {
+    uint64_t hash;
+    unsigned long addr;
+    int bucket;
+    uint32_t handle;            // Index in handles plus one, or zero
+};
+
+struct fh_dup {
+    fhandle_t fh;
+    unsigned long first_addr;
+    int first_bucket;
+    unsigned long addr;
+    int bucket;
+};
+
+struct fh_set {
+    struct fh_slot *slots;
+    size_t cap;
+    fhandle_t *handles;
+    size_t count;               // Distinct handles
+    size_t handles_cap;
+
+    struct fh_dup *dups;
+    size_t ndups;
+    size_t dups_cap;
+};
+
+int fh_set_init(struct fh_set *set);
+void fh_set_free(struct fh_set *set);
+
+// Adds a handle, with its lf_fh_hash(), seen at addr in bucket. A handle that
+// is already present is recorded as a duplicate instead. Returns -1 if memory
+// runs out.
+int fh_set_add(struct fh_set *set, const fhandle_t *fh, uint64_t hash, unsigned long addr, int bucket);
+
+#endif
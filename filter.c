@@ -0,0 +1,274 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+static const struct {
+    const char *name;
+    enum filter_field field;
+    unsigned int fields;
+    int ordered;                // Accepts <, <=, > and >=
+} field_names[] = {
+        {"bucket", FILTER_BUCKET, 0, 1},
+        {"addr", FILTER_ADDR, 0, 1},
+        {"usecount", FILTER_USECOUNT, LF_BIT(LF_USECOUNT), 1},
+        {"state", FILTER_STATE, LF_FIELDS_STATE, 0},
+        {"fsid", FILTER_FSID, LF_BIT(LF_FSID), 0},
+        {"fid", FILTER_FID, LF_BIT(LF_FH), 0},
+};
+
+static const struct {
+    const char *text;
+    enum filter_op op;
+} op_names[] = {
+        // Two character operators first, so "<=" is not read as "<".
+        {"!=", FILTER_NE},
+        {"<=", FILTER_LE},
+        {">=", FILTER_GE},
+        {"=", FILTER_EQ},
+        {"<", FILTER_LT},
+        {">", FILTER_GT},
+};
+
+static int parse_value(struct filter_term *t, const char *value, size_t len) {
+    char buf[64];
+    char *end;
+
+    if (len == 0 || len >= sizeof buf) {
+        return -1;
+    }
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+
+    switch (t->field) {
+        case FILTER_BUCKET:
+        case FILTER_ADDR:
+            t->value = strtoull(buf, &end, 0);
+            return *end ? -1 : 0;
+
+        // The use count is signed, and a negative one is worth finding.
+        case FILTER_USECOUNT:
+            t->value = (uint64_t)strtoll(buf, &end, 0);
+            return *end ? -1 : 0;
+
+        case FILTER_STATE: {
+            int bit;
+
+            if (strcmp(buf, "lost") == 0) {
+                t->value = FILTER_STATE_LOST;
+            } else if (strcmp(buf, "orphaned") == 0) {
+                t->value = FILTER_STATE_ORPHANED;
+            } else if ((bit = lf_state_bit(buf, len)) > 0) {
+                t->value = bit;
+            } else {
+                return -1;
+            }
+            return 0;
+        }
+
+        case FILTER_FSID: {
+            unsigned int val0;
+            unsigned int val1;
+            fsid_t fsid;
+            int n;
+
+            if (sscanf(buf, "%x:%x%n", &val0, &val1, &n) != 2 || buf[n]) {
+                return -1;
+            }
+            fsid.val[0] = (int32_t)val0;
+            fsid.val[1] = (int32_t)val1;
+            t->value = lf_fsid_key(&fsid);
+            return 0;
+        }
+
+        case FILTER_FID:
+            if (len % 2 || len / 2 > FID_BYTES) {
+                return -1;
+            }
+            for (size_t i = 0; i < len / 2; i++) {
+                unsigned int byte;
+
+                if (!isxdigit((unsigned char)buf[2 * i]) || !isxdigit((unsigned char)buf[2 * i + 1]) ||
+                    sscanf(buf + 2 * i, "%2x", &byte) != 1) {
+                    return -1;
+                }
+                t->fid[i] = byte;
+            }
+            t->fid_len = len / 2;
+            return 0;
+    }
+    return -1;
+}
+
+static int compare_terms(const void *a, const void *b) {
+    return (int)((const struct filter_term *)a)->field - (int)((const struct filter_term *)b)->field;
+}
+
+int filter_compile(struct filter *f, const char *expr) {
+    const char *p = expr;
+
+    memset(f, 0, sizeof *f);
+
+    while (*p) {
+        struct filter_term *t = &f->terms[f->nterms];
+        const char *term_end = p + strcspn(p, ",");
+        const char *value;
+        size_t value_len;
+        size_t name_len;
+        int field = -1;
+        int op = -1;
+
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+
+        if (f->nterms == FILTER_MAX_TERMS) {
+            fprintf(stderr, "A filter can have at most %d terms\n", FILTER_MAX_TERMS);
+            return -1;
+        }
+
+        name_len = strcspn(p, "=!<>, ");
+        for (size_t i = 0; i < sizeof field_names / sizeof *field_names; i++) {
+            if (strlen(field_names[i].name) == name_len && strncmp(field_names[i].name, p, name_len) == 0) {
+                field = i;
+            }
+        }
+        if (field < 0) {
+            fprintf(stderr, "Unknown filter field: %.*s\n", (int)(term_end - p), p);
+            return -1;
+        }
+
+        value = p + name_len;
+        while (isspace((unsigned char)*value)) {
+            value++;
+        }
+        for (size_t i = 0; i < sizeof op_names / sizeof *op_names; i++) {
+            size_t len = strlen(op_names[i].text);
+
+            if (strncmp(value, op_names[i].text, len) == 0) {
+                op = op_names[i].op;
+                value += len;
+                break;
+            }
+        }
+        if (op < 0 || (!field_names[field].ordered && op != FILTER_EQ && op != FILTER_NE)) {
+            fprintf(stderr, "Invalid operator in filter term: %.*s\n", (int)(term_end - p), p);
+            return -1;
+        }
+
+        while (isspace((unsigned char)*value)) {
+            value++;
+        }
+
+        value_len = term_end - value;
+        while (value_len > 0 && isspace((unsigned char)value[value_len - 1])) {
+            value_len--;
+        }
+
+        t->field = field_names[field].field;
+        t->op = op;
+        if (parse_value(t, value, value_len) < 0) {
+            fprintf(stderr, "Invalid value in filter term: %.*s\n", (int)(term_end - p), p);
+            return -1;
+        }
+
+        f->fields |= field_names[field].fields;
+        f->nterms++;
+        p = *term_end ? term_end + 1 : term_end;
+    }
+
+    // The field enum is ordered by cost.
+    qsort(f->terms, f->nterms, sizeof *f->terms, compare_terms);
+    return 0;
+}
+
+static int compare(uint64_t a, enum filter_op op, uint64_t b) {
+    switch (op) {
+        case FILTER_EQ:
+            return a == b;
+        case FILTER_NE:
+            return a != b;
+        case FILTER_LT:
+            return a < b;
+        case FILTER_LE:
+            return a <= b;
+        case FILTER_GT:
+            return a > b;
+        case FILTER_GE:
+            return a >= b;
+    }
+    return 0;
+}
+
+static int compare_signed(int64_t a, enum filter_op op, int64_t b) {
+    switch (op) {
+        case FILTER_EQ:
+            return a == b;
+        case FILTER_NE:
+            return a != b;
+        case FILTER_LT:
+            return a < b;
+        case FILTER_LE:
+            return a <= b;
+        case FILTER_GT:
+            return a > b;
+        case FILTER_GE:
+            return a >= b;
+    }
+    return 0;
+}
+
+static int match_state(const struct filter_term *t, const struct lf_node *node) {
+    int set;
+
+    if (t->value == FILTER_STATE_LOST) {
+        set = lf_is_lost(node);
+    } else if (t->value == FILTER_STATE_ORPHANED) {
+        set = lf_state(node) == 0;
+    } else {
+        set = (lf_state(node) & t->value) != 0;
+    }
+    return t->op == FILTER_EQ ? set : !set;
+}
+
+static int match_fid(const struct filter_term *t, const struct lf_node *node) {
+    const struct fid *fid = &node->fh.fh_fid;
+    int set = fid->fid_len >= t->fid_len && memcmp(&fid->fid_data0, t->fid, t->fid_len) == 0;
+
+    return t->op == FILTER_EQ ? set : !set;
+}
+
+int filter_match(const struct filter *f, const struct lf_node *node) {
+    for (int i = 0; i < f->nterms; i++) {
+        const struct filter_term *t = &f->terms[i];
+        int ok = 0;
+
+        switch (t->field) {
+            case FILTER_BUCKET:
+                ok = compare(node->bucket, t->op, t->value);
+                break;
+            case FILTER_ADDR:
+                ok = compare(node->addr, t->op, t->value);
+                break;
+            case FILTER_USECOUNT:
+                ok = compare_signed(node->usecount, t->op, (int64_t)t->value);
+                break;
+            case FILTER_STATE:
+                ok = match_state(t, node);
+                break;
+            case FILTER_FSID:
+                ok = compare(lf_fsid_key(&node->fh.fh_fsid), t->op, t->value);
+                break;
+            case FILTER_FID:
+                ok = match_fid(t, node);
+                break;
+        }
+
+        if (!ok) {
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,70 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lockfile.h"
+
+// A filter selects lockfiles by their fields. It is a comma separated list of
+// terms that must all hold, each a field, an operator and a value:
+//
+//   bucket=12             addr>=0xfffff80012000000
+//   fsid=00001000:0000003a      (= and != only)
+//   fid=00000c0003              (a hex prefix of the fid; = and != only)
+//   state=lost            state=orphaned        state!=deleg
+//   usecount>0
+//
+// A state term compares against one name: "lost" for lf_is_lost(),
+// "orphaned" for an empty lf_state() mask, or one of the names printed by
+// lf_state_format() to test that bit. The operators are =, !=, <, <=, > and
+// >=. A fid prefix is matched against the fid from fid_data0 on, within
+// fid_len, as the records written by -o spell it. The text is compiled once,
+// and the terms are reordered so the cheapest ones are tested first: the
+// bucket and address come from the walk itself, and comparing a fid prefix is
+// left for last.
+
+#define FILTER_MAX_TERMS 16
+
+// The values of a state term that are not a single LF_STATE_* bit.
+#define FILTER_STATE_LOST (1u << 16)
+#define FILTER_STATE_ORPHANED (1u << 17)
+
+enum filter_field {
+    FILTER_BUCKET,
+    FILTER_ADDR,
+    FILTER_USECOUNT,
+    FILTER_STATE,
+    FILTER_FSID,
+    FILTER_FID,
+};
+
+enum filter_op {
+    FILTER_EQ,
+    FILTER_NE,
+    FILTER_LT,
+    FILTER_LE,
+    FILTER_GT,
+    FILTER_GE,
+};
+
+struct filter_term {
+    enum filter_field field;
+    enum filter_op op;
+    uint64_t value;             // A number, an lf_fsid_key() or a state bit; an int64_t for usecount
+    unsigned char fid[FID_BYTES];
+    size_t fid_len;
+};
+
+struct filter {
+    struct filter_term terms[FILTER_MAX_TERMS];
+    int nterms;
+    unsigned int fields;        // LF_BIT()s the terms need read
+};
+
+// Compiles expr into f. Returns -1 after reporting the first error.
+int filter_compile(struct filter *f, const char *expr);
+
+int filter_match(const struct filter *f, const struct lf_node *node);
+
+#endif
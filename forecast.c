@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "forecast.h"
+
+#define HISTORY_MAGIC "nfs-lockfile-counter history 1"
+
+static struct series *add_series(struct history *h, const char *name) {
+    struct series *s;
+
+    for (size_t i = 0; i < h->count; i++) {
+        if (strcmp(h->series[i].name, name) == 0) {
+            return &h->series[i];
+        }
+    }
+
+    if (h->count == h->cap) {
+        size_t cap = h->cap ? h->cap * 2 : 16;
+        struct series *series = realloc(h->series, cap * sizeof *series);
+
+        if (!series) {
+            return NULL;
+        }
+        h->series = series;
+        h->cap = cap;
+    }
+
+    s = &h->series[h->count++];
+    memset(s, 0, sizeof *s);
+    snprintf(s->name, sizeof s->name, "%s", name);
+    return s;
+}
+
+static int add_point(struct series *s, int64_t time, unsigned long total, unsigned long lost) {
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 64;
+        struct history_point *points = realloc(s->points, cap * sizeof *points);
+
+        if (!points) {
+            return -1;
+        }
+        s->points = points;
+        s->cap = cap;
+    }
+
+    s->points[s->count++] = (struct history_point){.time = time, .total = total, .lost = lost};
+    return 0;
+}
+
+int history_load(struct history *h, const char *path) {
+    char line[256];
+    int lineno = 1;
+    FILE *f;
+
+    memset(h, 0, sizeof *h);
+
+    f = fopen(path, "r");
+    if (!f) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "Failed to open history %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (!fgets(line, sizeof line, f) || strncmp(line, HISTORY_MAGIC, strlen(HISTORY_MAGIC)) != 0) {
+        fprintf(stderr, "%s is not a scan history\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    while (fgets(line, sizeof line, f)) {
+        char name[32];
+        int64_t time;
+        unsigned long total;
+        unsigned long lost;
+        struct series *s;
+
+        lineno++;
+        if (sscanf(line, "%" SCNd64 " %31s %lu %lu", &time, name, &total, &lost) != 4) {
+            fprintf(stderr, "Invalid history line %s:%d\n", path, lineno);
+            fclose(f);
+            history_free(h);
+            return -1;
+        }
+
+        s = add_series(h, name);
+        if (!s || add_point(s, time, total, lost) < 0) {
+            fprintf(stderr, "Failed to allocate history\n");
+            fclose(f);
+            history_free(h);
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+void history_free(struct history *h) {
+    for (size_t i = 0; i < h->count; i++) {
+        free(h->series[i].points);
+    }
+    free(h->series);
+    h->series = NULL;
+    h->count = 0;
+}
+
+int history_append(const char *path, int64_t time, const char *name, unsigned long total, unsigned long lost) {
+    FILE *f;
+    long size;
+
+    f = fopen(path, "a");
+    if (!f) {
+        fprintf(stderr, "Failed to write history %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    if (size == 0) {
+        fprintf(f, "%s\n", HISTORY_MAGIC);
+    }
+    fprintf(f, "%" PRId64 " %s %lu %lu\n", time, name, total, lost);
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Failed to write history %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+const struct series *history_find(const struct history *h, const char *name) {
+    for (size_t i = 0; i < h->count; i++) {
+        if (strcmp(h->series[i].name, name) == 0) {
+            return &h->series[i];
+        }
+    }
+    return NULL;
+}
+
+int series_fit(const struct series *s, int lost, struct fit *fit) {
+    size_t first = 0;
+    double sx = 0;
+    double sy = 0;
+    double sxx = 0;
+    double sxy = 0;
+    double syy = 0;
+    double n;
+    double var_x;
+    double var_y;
+    double cov;
+
+    for (size_t i = 1; i < s->count; i++) {
+        if (2 * s->points[i].total < s->points[i - 1].total) {
+            first = i;
+        }
+    }
+
+    if (s->count - first < 2) {
+        return -1;
+    }
+
+    // Times are taken relative to the first point so their squares keep
+    // their precision.
+    for (size_t i = first; i < s->count; i++) {
+        double x = (double)(s->points[i].time - s->points[first].time);
+        double y = lost ? s->points[i].lost : s->points[i].total;
+
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        syy += y * y;
+    }
+
+    n = s->count - first;
+    var_x = sxx - sx * sx / n;
+    var_y = syy - sy * sy / n;
+    cov = sxy - sx * sy / n;
+    if (var_x <= 0) {
+        return -1;
+    }
+
+    fit->npoints = s->count - first;
+    fit->since = s->points[first].time;
+    fit->slope = cov / var_x;
+    fit->intercept = (sy - fit->slope * sx) / n - fit->slope * fit->since;
+    fit->r2 = var_y > 0 ? cov * cov / (var_x * var_y) : 1;
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef FORECAST_H
+#define FORECAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The counts of a series of scans, kept in a history file that every complete
+// scan appends to. Each line holds the time of a scan, the series it belongs
+// to ("all" for the whole table, or an fsid as printed by mount_format_fsid())
+// and the total and lost entries counted. The file is plain text so it can be
+// graphed or trimmed with the usual tools.
+//
+// Growth is fitted with an ordinary least-squares line through the points of
+// a series since the server last shed most of its entries. A series whose
+// total drops below half of the point before it is taken to have been reset
+// by an nfsd restart, and the fit starts over from there.
+
+#define HISTORY_ALL "all"
+
+struct history_point {
+    int64_t time;
+    unsigned long total;
+    unsigned long lost;
+};
+
+struct series {
+    char name[32];
+    struct history_point *points;
+    size_t count;
+    size_t cap;
+};
+
+struct history {
+    struct series *series;
+    size_t count;
+    size_t cap;
+};
+
+struct fit {
+    size_t npoints;
+    int64_t since;          // Time of the first point fitted
+    double slope;           // Entries per second
+    double intercept;       // Entries at time 0
+    double r2;
+};
+
+// Loads the history at path. A missing file is an empty history.
+int history_load(struct history *h, const char *path);
+void history_free(struct history *h);
+
+// Appends a point to the history at path, creating the file if needed.
+int history_append(const char *path, int64_t time, const char *name, unsigned long total, unsigned long lost);
+
+const struct series *history_find(const struct history *h, const char *name);
+
+// Fits the total, or with lost set the lost, entries of the series since its
+// last reset. Returns -1 if fewer than two points remain or they all share
+// one time.
+int series_fit(const struct series *s, int lost, struct fit *fit);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "fsid-stats.h"
+
+#define INITIAL_CAP 16
+
+// Slots with a zero total are empty, as every entry counts at least one node.
+
+static size_t slot_of(uint64_t key, size_t cap) {
+    return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (cap - 1);
+}
+
+int fsid_stats_init(struct fsid_stats *fs) {
+    fs->cap = INITIAL_CAP;
+    fs->count = 0;
+    fs->slots = calloc(fs->cap, sizeof *fs->slots);
+    return fs->slots ? 0 : -1;
+}
+
+void fsid_stats_free(struct fsid_stats *fs) {
+    free(fs->slots);
+    fs->slots = NULL;
+}
+
+static int grow(struct fsid_stats *fs) {
+    size_t cap = fs->cap * 2;
+    struct fsid_entry *slots = calloc(cap, sizeof *slots);
+
+    if (!slots) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < fs->cap; i++) {
+        if (fs->slots[i].total) {
+            size_t j = slot_of(fs->slots[i].key, cap);
+
+            while (slots[j].total) {
+                j = (j + 1) & (cap - 1);
+            }
+            slots[j] = fs->slots[i];
+        }
+    }
+
+    free(fs->slots);
+    fs->slots = slots;
+    fs->cap = cap;
+    return 0;
+}
+
+int fsid_stats_add(struct fsid_stats *fs, const fsid_t *fsid, int lost) {
+    uint64_t key = lf_fsid_key(fsid);
+    size_t i;
+
+    // Keep the load factor at or below one half.
+    if ((fs->count + 1) * 2 > fs->cap && grow(fs) < 0) {
+        return -1;
+    }
+
+    for (i = slot_of(key, fs->cap); fs->slots[i].total; i = (i + 1) & (fs->cap - 1)) {
+        if (fs->slots[i].key == key) {
+            break;
+        }
+    }
+
+    if (!fs->slots[i].total) {
+        fs->slots[i].key = key;
+        fs->slots[i].fsid = *fsid;
+        fs->count++;
+    }
+
+    fs->slots[i].total++;
+    if (lost) {
+        fs->slots[i].lost++;
+    }
+    return 0;
+}
+
+static int compare_lost(const void *a, const void *b) {
+    const struct fsid_entry *ea = a;
+    const struct fsid_entry *eb = b;
+
+    if (ea->lost != eb->lost) {
+        return (ea->lost < eb->lost) - (ea->lost > eb->lost);
+    }
+    return (ea->key > eb->key) - (ea->key < eb->key);
+}
+
+struct fsid_entry *fsid_stats_sorted(const struct fsid_stats *fs, size_t *count) {
+    struct fsid_entry *entries = malloc((fs->count ? fs->count : 1) * sizeof *entries);
+    size_t n = 0;
+
+    if (!entries) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < fs->cap; i++) {
+        if (fs->slots[i].total) {
+            entries[n++] = fs->slots[i];
+        }
+    }
+
+    qsort(entries, n, sizeof *entries, compare_lost);
+    *count = n;
+    return entries;
+}
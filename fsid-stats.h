@@ -0,0 +1,35 @@
+#ifndef FSID_STATS_H
+#define FSID_STATS_H
+
+#include <stddef.h>
+
+#include "lockfile.h"
+
+// Total and lost lockfile counts per fsid, kept in an open-addressing hash
+// table keyed by lf_fsid_key(). A server exports few filesystems, so the
+// table stays small no matter how many lockfiles are counted.
+
+struct fsid_entry {
+    uint64_t key;
+    fsid_t fsid;
+    unsigned long total;
+    unsigned long lost;
+};
+
+struct fsid_stats {
+    struct fsid_entry *slots;
+    size_t cap;
+    size_t count;
+};
+
+int fsid_stats_init(struct fsid_stats *fs);
+void fsid_stats_free(struct fsid_stats *fs);
+
+// Counts one lockfile on the given fsid.
+int fsid_stats_add(struct fsid_stats *fs, const fsid_t *fsid, int lost);
+
+// Returns a copy of the entries sorted by lost count, most first, and stores
+// their number in count. The caller frees the array.
+struct fsid_entry *fsid_stats_sorted(const struct fsid_stats *fs, size_t *count);
+
+#endif
@@ -0,0 +1,249 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "generations.h"
+
+#define GEN_MAGIC "NFSLKGEN"
+#define GEN_VERSION 2
+
+struct gen_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    int64_t first_scan;
+    int64_t scanned;
+};
+
+int gen_init(struct generation *gen, int64_t scanned) {
+    gen->count = 0;
+    gen->cap = 4096;
+    gen->first_scan = scanned;
+    gen->scanned = scanned;
+    gen->records = malloc(gen->cap * sizeof *gen->records);
+    return gen->records ? 0 : -1;
+}
+
+void gen_free(struct generation *gen) {
+    free(gen->records);
+    gen->records = NULL;
+}
+
+int gen_add(struct generation *gen, uint64_t addr, const fhandle_t *fh) {
+    struct gen_record *r;
+
+    if (gen->count == gen->cap) {
+        struct gen_record *records = realloc(gen->records, gen->cap * 2 * sizeof *records);
+
+        if (!records) {
+            return -1;
+        }
+        gen->records = records;
+        gen->cap *= 2;
+    }
+
+    r = &gen->records[gen->count++];
+    r->addr = addr;
+    r->fsid = fh->fh_fsid;
+    r->fid = fh->fh_fid;
+    r->pad = 0;
+    r->first_seen = gen->scanned;
+    return 0;
+}
+
+static int compare_records(const struct gen_record *a, const struct gen_record *b) {
+    int c;
+
+    if (a->addr != b->addr) {
+        return a->addr < b->addr ? -1 : 1;
+    }
+    c = memcmp(&a->fsid, &b->fsid, sizeof a->fsid);
+    if (c != 0) {
+        return c;
+    }
+    return memcmp(&a->fid, &b->fid, sizeof a->fid);
+}
+
+static int compare_records_qsort(const void *a, const void *b) {
+    return compare_records(a, b);
+}
+
+void gen_sort(struct generation *gen) {
+    qsort(gen->records, gen->count, sizeof *gen->records, compare_records_qsort);
+}
+
+int gen_load(struct generation *gen, const char *path) {
+    struct gen_header h;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "Failed to open generation store %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fread(&h, sizeof h, 1, f) != 1 || memcmp(h.magic, GEN_MAGIC, sizeof h.magic) != 0) {
+        fprintf(stderr, "%s is not a generation store\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    // Version 1 matched records on a hash of the handle that left out part of
+    // the fid, so its records cannot be joined with these. Start again.
+    if (h.version < GEN_VERSION) {
+        fprintf(stderr, "Generation store %s is from an older version, starting a new one\n", path);
+        fclose(f);
+        return 0;
+    }
+
+    if (h.version != GEN_VERSION || h.record_size != sizeof(struct gen_record)) {
+        fprintf(stderr, "%s is not a generation store\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    gen->records = malloc((h.count ? h.count : 1) * sizeof *gen->records);
+    if (!gen->records) {
+        fprintf(stderr, "Failed to allocate %llu generation records\n", (unsigned long long)h.count);
+        fclose(f);
+        return -1;
+    }
+
+    if (fread(gen->records, sizeof *gen->records, h.count, f) != h.count) {
+        fprintf(stderr, "Generation store %s is truncated\n", path);
+        gen_free(gen);
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+    gen->count = gen->cap = h.count;
+    gen->first_scan = h.first_scan;
+    gen->scanned = h.scanned;
+    return 1;
+}
+
+int gen_save(const struct generation *gen, const char *path) {
+    struct gen_header h = {.version = GEN_VERSION, .record_size = sizeof(struct gen_record)};
+    char tmp[PATH_MAX];
+    FILE *f;
+
+    memcpy(h.magic, GEN_MAGIC, sizeof h.magic);
+    h.count = gen->count;
+    h.first_scan = gen->first_scan;
+    h.scanned = gen->scanned;
+
+    // Written beside the store and renamed over it, so an interrupted run
+    // leaves the previous generation intact.
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        fprintf(stderr, "Failed to write generation store %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    if (fwrite(&h, sizeof h, 1, f) != 1 || fwrite(gen->records, sizeof *gen->records, gen->count, f) != gen->count) {
+        fprintf(stderr, "Failed to write generation store %s: %s\n", tmp, strerror(errno));
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+
+    if (fclose(f) != 0 || rename(tmp, path) < 0) {
+        fprintf(stderr, "Failed to write generation store %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// A server exports few filesystems, so the fsids are searched linearly,
+// starting with the one matched last.
+static int count_fsid(struct gen_diff *diff, const fsid_t *fsid, int kind) {
+    size_t i;
+
+    if (diff->last < diff->nfsids && memcmp(&diff->fsids[diff->last].fsid, fsid, sizeof *fsid) == 0) {
+        diff->fsids[diff->last].counts[kind]++;
+        return 0;
+    }
+
+    for (i = 0; i < diff->nfsids; i++) {
+        if (memcmp(&diff->fsids[i].fsid, fsid, sizeof *fsid) == 0) {
+            break;
+        }
+    }
+
+    if (i == diff->nfsids) {
+        if (diff->nfsids == diff->cap) {
+            size_t cap = diff->cap ? diff->cap * 2 : 16;
+            struct gen_fsid *fsids = realloc(diff->fsids, cap * sizeof *fsids);
+
+            if (!fsids) {
+                return -1;
+            }
+            diff->fsids = fsids;
+            diff->cap = cap;
+        }
+        memset(&diff->fsids[i], 0, sizeof diff->fsids[i]);
+        diff->fsids[i].fsid = *fsid;
+        diff->nfsids++;
+    }
+
+    diff->last = i;
+    diff->fsids[i].counts[kind]++;
+    return 0;
+}
+
+int gen_diff(const struct generation *prev, struct generation *cur, struct gen_diff *diff) {
+    size_t i = 0;
+    size_t j = 0;
+
+    memset(diff, 0, sizeof *diff);
+    cur->first_scan = prev->first_scan;
+
+    while (i < prev->count || j < cur->count) {
+        const struct gen_record *r;
+        int kind;
+        int c;
+
+        if (i == prev->count) {
+            c = 1;
+        } else if (j == cur->count) {
+            c = -1;
+        } else {
+            c = compare_records(&prev->records[i], &cur->records[j]);
+        }
+
+        if (c < 0) {
+            r = &prev->records[i++];
+            kind = GEN_GONE;
+        } else if (c > 0) {
+            r = &cur->records[j++];
+            kind = GEN_NEW;
+        } else {
+            cur->records[j].first_seen = prev->records[i++].first_seen;
+            r = &cur->records[j++];
+            kind = GEN_SURVIVING;
+        }
+
+        diff->counts[kind]++;
+        if (count_fsid(diff, &r->fsid, kind) < 0) {
+            gen_diff_free(diff);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void gen_diff_free(struct gen_diff *diff) {
+    free(diff->fsids);
+    diff->fsids = NULL;
+}
@@ -0,0 +1,74 @@
+#ifndef GENERATIONS_H
+#define GENERATIONS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lockfile.h"
+
+// A generation is the set of lost lockfiles found by one complete scan, kept
+// as an array of fixed-size records sorted by kernel address and file handle.
+// The newest generation is stored in a file between runs. Each scan builds a
+// new generation and merge joins it with the stored one in a single pass over
+// both, classifying every entry as new, surviving or gone. Surviving entries
+// inherit the time they were first seen, which gives each lost lockfile an age.
+//
+// An address alone is not enough to match entries, as a freed lockfile's
+// memory can be reused for another handle. Records match only when the
+// address, the fsid and every byte of the struct fid are equal, as the kernel
+// compares handles, rather than on a hash that distinct handles could share.
+
+struct gen_record {
+    uint64_t addr;
+    fsid_t fsid;
+    struct fid fid;
+    uint32_t pad;           // Zero, so that no uninitialised bytes are saved
+    int64_t first_seen;
+};
+
+struct generation {
+    struct gen_record *records;
+    size_t count;
+    size_t cap;
+    int64_t first_scan;     // When the oldest generation in the store was taken
+    int64_t scanned;        // When this generation was taken
+};
+
+#define GEN_NEW 0
+#define GEN_SURVIVING 1
+#define GEN_GONE 2
+
+struct gen_fsid {
+    fsid_t fsid;
+    unsigned long counts[3];    // Indexed by GEN_NEW, GEN_SURVIVING and GEN_GONE
+};
+
+struct gen_diff {
+    unsigned long counts[3];
+    struct gen_fsid *fsids;
+    size_t nfsids;
+    size_t cap;
+    size_t last;
+};
+
+int gen_init(struct generation *gen, int64_t scanned);
+void gen_free(struct generation *gen);
+int gen_add(struct generation *gen, uint64_t addr, const fhandle_t *fh);
+
+// Sorts the records into the order gen_diff() and gen_save() expect.
+void gen_sort(struct generation *gen);
+
+// Loads a generation saved by gen_save(). Returns 1 if one was loaded, 0 if
+// path does not exist or was saved by an older version, and -1 if it cannot
+// be read.
+int gen_load(struct generation *gen, const char *path);
+
+// Replaces the store at path with gen.
+int gen_save(const struct generation *gen, const char *path);
+
+// Joins the sorted generations prev and cur, counting each entry per fsid and
+// copying first_seen and first_scan from prev into cur.
+int gen_diff(const struct generation *prev, struct generation *cur, struct gen_diff *diff);
+void gen_diff_free(struct gen_diff *diff);
+
+#endif
@@ -0,0 +1,65 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "hash-audit.h"
+
+int hash_audit_init(struct hash_audit *ha) {
+    ha->count = 0;
+    ha->cap = 4096;
+    ha->hashes = malloc(ha->cap * sizeof *ha->hashes);
+    return ha->hashes ? 0 : -1;
+}
+
+void hash_audit_free(struct hash_audit *ha) {
+    free(ha->hashes);
+    ha->hashes = NULL;
+}
+
+int hash_audit_add(struct hash_audit *ha, uint32_t hash) {
+    if (ha->count == ha->cap) {
+        uint32_t *hashes = realloc(ha->hashes, ha->cap * 2 * sizeof *hashes);
+
+        if (!hashes) {
+            return -1;
+        }
+        ha->hashes = hashes;
+        ha->cap *= 2;
+    }
+
+    ha->hashes[ha->count++] = hash;
+    return 0;
+}
+
+int hash_audit_replay(const struct hash_audit *ha, unsigned long size, struct hash_audit_result *result) {
+    unsigned long *counts;
+    double mean;
+    double sumsq = 0;
+
+    counts = calloc(size, sizeof *counts);
+    if (!counts) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < ha->count; i++) {
+        counts[ha->hashes[i] % size]++;
+    }
+
+    mean = (double)ha->count / size;
+    result->size = size;
+    result->mean = mean;
+    result->max = 0;
+    for (unsigned long b = 0; b < size; b++) {
+        double d = counts[b] - mean;
+
+        sumsq += d * d;
+        if (counts[b] > result->max) {
+            result->max = counts[b];
+        }
+    }
+
+    result->cv = mean > 0 ? sqrt(sumsq / size) / mean : 0;
+    result->chi2 = mean > 0 && size > 1 ? sumsq / mean / (size - 1) : 0;
+
+    free(counts);
+    return 0;
+}
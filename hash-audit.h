@@ -0,0 +1,34 @@
+#ifndef HASH_AUDIT_H
+#define HASH_AUDIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Replays the kernel's bucket placement of nfslockhash for other table sizes.
+// The hash of every handle seen in the walk is kept, four bytes per entry, and
+// for each candidate size the entries are redistributed with the kernel's
+// hash % size. This shows what raising vfs.nfsd.fhhashsize would do to the
+// chain lengths of the current population, including any skew of the hash.
+
+struct hash_audit {
+    uint32_t *hashes;
+    size_t count;
+    size_t cap;
+};
+
+struct hash_audit_result {
+    unsigned long size;
+    double mean;            // Expected chain length, and so compares per miss
+    unsigned long max;      // Worst-case chain length
+    double cv;              // Coefficient of variation of the chain lengths
+    double chi2;            // Chi-squared against a uniform spread, per degree of freedom
+};
+
+int hash_audit_init(struct hash_audit *ha);
+void hash_audit_free(struct hash_audit *ha);
+int hash_audit_add(struct hash_audit *ha, uint32_t hash);
+
+// Distributes every recorded hash over size buckets.
+int hash_audit_replay(const struct hash_audit *ha, unsigned long size, struct hash_audit_result *result);
+
+#endif
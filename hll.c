@@ -0,0 +1,65 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "hll.h"
+
+int hll_init(struct hll *h, int precision) {
+    if (precision < 4 || precision > 18) {
+        return -1;
+    }
+
+    h->precision = precision;
+    h->nregisters = 1u << precision;
+    h->registers = calloc(h->nregisters, 1);
+    return h->registers ? 0 : -1;
+}
+
+void hll_free(struct hll *h) {
+    free(h->registers);
+    h->registers = NULL;
+}
+
+void hll_add(struct hll *h, uint64_t hash) {
+    uint32_t index = hash >> (64 - h->precision);
+    uint64_t rest = hash << h->precision;
+    uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - h->precision + 1;
+
+    if (rank > h->registers[index]) {
+        h->registers[index] = rank;
+    }
+}
+
+double hll_estimate(const struct hll *h) {
+    double m = h->nregisters;
+    double alpha = 0.7213 / (1 + 1.079 / m);
+    double sum = 0;
+    uint32_t zeros = 0;
+    double estimate;
+
+    for (uint32_t i = 0; i < h->nregisters; i++) {
+        sum += ldexp(1.0, -h->registers[i]);
+        zeros += h->registers[i] == 0;
+    }
+
+    estimate = alpha * m * m / sum;
+
+    // Small cardinalities are estimated better by linear counting. With
+    // 64-bit hashes no correction is needed at the top of the range.
+    if (estimate <= 2.5 * m && zeros) {
+        estimate = m * log(m / zeros);
+    }
+
+    return estimate;
+}
+
+double hll_error(const struct hll *h) {
+    return 1.04 / sqrt(h->nregisters);
+}
+
+void hll_merge(struct hll *dst, const struct hll *src) {
+    for (uint32_t i = 0; i < dst->nregisters; i++) {
+        if (src->registers[i] > dst->registers[i]) {
+            dst->registers[i] = src->registers[i];
+        }
+    }
+}
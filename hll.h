@@ -0,0 +1,29 @@
+#ifndef HLL_H
+#define HLL_H
+
+#include <stdint.h>
+
+// HyperLogLog cardinality estimate over 64-bit hashes. With 2^p registers of
+// one byte each, the standard error of the estimate is 1.04 / sqrt(2^p), so
+// the default of p = 14 uses 16KB and is accurate to about 0.8%.
+
+#define HLL_DEFAULT_PRECISION 14
+
+struct hll {
+    int precision;
+    uint32_t nregisters;
+    uint8_t *registers;
+};
+
+int hll_init(struct hll *h, int precision);
+void hll_free(struct hll *h);
+void hll_add(struct hll *h, uint64_t hash);
+double hll_estimate(const struct hll *h);
+
+// Relative standard error of the estimate.
+double hll_error(const struct hll *h);
+
+// Folds the registers of src into dst, which must have the same precision.
+void hll_merge(struct hll *dst, const struct hll *src);
+
+#endif
@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kvm-reader.h"
+
+int kreader_init(struct kreader *kr, kvm_t *kd) {
+    memset(kr, 0, sizeof *kr);
+    kr->kd = kd;
+    kr->page_size = getpagesize();
+
+    // A group starts on one page but its last request may run onto the next.
+    kr->buf = malloc(2 * kr->page_size);
+    if (!kr->buf) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void kreader_free(struct kreader *kr) {
+    free(kr->buf);
+    free(kr->pending);
+    free(kr->cache.pages);
+    free(kr->cache.mem);
+    free(kr->cache.hash);
+    kr->buf = NULL;
+    kr->pending = NULL;
+    memset(&kr->cache, 0, sizeof kr->cache);
+}
+
+int kreader_set_cache(struct kreader *kr, int npages) {
+    struct kcache *c = &kr->cache;
+
+    if (npages <= 0) {
+        return 0;
+    }
+
+    c->npages = npages;
+    c->hashsize = 1;
+    while (c->hashsize < npages) {
+        c->hashsize <<= 1;
+    }
+
+    c->pages = calloc(npages, sizeof *c->pages);
+    c->mem = malloc((size_t)npages * kr->page_size);
+    c->hash = malloc(c->hashsize * sizeof *c->hash);
+    if (!c->pages || !c->mem || !c->hash) {
+        return -1;
+    }
+
+    for (int i = 0; i < c->hashsize; i++) {
+        c->hash[i] = -1;
+    }
+    c->head = -1;
+    c->tail = -1;
+
+    return 0;
+}
+
+static unsigned int page_hash(struct kreader *kr, unsigned long addr) {
+    unsigned long pfn = addr / kr->page_size;
+
+    return (unsigned int)((pfn * 0x9e3779b97f4a7c15UL) >> 32) & (kr->cache.hashsize - 1);
+}
+
+static void lru_unlink(struct kcache *c, int i) {
+    struct kpage *p = &c->pages[i];
+
+    if (p->prev >= 0) {
+        c->pages[p->prev].next = p->next;
+    } else {
+        c->head = p->next;
+    }
+    if (p->next >= 0) {
+        c->pages[p->next].prev = p->prev;
+    } else {
+        c->tail = p->prev;
+    }
+}
+
+static void lru_push(struct kcache *c, int i) {
+    struct kpage *p = &c->pages[i];
+
+    p->prev = -1;
+    p->next = c->head;
+    if (c->head >= 0) {
+        c->pages[c->head].prev = i;
+    } else {
+        c->tail = i;
+    }
+    c->head = i;
+}
+
+static void hash_remove(struct kreader *kr, int i) {
+    struct kcache *c = &kr->cache;
+    int *link = &c->hash[page_hash(kr, c->pages[i].addr)];
+
+    while (*link != i) {
+        link = &c->pages[*link].hnext;
+    }
+    *link = c->pages[i].hnext;
+}
+
+// Returns the cached copy of the page at addr, fetching it on a miss and
+// evicting the least recently used page if the cache is full.
+static char *cache_page(struct kreader *kr, unsigned long addr) {
+    struct kcache *c = &kr->cache;
+    unsigned int h = page_hash(kr, addr);
+    int i;
+
+    for (i = c->hash[h]; i >= 0; i = c->pages[i].hnext) {
+        if (c->pages[i].addr == addr) {
+            c->hits++;
+            if (c->head != i) {
+                lru_unlink(c, i);
+                lru_push(c, i);
+            }
+            return c->pages[i].data;
+        }
+    }
+
+    // Fetch into the scratch buffer first so a failed read leaves the cache
+    // untouched.
+    c->misses++;
+    if (kvm_read(kr->kd, addr, kr->buf, kr->page_size) != (ssize_t)kr->page_size) {
+        return NULL;
+    }
+    kr->pages_fetched++;
+    kr->bytes_fetched += kr->page_size;
+
+    if (c->used < c->npages) {
+        i = c->used++;
+        c->pages[i].data = c->mem + (size_t)i * kr->page_size;
+    } else {
+        i = c->tail;
+        lru_unlink(c, i);
+        hash_remove(kr, i);
+        c->evictions++;
+    }
+
+    memcpy(c->pages[i].data, kr->buf, kr->page_size);
+    c->pages[i].addr = addr;
+    c->pages[i].hnext = c->hash[h];
+    c->hash[h] = i;
+    lru_push(c, i);
+
+    return c->pages[i].data;
+}
+
+int kreader_add(struct kreader *kr, unsigned long addr, void *dst, size_t len) {
+    if (kr->npending == kr->cap) {
+        int cap = kr->cap ? kr->cap * 2 : 64;
+        struct kreq *pending = realloc(kr->pending, cap * sizeof *pending);
+
+        if (!pending) {
+            return -1;
+        }
+        kr->pending = pending;
+        kr->cap = cap;
+    }
+
+    kr->pending[kr->npending++] = (struct kreq) {.addr = addr, .len = len, .dst = dst};
+    return 0;
+}
+
+static int compare_kreq(const void *a, const void *b) {
+    const struct kreq *ra = a;
+    const struct kreq *rb = b;
+
+    return (ra->addr > rb->addr) - (ra->addr < rb->addr);
+}
+
+// Serves a single request out of the page cache, one page at a time.
+static int read_cached(struct kreader *kr, struct kreq *r) {
+    unsigned long mask = ~(unsigned long)(kr->page_size - 1);
+    unsigned long addr = r->addr;
+    char *dst = r->dst;
+    size_t left = r->len;
+
+    while (left > 0) {
+        unsigned long page = addr & mask;
+        size_t off = addr - page;
+        size_t n = kr->page_size - off < left ? kr->page_size - off : left;
+        char *data = cache_page(kr, page);
+
+        if (!data) {
+            return -1;
+        }
+        memcpy(dst, data + off, n);
+        dst += n;
+        addr += n;
+        left -= n;
+    }
+
+    kr->structs_served++;
+    return 0;
+}
+
+// Reads the requests in [first, last) which all start on the same page.
+static int read_group(struct kreader *kr, struct kreq *first, struct kreq *last) {
+    unsigned long start = first->addr;
+    unsigned long end = start;
+    ssize_t rc;
+
+    if (kr->cache.npages > 0) {
+        for (struct kreq *r = first; r < last; r++) {
+            if (read_cached(kr, r) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    for (struct kreq *r = first; r < last; r++) {
+        if (r->addr + r->len > end) {
+            end = r->addr + r->len;
+        }
+    }
+
+    // Only requests larger than a page can overflow the buffer. Read those
+    // directly rather than sizing the buffer for the worst case.
+    if (end - start > 2 * kr->page_size) {
+        for (struct kreq *r = first; r < last; r++) {
+            rc = kvm_read(kr->kd, r->addr, r->dst, r->len);
+            if (rc != (ssize_t)r->len) {
+                return -1;
+            }
+            kr->pages_fetched++;
+            kr->bytes_fetched += r->len;
+            kr->structs_served++;
+        }
+        return 0;
+    }
+
+    rc = kvm_read(kr->kd, start, kr->buf, end - start);
+    if (rc != (ssize_t)(end - start)) {
+        return -1;
+    }
+    kr->pages_fetched++;
+    kr->bytes_fetched += end - start;
+
+    for (struct kreq *r = first; r < last; r++) {
+        memcpy(r->dst, kr->buf + (r->addr - start), r->len);
+        kr->structs_served++;
+    }
+
+    return 0;
+}
+
+int kreader_flush(struct kreader *kr) {
+    unsigned long mask = ~(unsigned long)(kr->page_size - 1);
+    int rc = 0;
+    int i = 0;
+
+    qsort(kr->pending, kr->npending, sizeof *kr->pending, compare_kreq);
+
+    while (i < kr->npending) {
+        unsigned long page = kr->pending[i].addr & mask;
+        int j = i + 1;
+
+        while (j < kr->npending && (kr->pending[j].addr & mask) == page) {
+            j++;
+        }
+
+        if (read_group(kr, &kr->pending[i], &kr->pending[j]) < 0) {
+            rc = -1;
+            break;
+        }
+        i = j;
+    }
+
+    kr->npending = 0;
+    return rc;
+}
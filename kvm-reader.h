@@ -0,0 +1,81 @@
+#ifndef KVM_READER_H
+#define KVM_READER_H
+
+#include <stddef.h>
+
+#include <kvm.h>
+
+// A batched reader for kernel memory. Callers queue the copies they need with
+// kreader_add() and then service them all with kreader_flush(). Pending reads
+// are sorted and grouped by the kernel page they start on, and each group is
+// fetched with a single kvm_read covering all of its requests. Individual
+// copies are then served out of that buffer.
+//
+// Optionally, whole pages can be kept in a bounded LRU cache keyed by kernel
+// page address. With the cache enabled every fetch reads a full page, and
+// later requests touching the same page are served without calling into
+// libkvm again, including requests from later passes over the table.
+
+struct kreq {
+    unsigned long addr;
+    size_t len;
+    void *dst;
+};
+
+struct kpage {
+    unsigned long addr;
+    char *data;
+    int prev;       // LRU neighbours, most recently used first
+    int next;
+    int hnext;      // Next page in the same hash bucket
+};
+
+struct kcache {
+    struct kpage *pages;
+    char *mem;
+    int npages;     // Capacity in pages
+    int used;
+    int *hash;
+    int hashsize;
+    int head;       // Most recently used
+    int tail;       // Least recently used
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+struct kreader {
+    kvm_t *kd;
+    size_t page_size;
+    char *buf;
+
+    struct kreq *pending;
+    int npending;
+    int cap;
+
+    // Statistics: kvm_read calls issued for page groups, bytes those calls
+    // transferred, and the number of individual copies served from them.
+    unsigned long pages_fetched;
+    unsigned long bytes_fetched;
+    unsigned long structs_served;
+
+    struct kcache cache;
+};
+
+int kreader_init(struct kreader *kr, kvm_t *kd);
+void kreader_free(struct kreader *kr);
+
+// Enables a page cache holding at most npages pages. A size of zero leaves
+// the cache disabled.
+int kreader_set_cache(struct kreader *kr, int npages);
+
+// Queues a copy of len bytes at kernel address addr into dst. The copy is not
+// performed until the next kreader_flush().
+int kreader_add(struct kreader *kr, unsigned long addr, void *dst, size_t len);
+
+// Performs every queued copy. Returns -1 if any of them could not be read, in
+// which case kvm_geterr() describes the failure.
+int kreader_flush(struct kreader *kr);
+
+#endif
@@ -0,0 +1,578 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <kvm.h>
+
+#include "kvm-reader.h"
+#include "lockfile.h"
+#include "lockfile-scan.h"
+
+// The position of a single bucket chain in the frontier.
+struct chain {
+    int bucket;
+    unsigned long cur;
+    unsigned long prevlink;
+    unsigned long len;
+
+    // Brent's cycle detection: the saved node, the current power of two and
+    // the number of steps taken since the node was saved.
+    unsigned long tortoise;
+    unsigned long power;
+    unsigned long lam;
+};
+
+struct worker {
+    pthread_t thread;
+    struct scan *scan;
+    kvm_t *kd;
+    struct kreader reader;
+
+    unsigned long visited;
+    unsigned long matched;
+    unsigned long matched_lost;
+};
+
+#define CURSOR_MAGIC "nfs-lockfile-counter cursor 1"
+
+int scan_alloc(struct scan *scan, int hashsize) {
+    scan->hashsize = hashsize;
+    scan->heads = calloc(hashsize, sizeof *scan->heads);
+    scan->order = calloc(hashsize, sizeof *scan->order);
+    scan->chain_len = calloc(hashsize, sizeof *scan->chain_len);
+    scan->bucket_lost = calloc(hashsize, sizeof *scan->bucket_lost);
+    scan->complete = calloc(hashsize, sizeof *scan->complete);
+    scan->next = calloc(hashsize, sizeof *scan->next);
+    scan->prevlink = calloc(hashsize, sizeof *scan->prevlink);
+    scan->damage = calloc(hashsize, sizeof *scan->damage);
+    if (!scan->heads || !scan->order || !scan->chain_len || !scan->bucket_lost || !scan->complete ||
+        !scan->next || !scan->prevlink || !scan->damage) {
+        return -1;
+    }
+
+    for (int bucket = 0; bucket < hashsize; bucket++) {
+        scan->order[bucket] = bucket;
+    }
+
+    return 0;
+}
+
+void scan_free(struct scan *scan) {
+    free(scan->heads);
+    free(scan->order);
+    free(scan->chain_len);
+    free(scan->bucket_lost);
+    free(scan->complete);
+    free(scan->next);
+    free(scan->prevlink);
+    free(scan->damage);
+}
+
+// Claims the next unfinished, non-empty bucket from the shared cursor and
+// places it in the given frontier slot, continuing from its saved position if
+// it has one. Returns 0 once every bucket has been claimed.
+static int claim_bucket(struct scan *scan, struct chain *c) {
+    int i;
+
+    while ((i = atomic_fetch_add(&scan->cursor, 1)) < scan->hashsize) {
+        int bucket = scan->order[i];
+
+        if (scan->complete[bucket]) {
+            continue;
+        }
+
+        if (scan->next[bucket]) {
+            c->bucket = bucket;
+            c->cur = scan->next[bucket];
+            c->prevlink = scan->prevlink[bucket];
+            c->len = scan->chain_len[bucket];
+        } else if (scan->heads[bucket]) {
+            c->bucket = bucket;
+            c->cur = scan->heads[bucket];
+            c->prevlink = scan->table + bucket * scan->desc->bucket_stride + scan->desc->head_offset;
+            c->len = 0;
+        } else {
+            scan->chain_len[bucket] = 0;
+            scan->complete[bucket] = 1;
+            continue;
+        }
+
+        c->tortoise = c->cur;
+        c->power = 1;
+        c->lam = 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Records how far a chain got once the worker stops walking it.
+static void finish_chain(struct scan *scan, struct chain *c, int complete) {
+    scan->chain_len[c->bucket] = c->len;
+    scan->complete[c->bucket] = complete;
+    scan->next[c->bucket] = complete ? 0 : c->cur;
+    scan->prevlink[c->bucket] = complete ? 0 : c->prevlink;
+}
+
+// Reserves up to want nodes from the scan's budget and returns how many may
+// be visited this round. Zero means the budget is spent.
+static int reserve_nodes(struct scan *scan, int want) {
+    struct timespec now;
+    unsigned long before;
+
+    if (scan->max_time > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > scan->deadline.tv_sec ||
+            (now.tv_sec == scan->deadline.tv_sec && now.tv_nsec >= scan->deadline.tv_nsec)) {
+            atomic_store(&scan->expired, 1);
+            return 0;
+        }
+    }
+
+    if (scan->max_nodes == 0) {
+        return want;
+    }
+
+    before = atomic_fetch_add(&scan->visited, want);
+    if (before >= scan->max_nodes) {
+        atomic_store(&scan->expired, 1);
+        return 0;
+    }
+    if (before + want > scan->max_nodes) {
+        return scan->max_nodes - before;
+    }
+    return want;
+}
+
+// Advances the cycle detector by one step to the chain's new current node.
+// Returns 1 if the chain has revisited a node.
+static int brent_step(struct chain *c) {
+    if (c->cur == c->tortoise) {
+        return 1;
+    }
+
+    if (++c->lam == c->power) {
+        c->tortoise = c->cur;
+        c->power <<= 1;
+        c->lam = 0;
+    }
+
+    return 0;
+}
+
+// Retries the reads of a round one node at a time after the batched read
+// failed, so that a single bad pointer only ends its own chain. Chains whose
+// node cannot be read are marked and dropped. Returns the new frontier size.
+static int read_each(struct worker *w, struct chain *frontier, int count, char *raw, size_t span_off,
+                     size_t span_len) {
+    struct scan *scan = w->scan;
+    int live = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct chain *c = &frontier[i];
+
+        if (kreader_add(&w->reader, c->cur + span_off, raw + live * span_len, span_len) < 0 ||
+            kreader_flush(&w->reader) < 0) {
+            scan->damage[c->bucket] |= BUCKET_UNREADABLE;
+            finish_chain(scan, c, 1);
+            continue;
+        }
+        frontier[live++] = *c;
+    }
+
+    return live;
+}
+
+static int walk(struct worker *w, int width) {
+    struct scan *scan = w->scan;
+    unsigned int fields = scan->fields | LF_BIT(LF_HASH_NEXT) | LF_BIT(LF_HASH_PREV) | scan->desc->idle_fields;
+    struct chain *frontier;
+    struct lf_node *nodes;
+    char *raw;
+    size_t span_off;
+    size_t span_len;
+    int frontier_size = 0;
+    int rc = 0;
+
+    lf_layout_span(scan->layout, fields, &span_off, &span_len);
+
+    frontier = calloc(width, sizeof *frontier);
+    nodes = calloc(width, sizeof *nodes);
+    raw = calloc(width, span_len);
+    if (!frontier || !nodes || !raw) {
+        fprintf(stderr, "Failed to allocate frontier of %d chains\n", width);
+        rc = -1;
+        goto out;
+    }
+
+    while (frontier_size < width && claim_bucket(scan, &frontier[frontier_size])) {
+        frontier_size++;
+    }
+
+    while (frontier_size > 0 && !atomic_load(&scan->failed)) {
+        int allowed = reserve_nodes(scan, frontier_size);
+        int live = 0;
+        int round;
+
+        // Chains beyond what the budget allows are left where they are.
+        if (allowed < frontier_size) {
+            for (int i = allowed; i < frontier_size; i++) {
+                finish_chain(scan, &frontier[i], 0);
+            }
+            frontier_size = allowed;
+            if (frontier_size == 0) {
+                break;
+            }
+        }
+
+        for (int i = 0; i < frontier_size; i++) {
+            if (kreader_add(&w->reader, frontier[i].cur + span_off, raw + i * span_len, span_len) < 0) {
+                fprintf(stderr, "Failed to queue lockfile read\n");
+                rc = -1;
+                goto out;
+            }
+        }
+
+        if (kreader_flush(&w->reader) < 0) {
+            frontier_size = read_each(w, frontier, frontier_size, raw, span_off, span_len);
+        }
+        round = 0;
+
+        for (int i = 0; i < frontier_size; i++) {
+            struct lf_node *node = &nodes[round];
+            struct chain *c = &frontier[i];
+            int lost = lf_layout_zero(scan->layout, scan->desc->idle_fields, raw + i * span_len, span_off);
+            unsigned long limit = scan->limit ? scan->limit[c->bucket] : 0;
+
+            memset(node, 0, sizeof *node);
+            lf_decode(scan->layout, fields, raw + i * span_len, span_off, node);
+            node->addr = c->cur;
+            node->bucket = c->bucket;
+
+            w->visited++;
+            c->len++;
+
+            if (node->prev != c->prevlink) {
+                scan->damage[c->bucket] |= BUCKET_BAD_LINK;
+            }
+
+            if (lost) {
+                scan->bucket_lost[c->bucket]++;
+            }
+
+            // Only the nodes that pass the filter are kept for the visit.
+            if (!scan->filter || filter_match(scan->filter, node)) {
+                w->matched++;
+                w->matched_lost += lost;
+                round++;
+            }
+
+            // Advance the chain, ending it when it runs out, loops, reaches
+            // its sampling limit or grows past the bound on chain length.
+            c->prevlink = c->cur + scan->layout->fields[LF_HASH_NEXT].off;
+            c->cur = node->next;
+            if (!c->cur) {
+                finish_chain(scan, c, 1);
+                continue;
+            }
+            if (brent_step(c)) {
+                scan->damage[c->bucket] |= BUCKET_CYCLE;
+                finish_chain(scan, c, 1);
+                continue;
+            }
+            if (scan->max_chain && c->len >= scan->max_chain) {
+                scan->damage[c->bucket] |= BUCKET_TOO_LONG;
+                finish_chain(scan, c, 1);
+                continue;
+            }
+            if (limit && c->len >= limit) {
+                finish_chain(scan, c, 0);
+                continue;
+            }
+            frontier[live++] = *c;
+        }
+
+        if (scan->visit && round > 0) {
+            pthread_mutex_lock(&scan->visit_lock);
+            for (int i = 0; i < round && rc == 0; i++) {
+                if (scan->visit(&nodes[i], scan->visit_arg) != 0) {
+                    rc = -1;
+                }
+            }
+            pthread_mutex_unlock(&scan->visit_lock);
+            if (rc < 0) {
+                goto out;
+            }
+        }
+
+        // Refill the slots of the chains that ended with unclaimed buckets.
+        while (live < width && claim_bucket(scan, &frontier[live])) {
+            live++;
+        }
+
+        frontier_size = live;
+
+        if (atomic_load(&scan->expired)) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < frontier_size; i++) {
+        finish_chain(scan, &frontier[i], 0);
+    }
+
+out:
+    free(frontier);
+    free(nodes);
+    free(raw);
+    return rc;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    struct scan *scan = w->scan;
+    int width = (scan->hashsize + scan->nworkers - 1) / scan->nworkers;
+
+    if (walk(w, width) < 0) {
+        atomic_store(&scan->failed, 1);
+    }
+
+    return NULL;
+}
+
+int scan_run(struct scan *scan) {
+    char errbuf[_POSIX2_LINE_MAX];
+    struct worker *workers;
+    int started = 0;
+    int rc = 0;
+
+    atomic_init(&scan->cursor, 0);
+    atomic_init(&scan->failed, 0);
+    atomic_init(&scan->expired, 0);
+    atomic_init(&scan->visited, 0);
+    pthread_mutex_init(&scan->visit_lock, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &scan->deadline);
+    scan->deadline.tv_sec += (time_t)scan->max_time;
+    scan->deadline.tv_nsec += (long)((scan->max_time - (time_t)scan->max_time) * 1e9);
+    if (scan->deadline.tv_nsec >= 1000000000L) {
+        scan->deadline.tv_sec++;
+        scan->deadline.tv_nsec -= 1000000000L;
+    }
+
+    workers = calloc(scan->nworkers, sizeof *workers);
+    if (!workers) {
+        fprintf(stderr, "Failed to allocate %d workers\n", scan->nworkers);
+        return -1;
+    }
+
+    for (int i = 0; i < scan->nworkers; i++) {
+        struct worker *w = &workers[i];
+
+        w->scan = scan;
+        w->kd = kvm_openfiles(NULL, NULL, NULL, O_RDONLY, &errbuf[0]);
+        if (!w->kd) {
+            fprintf(stderr, "Failed to open files for KVM: %s\n", errbuf);
+            rc = -1;
+            break;
+        }
+
+        if (kreader_init(&w->reader, w->kd) < 0 || kreader_set_cache(&w->reader, scan->cache_pages) < 0) {
+            fprintf(stderr, "Failed to allocate reader for worker %d\n", i);
+            kvm_close(w->kd);
+            rc = -1;
+            break;
+        }
+
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            fprintf(stderr, "Failed to start worker %d\n", i);
+            kreader_free(&w->reader);
+            kvm_close(w->kd);
+            rc = -1;
+            break;
+        }
+        started++;
+    }
+
+    if (rc < 0) {
+        atomic_store(&scan->failed, 1);
+    }
+
+    for (int i = 0; i < started; i++) {
+        struct worker *w = &workers[i];
+
+        pthread_join(w->thread, NULL);
+
+        scan->visited_nodes += w->visited;
+        scan->matched += w->matched;
+        scan->matched_lost += w->matched_lost;
+        scan->pages_fetched += w->reader.pages_fetched;
+        scan->bytes_fetched += w->reader.bytes_fetched;
+        scan->structs_served += w->reader.structs_served;
+        scan->cache_hits += w->reader.cache.hits;
+        scan->cache_misses += w->reader.cache.misses;
+        scan->cache_evictions += w->reader.cache.evictions;
+
+        kreader_free(&w->reader);
+        kvm_close(w->kd);
+    }
+
+    free(workers);
+    pthread_mutex_destroy(&scan->visit_lock);
+
+    scan->stopped = atomic_load(&scan->expired);
+    scan->total = 0;
+    scan->leaked = 0;
+    for (int bucket = 0; bucket < scan->hashsize; bucket++) {
+        scan->total += scan->chain_len[bucket];
+        scan->leaked += scan->bucket_lost[bucket];
+    }
+
+    if (atomic_load(&scan->failed)) {
+        return -1;
+    }
+    return rc;
+}
+
+int scan_read_heads(struct scan *scan, kvm_t *kd) {
+    size_t len = (size_t)scan->hashsize * scan->desc->bucket_stride;
+    char *buckets;
+
+    // The buckets are contiguous, so they can all be read at once. Each holds
+    // a LIST_HEAD, a single pointer to the first entry of the chain.
+    buckets = malloc(len);
+    if (!buckets) {
+        fprintf(stderr, "Failed to allocate %d buckets\n", scan->hashsize);
+        return -1;
+    }
+
+    if (kvm_read(kd, scan->table, buckets, len) != (ssize_t)len) {
+        fprintf(stderr, "Failed to read bucket pointers: %s\n", kvm_geterr(kd));
+        free(buckets);
+        return -1;
+    }
+
+    for (int bucket = 0; bucket < scan->hashsize; bucket++) {
+        memcpy(&scan->heads[bucket], buckets + bucket * scan->desc->bucket_stride + scan->desc->head_offset,
+               sizeof scan->heads[bucket]);
+    }
+
+    free(buckets);
+    return 0;
+}
+
+int scan_complete_buckets(const struct scan *scan) {
+    int count = 0;
+
+    for (int bucket = 0; bucket < scan->hashsize; bucket++) {
+        count += scan->complete[bucket];
+    }
+
+    return count;
+}
+
+int scan_save_cursor(const struct scan *scan, const char *path) {
+    FILE *f;
+
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to write cursor %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "%s\n", CURSOR_MAGIC);
+    fprintf(f, "layout %s\n", scan->layout->name);
+    fprintf(f, "table %#lx %d\n", scan->table, scan->hashsize);
+    for (int bucket = 0; bucket < scan->hashsize; bucket++) {
+        fprintf(f, "bucket %d %d %#lx %#lx %lu %lu\n", bucket, scan->complete[bucket],
+                scan->next[bucket], scan->prevlink[bucket], scan->chain_len[bucket], scan->bucket_lost[bucket]);
+    }
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Failed to write cursor %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int scan_load_cursor(struct scan *scan, const char *path) {
+    char magic[64];
+    char layout[64];
+    unsigned long table;
+    int hashsize;
+    int bucket;
+    int complete;
+    unsigned long next;
+    unsigned long prevlink;
+    unsigned long len;
+    unsigned long lost;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "Failed to open cursor %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (!fgets(magic, sizeof magic, f) || strncmp(magic, CURSOR_MAGIC, strlen(CURSOR_MAGIC)) != 0 ||
+        fscanf(f, "layout %63s table %lx %d", layout, &table, &hashsize) != 3) {
+        fprintf(stderr, "%s is not a scan cursor\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    if (strcmp(layout, scan->layout->name) != 0 || table != scan->table || hashsize != scan->hashsize) {
+        fprintf(stderr, "Cursor %s was written for a different table (layout %s, table %#lx, %d buckets)\n",
+                path, layout, table, hashsize);
+        fclose(f);
+        return -1;
+    }
+
+    while (fscanf(f, " bucket %d %d %lx %lx %lu %lu", &bucket, &complete, &next, &prevlink, &len, &lost) == 6) {
+        if (bucket < 0 || bucket >= hashsize) {
+            continue;
+        }
+        scan->complete[bucket] = complete != 0;
+        scan->next[bucket] = next;
+        scan->prevlink[bucket] = prevlink;
+        scan->chain_len[bucket] = len;
+        scan->bucket_lost[bucket] = lost;
+    }
+
+    fclose(f);
+    return 1;
+}
+
+int scan_validate_cursor(struct scan *scan, kvm_t *kd) {
+    size_t off = scan->layout->fields[LF_HASH_PREV].off;
+    int restarted = 0;
+
+    for (int bucket = 0; bucket < scan->hashsize; bucket++) {
+        unsigned long le_prev;
+
+        if (scan->complete[bucket] || !scan->next[bucket]) {
+            continue;
+        }
+
+        // The node was freed or relinked since the cursor was written, so the
+        // counts for the part already walked no longer describe the chain. A
+        // freed node may also sit on a page that is no longer mapped.
+        if (kvm_read(kd, scan->next[bucket] + off, &le_prev, sizeof le_prev) != sizeof le_prev ||
+            le_prev != scan->prevlink[bucket]) {
+            scan->next[bucket] = 0;
+            scan->prevlink[bucket] = 0;
+            scan->chain_len[bucket] = 0;
+            scan->bucket_lost[bucket] = 0;
+            restarted++;
+        }
+    }
+
+    return restarted;
+}
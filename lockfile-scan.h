@@ -0,0 +1,138 @@
+#ifndef LOCKFILE_SCAN_H
+#define LOCKFILE_SCAN_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <kvm.h>
+
+#include "filter.h"
+#include "lockfile.h"
+#include "state-tables.h"
+
+// A scan of one of the server's state tables, nfslockhash unless `desc` says
+// otherwise, shared by all of its worker threads.
+//
+// The table is walked breadth first. Each worker keeps a frontier holding the
+// current node of up to `width` bucket chains and reads the whole frontier as
+// one batch per round before advancing every chain by one step. When a chain
+// ends, the worker claims the next bucket from the shared cursor into `order`,
+// so buckets listed first are started first. Each worker opens its own kvm_t,
+// as libkvm descriptors are not safe to share between threads.
+//
+// Only the byte range of each node that covers `fields` is read, using the
+// offsets from `layout`. The walk itself always needs the hash links and the
+// idle fields of `desc`, which for lockfiles make up LF_FIELDS_WALK. An entry
+// whose idle fields are all zero is counted as lost.
+//
+// A walk can be bounded. A bucket with a non-zero entry in `limit` is walked
+// for at most that many nodes, and the whole scan stops once `max_nodes`
+// nodes have been visited or `max_time` seconds have passed. Buckets that were
+// not walked to the end of their chain are left with `complete` unset.
+//
+// Every bucket carries its own position: `next` is the node the chain stopped
+// at, and `prevlink` is the kernel address of the pointer that linked to it.
+// A bucket with a position set is continued from there rather than from its
+// head, and its counts are added to. This lets a bounded scan be saved as a
+// cursor with scan_save_cursor() and resumed by a later run.
+//
+// The kernel keeps modifying the table while it is read, so the links cannot
+// be trusted. Every chain is checked for cycles with Brent's algorithm, which
+// needs only a saved node and two counters per chain, and is cut off after
+// `max_chain` nodes. A node that cannot be read ends its chain rather than the
+// scan. The problems found are recorded per bucket in `damage`.
+//
+// With a `filter`, each worker tests every node as soon as it is decoded, and
+// only the nodes that match are passed on to `visit`. The chains are still
+// walked and counted in full, but the serialised visit stage, and whatever
+// analyses and output hang off it, only sees the nodes asked for.
+#define BUCKET_CYCLE 0x01       // The chain loops back on itself
+#define BUCKET_TOO_LONG 0x02    // The chain was cut off after max_chain nodes
+#define BUCKET_UNREADABLE 0x04  // A node in the chain could not be read
+#define BUCKET_BAD_LINK 0x08    // A node's le_prev did not point back at its predecessor
+
+struct scan {
+    // Set up by the caller before scan_run().
+    int hashsize;
+    const struct state_table *desc;
+    unsigned long table;    // Kernel address of the bucket array
+    unsigned long *heads;   // Bucket heads, read before the scan starts
+    int *order;             // Order in which buckets are claimed
+    int nworkers;
+    int cache_pages;
+    const struct lf_layout *layout;
+    unsigned int fields;
+    unsigned long *limit;   // Optional, per bucket; zero means unlimited
+    unsigned long max_nodes;
+    double max_time;
+    unsigned long max_chain;    // Zero means unlimited
+    const struct filter *filter;    // Optional; its fields must be in `fields`
+
+    // Called for every node visited, with LF_FIELDS_WALK and `fields`
+    // decoded. Calls are serialised across workers one frontier round at a
+    // time, so the callback needs no locking of its own. A non-zero return
+    // stops the scan.
+    int (*visit)(const struct lf_node *node, void *arg);
+    void *visit_arg;
+
+    // Filled in by scan_run(), or carried over from a cursor. Each bucket is
+    // walked by exactly one worker, which records its progress.
+    unsigned long *chain_len;
+    unsigned long *bucket_lost;
+    unsigned char *complete;
+    unsigned long *next;
+    unsigned long *prevlink;
+    unsigned char *damage;
+    unsigned long total;    // Sums over every bucket, including earlier runs
+    unsigned long leaked;
+    unsigned long visited_nodes;    // Nodes read by this run
+    unsigned long matched;          // Nodes of this run that passed the filter
+    unsigned long matched_lost;
+    int stopped;            // Set if max_nodes or max_time ended the scan
+
+    unsigned long pages_fetched;
+    unsigned long bytes_fetched;
+    unsigned long structs_served;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long cache_evictions;
+
+    atomic_int cursor;
+    atomic_int failed;
+    atomic_int expired;
+    atomic_ulong visited;
+    struct timespec deadline;
+    pthread_mutex_t visit_lock;
+};
+
+// Allocates the per-bucket result arrays for a table of hashsize buckets.
+int scan_alloc(struct scan *scan, int hashsize);
+void scan_free(struct scan *scan);
+
+// Walks every bucket of the table with scan->nworkers threads and merges their
+// totals into scan. Returns -1 if any worker failed, after reporting why.
+int scan_run(struct scan *scan);
+
+// Reads the bucket heads of the table at scan->table into scan->heads.
+int scan_read_heads(struct scan *scan, kvm_t *kd);
+
+// Returns the number of buckets that have been walked to the end.
+int scan_complete_buckets(const struct scan *scan);
+
+// Writes the progress of every bucket to path, so an incomplete scan can be
+// continued with scan_load_cursor().
+int scan_save_cursor(const struct scan *scan, const char *path);
+
+// Loads a cursor written by scan_save_cursor(). Returns 1 if one was loaded,
+// 0 if path does not exist, and -1 if it is unreadable or was written for a
+// different table or layout.
+int scan_load_cursor(struct scan *scan, const char *path);
+
+// Checks that every partially walked bucket of a loaded cursor still links to
+// the node it stopped at, by comparing that node's lf_hash.le_prev with the
+// recorded prevlink. Buckets that changed are restarted from their head.
+// Returns the number of buckets that were restarted.
+int scan_validate_cursor(struct scan *scan, kvm_t *kd);
+
+#endif
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "lockfile.h"
+
+#define FIELD(member) {offsetof(struct nfslockfile, member), sizeof(((struct nfslockfile *)0)->member)}
+
+// The layout of struct nfslockfile has not changed since the NFSv4 server was
+// added, so the copy in lockfile.h describes every supported kernel. Kernels
+// that diverge get their own entry here.
+const struct lf_layout lf_layouts[] = {
+        {
+                .name = "freebsd",
+                .size = sizeof(struct nfslockfile),
+                .fields = {
+                        [LF_OPEN] = FIELD(lf_open.lh_first),
+                        [LF_DELEG] = FIELD(lf_deleg.lh_first),
+                        [LF_LOCK] = FIELD(lf_lock.lh_first),
+                        [LF_LOCALLOCK] = FIELD(lf_locallock.lh_first),
+                        [LF_ROLLBACK] = FIELD(lf_rollback.lh_first),
+                        [LF_HASH_NEXT] = FIELD(lf_hash.le_next),
+                        [LF_HASH_PREV] = FIELD(lf_hash.le_prev),
+                        [LF_FH] = FIELD(lf_fh),
+                        [LF_FSID] = FIELD(lf_fh.fh_fsid),
+                        [LF_LCK_USECNT] = FIELD(lf_locallock_lck.nfslock_usecnt),
+                        [LF_LCK_LOCK] = FIELD(lf_locallock_lck.nfslock_lock),
+                        [LF_USECOUNT] = FIELD(lf_usecount),
+                },
+        },
+        {.name = NULL},
+};
+
+const struct lf_layout *lf_layout_find(const char *name) {
+    for (const struct lf_layout *layout = lf_layouts; layout->name; layout++) {
+        if (strcmp(layout->name, name) == 0) {
+            return layout;
+        }
+    }
+
+    return NULL;
+}
+
+void lf_layout_span(const struct lf_layout *layout, unsigned int fields, size_t *off, size_t *len) {
+    size_t start = layout->size;
+    size_t end = 0;
+
+    for (int f = 0; f < LF_NFIELDS; f++) {
+        // Layouts of other tables leave the fields they lack empty.
+        if ((fields & LF_BIT(f)) && layout->fields[f].size) {
+            if (layout->fields[f].off < start) {
+                start = layout->fields[f].off;
+            }
+            if (layout->fields[f].off + layout->fields[f].size > end) {
+                end = layout->fields[f].off + layout->fields[f].size;
+            }
+        }
+    }
+
+    if (start > end) {
+        start = end = 0;
+    }
+
+    *off = start;
+    *len = end - start;
+}
+
+int lf_layout_zero(const struct lf_layout *layout, unsigned int fields, const void *raw, size_t span_off) {
+    for (int f = 0; f < LF_NFIELDS; f++) {
+        const unsigned char *p;
+
+        if (!(fields & LF_BIT(f)) || !layout->fields[f].size) {
+            continue;
+        }
+        p = (const unsigned char *)raw + (layout->fields[f].off - span_off);
+        for (size_t i = 0; i < layout->fields[f].size; i++) {
+            if (p[i]) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+void lf_decode(const struct lf_layout *layout, unsigned int fields, const void *raw, size_t span_off,
+               struct lf_node *node) {
+    // Destination of each field in struct lf_node, in enum lf_field order.
+    void *dst[LF_NFIELDS] = {
+            [LF_OPEN] = &node->open,
+            [LF_DELEG] = &node->deleg,
+            [LF_LOCK] = &node->lock,
+            [LF_LOCALLOCK] = &node->locallock,
+            [LF_ROLLBACK] = &node->rollback,
+            [LF_HASH_NEXT] = &node->next,
+            [LF_HASH_PREV] = &node->prev,
+            [LF_FH] = &node->fh,
+            [LF_FSID] = &node->fh.fh_fsid,
+            [LF_LCK_USECNT] = &node->lck_usecnt,
+            [LF_LCK_LOCK] = &node->lck_lock,
+            [LF_USECOUNT] = &node->usecount,
+    };
+
+    for (int f = 0; f < LF_NFIELDS; f++) {
+        if (fields & LF_BIT(f)) {
+            memcpy(dst[f], (const char *)raw + (layout->fields[f].off - span_off), layout->fields[f].size);
+        }
+    }
+}
+
+// Names of the LF_STATE_* bits, lowest first.
+static const char *state_names[] = {"open", "deleg", "lock", "locallock", "rollback", "usecount", "lck"};
+
+void lf_state_format(unsigned int state, char *buf, size_t len) {
+    size_t used = 0;
+
+    if (len == 0) {
+        return;
+    }
+    buf[0] = '\0';
+
+    if (state == 0) {
+        snprintf(buf, len, "orphaned");
+        return;
+    }
+
+    for (size_t bit = 0; bit < sizeof state_names / sizeof state_names[0]; bit++) {
+        if (state & (1u << bit)) {
+            int n = snprintf(buf + used, len - used, "%s%s", used ? "," : "", state_names[bit]);
+
+            if (n < 0 || (size_t)n >= len - used) {
+                return;
+            }
+            used += n;
+        }
+    }
+}
+
+int lf_state_bit(const char *name, size_t len) {
+    for (size_t bit = 0; bit < sizeof state_names / sizeof state_names[0]; bit++) {
+        if (strlen(state_names[bit]) == len && strncmp(state_names[bit], name, len) == 0) {
+            return 1 << bit;
+        }
+    }
+    return -1;
+}
+
+// FNV-1a over the compared bytes, finished with the splitmix64 mixer so that
+// every output bit depends on every input bit.
+uint64_t lf_fh_hash(const fhandle_t *fh) {
+    const unsigned char *p = (const unsigned char *)&fh->fh_fid;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    h = (h ^ (uint32_t)fh->fh_fsid.val[0]) * 0x100000001b3ULL;
+    h = (h ^ (uint32_t)fh->fh_fsid.val[1]) * 0x100000001b3ULL;
+    for (size_t i = 0; i < sizeof(struct fid); i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+int lf_fh_compare(const fhandle_t *a, const fhandle_t *b) {
+    int c = memcmp(&a->fh_fsid, &b->fh_fsid, sizeof a->fh_fsid);
+
+    return c ? c : memcmp(&a->fh_fid, &b->fh_fid, sizeof a->fh_fid);
+}
+
+uint32_t lf_kernel_hash(const fhandle_t *fh) {
+    const unsigned char *p = (const unsigned char *)&fh->fh_fid;
+    uint32_t hash = 0;
+
+    // HASHSTEP() from <sys/hash.h>.
+    for (size_t i = 0; i < sizeof(struct fid); i++) {
+        hash = ((hash << 5) + hash) + p[i];
+    }
+    return hash;
+}
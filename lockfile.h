@@ -0,0 +1,181 @@
+#ifndef LOCKFILE_H
+#define LOCKFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __FreeBSD__
+#include <sys/mount.h>
+#else
+// Just enough of FreeBSD's <sys/mount.h> to decode file handles on other
+// systems, where only the analysis side of these tools is built.
+typedef struct lf_fsid { int32_t val[2]; } lf_fsid_t;
+#define fsid_t lf_fsid_t
+
+#define MAXFIDSZ 16
+struct fid {
+    u_short fid_len;
+    u_short fid_data0;
+    char fid_data[MAXFIDSZ];
+};
+
+typedef struct fhandle {
+    fsid_t fh_fsid;
+    struct fid fh_fid;
+} fhandle_t;
+#endif
+
+// The fid bytes following fid_len: fid_data0 and fid_data. Filesystems lay
+// out their fid from fid_data0 on, and on ZFS fid_len counts these bytes.
+#define FID_BYTES (sizeof(struct fid) - offsetof(struct fid, fid_data0))
+
+#define SYMBOL_LOCKHASH "_nfslockhash"
+#define SYMBOL_LOCKHASH_SIZE "_nfsrv_lockhashsize"
+
+// The nfslockfile struct is copied here as it is too messy to try and import it
+// from <nfs/nfsrvstate.h>. The struct has been modified to convert all pointers
+// to unsigned long, as they are all kernel addresses.
+struct nfslockfile {
+    struct { unsigned long lh_first; } lf_open;    /* Open list */
+    struct { unsigned long lh_first; } lf_deleg;    /* Delegation list */
+    struct { unsigned long lh_first; } lf_lock;    /* Lock list */
+    struct { unsigned long lh_first; } lf_locallock;    /* Local lock list */
+    struct { unsigned long lh_first; } lf_rollback;    /* Local lock rollback list */
+    struct { unsigned long le_next; unsigned long le_prev; } lf_hash;    /* Hash list entry */
+    fhandle_t lf_fh;        /* The file handle */
+    struct nfsv4lock {
+        u_int32_t nfslock_usecnt;
+        u_int8_t nfslock_lock;
+    } lf_locallock_lck; /* serialize local locking */
+    int lf_usecount;    /* Ref count for locking */
+};
+
+// The fields of an nfslockfile that the scanner knows how to decode.
+enum lf_field {
+    LF_OPEN,
+    LF_DELEG,
+    LF_LOCK,
+    LF_LOCALLOCK,
+    LF_ROLLBACK,
+    LF_HASH_NEXT,
+    LF_HASH_PREV,
+    LF_FH,
+    LF_FSID,                // The fsid alone, a prefix of LF_FH
+    LF_LCK_USECNT,
+    LF_LCK_LOCK,
+    LF_USECOUNT,
+    LF_NFIELDS
+};
+
+#define LF_BIT(field) (1u << (field))
+
+// Fields needed to walk and check the chains and apply the lost predicate.
+#define LF_FIELDS_WALK (LF_BIT(LF_HASH_NEXT) | LF_BIT(LF_HASH_PREV) | LF_BIT(LF_OPEN) | LF_BIT(LF_LOCK))
+
+// Describes where each field lives in the kernel's struct nfslockfile, so a
+// scan can read only the byte range covering the fields it uses. Supporting a
+// kernel with a different layout means adding a descriptor, not a new struct.
+struct lf_layout {
+    const char *name;
+    size_t size;
+    struct {
+        unsigned short off;
+        unsigned short size;
+    } fields[LF_NFIELDS];
+};
+
+// The decoded fields of a single lockfile, independent of the kernel layout.
+// Fields that were not read are left zero.
+struct lf_node {
+    unsigned long addr;
+    int bucket;
+
+    unsigned long open;
+    unsigned long deleg;
+    unsigned long lock;
+    unsigned long locallock;
+    unsigned long rollback;
+    unsigned long next;
+    unsigned long prev;
+    fhandle_t fh;
+    uint32_t lck_usecnt;
+    uint8_t lck_lock;
+    int usecount;
+};
+
+// Packs an fsid into a single integer for hashing and comparison.
+static inline uint64_t lf_fsid_key(const fsid_t *fsid) {
+    return (uint64_t)(uint32_t)fsid->val[0] << 32 | (uint32_t)fsid->val[1];
+}
+
+// A file handle is considered lost if it has no reference to an open file or lock.
+static inline int lf_is_lost(const struct lf_node *node) {
+    return !node->open && !node->lock;
+}
+
+// Hashes a file handle to 64 bits over its fsid and every byte of its struct
+// fid, fid_len and fid_data0 included, which are what NFSVNO_CMPFH() in the
+// kernel compares. On ZFS, fid_data0 holds the low bits of the object
+// number, so it must take part for different files to hash differently.
+uint64_t lf_fh_hash(const fhandle_t *fh);
+
+// Orders file handles by their fsid and then every byte of their struct fid,
+// so that handles compare equal exactly when NFSVNO_CMPFH() finds them equal.
+int lf_fh_compare(const fhandle_t *a, const fhandle_t *b);
+
+// The hash nfsrv_hashfh() computes to place a handle in nfslockhash: the
+// hash32_buf() of the whole struct fid, seeded with zero. The bucket is this
+// value modulo nfsrv_lockhashsize.
+uint32_t lf_kernel_hash(const fhandle_t *fh);
+
+// Every reason a lockfile can still be in use, as bits of an lf_state() mask.
+// An entry with none of them set is orphaned: nothing will ever remove it.
+// The lost predicate only considers opens and locks, so an entry pinned only
+// by a delegation or a local lock counts as lost but is not orphaned.
+#define LF_STATE_OPEN 0x01          // lf_open is not empty
+#define LF_STATE_DELEG 0x02         // lf_deleg is not empty
+#define LF_STATE_LOCK 0x04          // lf_lock is not empty
+#define LF_STATE_LOCALLOCK 0x08     // lf_locallock is not empty
+#define LF_STATE_ROLLBACK 0x10      // lf_rollback is not empty
+#define LF_STATE_USECOUNT 0x20      // lf_usecount is non-zero
+#define LF_STATE_LCK 0x40           // lf_locallock_lck is held or referenced
+#define LF_NSTATES 0x80
+
+#define LF_FIELDS_STATE (LF_BIT(LF_OPEN) | LF_BIT(LF_DELEG) | LF_BIT(LF_LOCK) | LF_BIT(LF_LOCALLOCK) | \
+                         LF_BIT(LF_ROLLBACK) | LF_BIT(LF_USECOUNT) | LF_BIT(LF_LCK_USECNT) | LF_BIT(LF_LCK_LOCK))
+
+static inline unsigned int lf_state(const struct lf_node *node) {
+    return (node->open ? LF_STATE_OPEN : 0) |
+           (node->deleg ? LF_STATE_DELEG : 0) |
+           (node->lock ? LF_STATE_LOCK : 0) |
+           (node->locallock ? LF_STATE_LOCALLOCK : 0) |
+           (node->rollback ? LF_STATE_ROLLBACK : 0) |
+           (node->usecount ? LF_STATE_USECOUNT : 0) |
+           (node->lck_usecnt || node->lck_lock ? LF_STATE_LCK : 0);
+}
+
+// Writes the names of the bits set in state, separated by commas, or
+// "orphaned" if none are.
+void lf_state_format(unsigned int state, char *buf, size_t len);
+
+// Returns the LF_STATE_* bit named by the len bytes at name, or -1.
+int lf_state_bit(const char *name, size_t len);
+
+extern const struct lf_layout lf_layouts[];
+
+// Returns the layout with the given name, or NULL if there is none.
+const struct lf_layout *lf_layout_find(const char *name);
+
+// Computes the smallest byte range of the struct covering all of fields.
+void lf_layout_span(const struct lf_layout *layout, unsigned int fields, size_t *off, size_t *len);
+
+// Returns 1 if every byte of fields is zero in raw, a span read from span_off.
+int lf_layout_zero(const struct lf_layout *layout, unsigned int fields, const void *raw, size_t span_off);
+
+// Decodes fields out of raw, which holds the struct's bytes starting at
+// offset span_off.
+void lf_decode(const struct lf_layout *layout, unsigned int fields, const void *raw, size_t span_off,
+               struct lf_node *node);
+
+#endif
@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/ucred.h>
+#include <sys/mount.h>
+#endif
+
+#include "mount-table.h"
+
+static int append(struct mount_table *mt, const fsid_t *fsid, const char *path) {
+    struct mount_entry *entries = realloc(mt->entries, (mt->count + 1) * sizeof *entries);
+
+    if (!entries) {
+        return -1;
+    }
+    mt->entries = entries;
+
+    mt->entries[mt->count].fsid = *fsid;
+    mt->entries[mt->count].path = strdup(path);
+    if (!mt->entries[mt->count].path) {
+        return -1;
+    }
+    mt->count++;
+    return 0;
+}
+
+int mount_table_load(struct mount_table *mt) {
+#ifdef __FreeBSD__
+    struct statfs *mounts;
+    int count;
+
+    mt->entries = NULL;
+    mt->count = 0;
+
+    count = getfsstat(NULL, 0, MNT_NOWAIT);
+    if (count < 0) {
+        fprintf(stderr, "Failed to count mounts: %s\n", strerror(errno));
+        return -1;
+    }
+
+    mounts = calloc(count, sizeof *mounts);
+    if (!mounts) {
+        return -1;
+    }
+
+    count = getfsstat(mounts, count * sizeof *mounts, MNT_NOWAIT);
+    if (count < 0) {
+        fprintf(stderr, "Failed to list mounts: %s\n", strerror(errno));
+        free(mounts);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (append(mt, &mounts[i].f_fsid, mounts[i].f_mntonname) < 0) {
+            free(mounts);
+            return -1;
+        }
+    }
+
+    free(mounts);
+    return 0;
+#else
+    mt->entries = NULL;
+    mt->count = 0;
+    fprintf(stderr, "getfsstat() is not available on this system; pass a mount table file\n");
+    return -1;
+#endif
+}
+
+int mount_table_load_file(struct mount_table *mt, const char *path) {
+    char line[1024 + 64];
+    char mnt[1024];
+    unsigned int val0;
+    unsigned int val1;
+    FILE *f;
+
+    mt->entries = NULL;
+    mt->count = 0;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open mount table %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof line, f)) {
+        fsid_t fsid;
+
+        if (line[0] == '#' || sscanf(line, "%x:%x %1023s", &val0, &val1, mnt) != 3) {
+            continue;
+        }
+
+        fsid.val[0] = (int32_t)val0;
+        fsid.val[1] = (int32_t)val1;
+        if (append(mt, &fsid, mnt) < 0) {
+            fclose(f);
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+void mount_table_free(struct mount_table *mt) {
+    for (int i = 0; i < mt->count; i++) {
+        free(mt->entries[i].path);
+    }
+    free(mt->entries);
+    mt->entries = NULL;
+    mt->count = 0;
+}
+
+const char *mount_table_lookup(const struct mount_table *mt, const fsid_t *fsid) {
+    uint64_t key = lf_fsid_key(fsid);
+
+    for (int i = 0; i < mt->count; i++) {
+        if (lf_fsid_key(&mt->entries[i].fsid) == key) {
+            return mt->entries[i].path;
+        }
+    }
+
+    return NULL;
+}
+
+void mount_format_fsid(const fsid_t *fsid, char *buf, size_t len) {
+    snprintf(buf, len, "%08x:%08x", (uint32_t)fsid->val[0], (uint32_t)fsid->val[1]);
+}
+
+void mount_format_handle(const fhandle_t *fh, char *buf, size_t len) {
+    const unsigned char *fid = (const unsigned char *)&fh->fh_fid.fid_data0;
+    size_t fid_len = fh->fh_fid.fid_len < FID_BYTES ? fh->fh_fid.fid_len : FID_BYTES;
+    size_t used;
+
+    mount_format_fsid(&fh->fh_fsid, buf, len);
+    used = strlen(buf);
+    for (size_t i = 0; i < fid_len && used + 3 < len; i++) {
+        used += snprintf(buf + used, len - used, "%s%02x", i ? "" : "/", fid[i]);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef MOUNT_TABLE_H
+#define MOUNT_TABLE_H
+
+#include "lockfile.h"
+
+// Maps fsids to the paths their filesystems are mounted on.
+//
+// mount_table_load() reads the mounts of the running system with getfsstat().
+// mount_table_load_file() reads a stand-in table instead, with one
+// "VAL0:VAL1 PATH" line per mount and both fsid words in hex. It is used to
+// attribute lockfiles when the tool does not run on the NFS server itself,
+// and to test the attribution on systems without getfsstat().
+
+struct mount_entry {
+    fsid_t fsid;
+    char *path;
+};
+
+struct mount_table {
+    struct mount_entry *entries;
+    int count;
+};
+
+int mount_table_load(struct mount_table *mt);
+int mount_table_load_file(struct mount_table *mt, const char *path);
+void mount_table_free(struct mount_table *mt);
+
+// Returns the mount point of fsid, or NULL if it is not mounted.
+const char *mount_table_lookup(const struct mount_table *mt, const fsid_t *fsid);
+
+// Formats an fsid the way the stand-in table spells it.
+void mount_format_fsid(const fsid_t *fsid, char *buf, size_t len);
+
+// Formats a handle as its fsid followed by the fid_len bytes of its fid from
+// fid_data0 on, at most FID_BYTES.
+void mount_format_handle(const fhandle_t *fh, char *buf, size_t len);
+
+#endif
@@ -1,34 +1,31 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/mount.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <kvm.h>
 
-#define SYMBOL_LOCKHASH "_nfslockhash"
-#define SYMBOL_LOCKHASH_SIZE "_nfsrv_lockhashsize"
-
-// The nfslockfile struct is copied here as it is too messy to try and import it
-// from <nfs/nfsrvstate.h>. The struct has been modified to convert all pointers
-// to unsigned long, as they are all kernel addresses.
-struct nfslockfile {
-    struct { unsigned long lh_first; } lf_open;    /* Open list */
-    struct { unsigned long lh_first; } lf_deleg;    /* Delegation list */
-    struct { unsigned long lh_first; } lf_lock;    /* Lock list */
-    struct { unsigned long lh_first; } lf_locallock;    /* Local lock list */
-    struct { unsigned long lh_first; } lf_rollback;    /* Local lock rollback list */
-    struct { unsigned long le_next; unsigned long le_prev; } lf_hash;    /* Hash list entry */
-    fhandle_t lf_fh;        /* The file handle */
-    struct nfsv4lock {
-        u_int32_t nfslock_usecnt;
-        u_int8_t nfslock_lock;
-    } lf_locallock_lck; /* serialize local locking */
-    int lf_usecount;    /* Ref count for locking */
-};
+#include "analyses.h"
+#include "chain-stats.h"
+#include "emit.h"
+#include "fh-resolve.h"
+#include "filter.h"
+#include "forecast.h"
+#include "fsid-stats.h"
+#include "generations.h"
+#include "lockfile.h"
+#include "lockfile-scan.h"
+#include "mount-table.h"
+#include "snapshot.h"
+#include "state-tables.h"
 
 // This program uses libkvm to read kernel memory and examine the nfslockhash
 // table. "_nfslockhash" points to the array containing the buckets of the hash
@@ -37,77 +34,1189 @@ struct nfslockfile {
 // A lockfile is considered lost if it lacks a pointer to a session or a lock,
 // which indicates the lock file is not associated with any currently opened
 // files or locks.
+//
+// Rather than walking one bucket chain to the end before starting the next,
+// the table is walked breadth first, advancing many chains one step per round
+// and reading each round as one batch. With -j, several worker threads share
+// the buckets between them. See lockfile-scan.h for the details.
+//
+// With -b, the chain length of every bucket is saved to a profile file at the
+// end of the scan. When the file already exists, its lengths are used to
+// start the longest chains first, which keeps a multi-threaded scan from
+// finishing with one worker left walking the longest chain on its own.
+//
+// With --sample, only a few randomly chosen buckets are walked to the end of
+// their chains, and every other bucket is walked for a short prefix. The
+// complete buckets form a cluster sample of the table, from which the total
+// and lost counts are estimated with a 95% confidence interval. Together with
+// --max-nodes and --max-time this bounds the cost of a health check on a
+// table too large to walk in full.
+//
+// With -r, a scan that is stopped by its budget writes a cursor recording the
+// progress of every bucket. Running again with the same cursor validates it
+// against the live table and continues where the last run stopped, so the
+// totals accumulate over several short runs. The cursor is removed once every
+// bucket has been walked.
+//
+// With -m, total and lost counts are also kept per fsid as the table is
+// walked, and each fsid is resolved to its mount point with getfsstat(), or
+// with the stand-in mount table given to -M. Only the fsid part of each file
+// handle is read for this. The counts cover the nodes visited by this run.
+//
+// With -H, the chain length of every bucket is printed along with a summary
+// and the number of memcmp() calls nfsrv_getlockfile() is predicted to make
+// per lookup. The cost of a miss is what tracks the state mutex hold time.
+// See chain-stats.h for the model.
+//
+// With -S, every node is reduced to a bitmask of the lists and counters that
+// still reference it (see lf_state()), and the nodes are tallied per distinct
+// mask. This tells orphaned entries apart from ones pinned by a delegation or
+// a local lock, which the lost predicate alone cannot.
+//
+// With -T, the lost entries are fed into two space-saving sketches (see
+// topk.h), one keyed by fsid and a prefix of the fid and one by fsid alone, to
+// find the handles and filesystems with the most lost entries in fixed memory.
+// A fid usually ends in a generation number that changes each time an inode
+// is reused, so --top-prefix can drop it to group the entries left behind by
+// one churned file. For ZFS the object number is the first 6 bytes.
+//
+// nfsrv_getlockfile() should never insert two entries for the same handle.
+// -D estimates the number of distinct handles with a HyperLogLog sketch in
+// constant memory, and --duplicates counts them exactly with a compact hash
+// set (see fh-set.h), listing every duplicate with its bucket and address.
+//
+// With -A, the kernel's bucket hash of every handle is recomputed (see
+// lf_kernel_hash()) and the entries are redistributed over other table sizes,
+// to show what raising the vfs.nfsd.fhhashsize loader tunable would do to the
+// current population before the server is rebooted with it. Replaying the
+// current size doubles as a check that the hash matches the kernel's.
+//
+// With -g, the lost entries of a complete scan are kept in a generation store
+// (see generations.h) and compared with those of the previous run, to measure
+// how quickly lockfiles are leaking on each filesystem and how old they are.
+//
+// With --history, the counts of every complete scan are appended to a history
+// file, and the growth since the last nfsd restart is fitted with a line per
+// fsid and for the whole table (see forecast.h). Combined with the miss cost
+// model of chain-stats.h and the time one compare takes, this projects how
+// long it will be until a lookup that misses holds the state mutex for longer
+// than --latency-threshold.
+//
+// With --resolve, the distinct handles of the lost entries are looked up to
+// name the files and directories they belong to (see fh-resolve.h), so the
+// application churning them can be found.
+//
+// With -o, every visited node is also written out as a record, as NDJSON or
+// in a fixed-width binary format (see emit.h), for analysis elsewhere. When
+// the records go to standard output, the report goes to standard error.
+//
+// With -f, only the nodes matching a filter expression (see filter.h) are fed
+// to the analyses and the record output, while the table is still counted in
+// full. The filter runs in the scan workers, ahead of the serialised visits.
+//
+// With --snapshot, the nodes of the scan are also captured into a snapshot
+// file (see snapshot.h), which nfs-lockfile-snapshot runs the same analyses
+// against on any machine, without touching the kernel again. With
+// --snapshot-format columns, each field is stored as a separate column, and
+// the list heads as bitmaps that the lost and orphaned counts are read from.
+// --snapshot-format compressed packs the nodes into zlib-compressed blocks
+// for keeping a snapshot of every scan.
+//
+// --tables walks every NFSv4 server state table described in state-tables.c
+// instead, and prints the population, chain lengths and idle entries of each.
 
-int main(int argv, char *argc[]) {
-    kvm_t *kd;
+// The longest chain that is walked before a bucket is assumed to be corrupt.
+// Far above anything a real server holds, it only bounds the scan.
+#define DEFAULT_MAX_CHAIN 100000000UL
+
+// Age brackets of lost lockfiles reported by -g, in seconds.
+static const struct {
+    const char *name;
+    int64_t max_age;
+} age_brackets[] = {
+        {"< 1 hour", 3600},
+        {"< 1 day", 86400},
+        {"< 1 week", 7 * 86400},
+        {"< 30 days", 30 * 86400},
+        {">= 30 days", INT64_MAX},
+};
+
+// The shortest interval between generations over which rates are reported.
+#define MIN_RATE_INTERVAL 60
+
+// The time nfsrv_getlockfile() spends on one entry of a chain: following the
+// link to an entry that is usually not cached, and comparing its handle.
+#define DEFAULT_NODE_COST_NS 100.0
+#define DEFAULT_LATENCY_THRESHOLD_MS 10.0
+
+// Threads looking up handles for --resolve, and the directories listed.
+#define DEFAULT_RESOLVE_JOBS 4
+#define MAX_LISTED_DIRECTORIES 20
+
+#define DEFAULT_SAMPLE_BUCKETS 4
+#define DEFAULT_SAMPLE_PREFIX 1000
+
+enum {
+    OPT_SAMPLE_BUCKETS = 256,
+    OPT_SAMPLE_PREFIX,
+    OPT_MAX_CHAIN,
+    OPT_HISTORY,
+    OPT_NODE_COST,
+    OPT_LATENCY_THRESHOLD,
+    OPT_RESOLVE,
+    OPT_RESOLVE_CACHE,
+    OPT_RESOLVE_JOBS,
+    OPT_FORMAT,
+    OPT_TABLES,
+    OPT_SNAPSHOT,
+    OPT_SNAPSHOT_FORMAT,
+};
+
+static const struct option long_options[] = {
+        {"sample", no_argument, NULL, 's'},
+        {"sample-buckets", required_argument, NULL, OPT_SAMPLE_BUCKETS},
+        {"sample-prefix", required_argument, NULL, OPT_SAMPLE_PREFIX},
+        {"max-nodes", required_argument, NULL, 'n'},
+        {"max-time", required_argument, NULL, 't'},
+        {"resume", required_argument, NULL, 'r'},
+        {"max-chain", required_argument, NULL, OPT_MAX_CHAIN},
+        {"histogram", no_argument, NULL, 'H'},
+        {"states", no_argument, NULL, 'S'},
+        {"top", required_argument, NULL, 'T'},
+        {"top-prefix", required_argument, NULL, OPT_TOP_PREFIX},
+        {"distinct", no_argument, NULL, 'D'},
+        {"duplicates", no_argument, NULL, OPT_DUPLICATES},
+        {"generations", required_argument, NULL, 'g'},
+        {"history", required_argument, NULL, OPT_HISTORY},
+        {"node-cost", required_argument, NULL, OPT_NODE_COST},
+        {"latency-threshold", required_argument, NULL, OPT_LATENCY_THRESHOLD},
+        {"resolve", required_argument, NULL, OPT_RESOLVE},
+        {"resolve-cache", required_argument, NULL, OPT_RESOLVE_CACHE},
+        {"resolve-jobs", required_argument, NULL, OPT_RESOLVE_JOBS},
+        {"filter", required_argument, NULL, 'f'},
+        {"tables", no_argument, NULL, OPT_TABLES},
+        {"output", required_argument, NULL, 'o'},
+        {"format", required_argument, NULL, OPT_FORMAT},
+        {"audit", no_argument, NULL, 'A'},
+        {"audit-sizes", required_argument, NULL, OPT_AUDIT_SIZES},
+        {"audit-target", required_argument, NULL, OPT_AUDIT_TARGET},
+        {"snapshot", required_argument, NULL, OPT_SNAPSHOT},
+        {"snapshot-format", required_argument, NULL, OPT_SNAPSHOT_FORMAT},
+        {NULL, 0, NULL, 0},
+};
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-v] [-c pages] [-j workers] [-b profile] [-L layout]\n"
+                    "       [-n|--max-nodes nodes] [-t|--max-time seconds] [-r|--resume cursor]\n"
+                    "       [--max-chain nodes] [-m] [-M mount-table] [-H|--histogram]\n"
+                    "       [-S|--states] [-T|--top k] [--top-prefix bytes]\n"
+                    "       [-D|--distinct] [--duplicates]\n"
+                    "       [-g|--generations store] [--history file] [--node-cost ns]\n"
+                    "       [--latency-threshold ms] [--resolve backend[:arg]] [--resolve-cache file]\n"
+                    "       [--resolve-jobs n] [-o|--output file] [--format ndjson|binary]\n"
+                    "       [--snapshot file] [--snapshot-format rows|columns|compressed]\n"
+                    "       [-f|--filter expr] [--tables] [-A|--audit] [--audit-sizes n,...]\n"
+                    "       [--audit-target nodes]\n"
+                    "       [-s|--sample] [--sample-buckets n] [--sample-prefix nodes]\n", name);
+}
+
+static unsigned long *profile_len;
+
+static int compare_profile(const void *a, const void *b) {
+    unsigned long la = profile_len[*(const int *)a];
+    unsigned long lb = profile_len[*(const int *)b];
+
+    return (la < lb) - (la > lb);
+}
+
+// Orders buckets longest chain first according to a previous run's profile.
+// A missing profile leaves the buckets in their natural order.
+static int load_profile(const char *path, int *order, int hashsize) {
+    FILE *f;
+    int bucket;
+    unsigned long len;
+
+    f = fopen(path, "r");
+    if (!f) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "Failed to open bucket profile %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    profile_len = calloc(hashsize, sizeof *profile_len);
+    if (!profile_len) {
+        fclose(f);
+        return -1;
+    }
+
+    while (fscanf(f, "%d %lu", &bucket, &len) == 2) {
+        if (bucket >= 0 && bucket < hashsize) {
+            profile_len[bucket] = len;
+        }
+    }
+    fclose(f);
+
+    qsort(order, hashsize, sizeof *order, compare_profile);
+
+    free(profile_len);
+    profile_len = NULL;
+    return 0;
+}
+
+static int save_profile(const char *path, const unsigned long *chain_len, int hashsize) {
+    FILE *f;
+
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to write bucket profile %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    for (int bucket = 0; bucket < hashsize; bucket++) {
+        fprintf(f, "%d %lu\n", bucket, chain_len[bucket]);
+    }
+
+    return fclose(f);
+}
+
+// Picks nbuckets buckets at random to be walked in full, limits every other
+// bucket to a prefix of its chain, and moves the chosen buckets to the front
+// of the claim order.
+static int setup_sample(struct scan *scan, int nbuckets, unsigned long prefix) {
+    int hashsize = scan->hashsize;
 
+    if (nbuckets > hashsize) {
+        nbuckets = hashsize;
+    }
+
+    scan->limit = calloc(hashsize, sizeof *scan->limit);
+    if (!scan->limit) {
+        return -1;
+    }
+
+    srandom(time(NULL) ^ getpid());
+    for (int i = 0; i < nbuckets; i++) {
+        int j = i + random() % (hashsize - i);
+        int tmp = scan->order[i];
+
+        scan->order[i] = scan->order[j];
+        scan->order[j] = tmp;
+    }
+
+    for (int i = nbuckets; i < hashsize; i++) {
+        scan->limit[scan->order[i]] = prefix;
+    }
+
+    return 0;
+}
+
+// The two-sided 95% quantile of Student's t distribution with df degrees of
+// freedom. Between the listed values the next smaller df is used, which
+// errs towards a wider interval, and from 120 on the normal 1.96 is close
+// enough.
+static double t_quantile_95(int df) {
+    static const double small[] = {
+            12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+            2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+            2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+
+    if (df <= 30) {
+        return small[df - 1];
+    }
+    return df < 40 ? 2.042 : df < 60 ? 2.021 : df < 120 ? 2.000 : 1.96;
+}
+
+// Estimates the table total of a per-bucket quantity from the complete
+// buckets that were walked without a prefix limit, using the mean per bucket
+// and its standard error with a finite population correction. The variance
+// comes from the same few buckets, so the interval takes its width from the
+// t distribution rather than the normal.
+static void estimate(const struct scan *scan, const unsigned long *per_bucket, double *mean_total,
+                     double *half_width, int *n) {
+    double sum = 0;
+    double sumsq = 0;
+    double var;
+    int count = 0;
+
+    for (int bucket = 0; bucket < scan->hashsize; bucket++) {
+        if (scan->complete[bucket] && !scan->limit[bucket]) {
+            sum += per_bucket[bucket];
+            sumsq += (double)per_bucket[bucket] * per_bucket[bucket];
+            count++;
+        }
+    }
+
+    *n = count;
+    if (count < 2) {
+        *mean_total = 0;
+        *half_width = 0;
+        return;
+    }
+
+    var = (sumsq - sum * sum / count) / (count - 1);
+    *mean_total = scan->hashsize * sum / count;
+    *half_width = t_quantile_95(count - 1) * scan->hashsize * sqrt(var / count * (1.0 - (double)count / scan->hashsize));
+}
+
+static void report_sample(const struct scan *scan) {
+    double total;
+    double total_hw;
+    double lost;
+    double lost_hw;
+    double p;
+    double z = 1.96;
+    int n;
+
+    estimate(scan, scan->chain_len, &total, &total_hw, &n);
+    estimate(scan, scan->bucket_lost, &lost, &lost_hw, &n);
+
+    printf("Sampled file handles: %lu\n", scan->total);
+    printf("Sampled lost file handles: %lu\n", scan->leaked);
+
+    // Wilson score interval for the lost fraction of the nodes visited. The
+    // prefixes favour recently inserted entries, as the kernel inserts at the
+    // head of each chain.
+    if (scan->total > 0) {
+        double nv = scan->total;
+        double centre;
+        double hw;
+
+        p = scan->leaked / nv;
+        centre = (p + z * z / (2 * nv)) / (1 + z * z / nv);
+        hw = z * sqrt(p * (1 - p) / nv + z * z / (4 * nv * nv)) / (1 + z * z / nv);
+        printf("Lost fraction of sampled handles: %.1f%% (95%% CI %.1f%% - %.1f%%)\n",
+               100 * p, 100 * (centre - hw), 100 * (centre + hw));
+    }
+
+    if (n < 2) {
+        printf("Too few complete buckets (%d) to estimate the table; it holds at least %lu file handles\n",
+               n, scan->total);
+        return;
+    }
+
+    if (total < scan->total) {
+        total = scan->total;
+    }
+    printf("Estimated total file handles: %.0f (95%% CI %.0f - %.0f, from %d of %d buckets)\n",
+           total, fmax(total - total_hw, scan->total), total + total_hw, n, scan->hashsize);
+    printf("Estimated lost file handles: %.0f (95%% CI %.0f - %.0f)\n",
+           lost, fmax(lost - lost_hw, scan->leaked), lost + lost_hw);
+}
+
+// Lists the buckets in which the walk found a cycle, an unreadable node, a
+// broken back link or an overlong chain. The counts for those buckets only
+// cover the nodes visited before the problem was found.
+static void report_damage(const struct scan *scan) {
+    static const struct {
+        unsigned char flag;
+        const char *what;
+    } problems[] = {
+            {BUCKET_CYCLE, "cycle"},
+            {BUCKET_TOO_LONG, "chain too long"},
+            {BUCKET_UNREADABLE, "unreadable node"},
+            {BUCKET_BAD_LINK, "bad back link"},
+    };
+
+    for (int bucket = 0; bucket < scan->hashsize; bucket++) {
+        if (!scan->damage[bucket]) {
+            continue;
+        }
+
+        printf("Bucket %d:", bucket);
+        for (size_t i = 0; i < sizeof problems / sizeof problems[0]; i++) {
+            if (scan->damage[bucket] & problems[i].flag) {
+                printf(" %s", problems[i].what);
+            }
+        }
+        printf(" (after %lu nodes)\n", scan->chain_len[bucket]);
+    }
+}
+
+static void format_duration(double seconds, char *buf, size_t len) {
+    if (seconds < 3600) {
+        snprintf(buf, len, "%.0f minutes", seconds / 60);
+    } else if (seconds < 2 * 86400) {
+        snprintf(buf, len, "%.1f hours", seconds / 3600);
+    } else {
+        snprintf(buf, len, "%.1f days", seconds / 86400);
+    }
+}
+
+static int compare_gen_fsids(const void *a, const void *b) {
+    unsigned long na = ((const struct gen_fsid *)a)->counts[GEN_NEW];
+    unsigned long nb = ((const struct gen_fsid *)b)->counts[GEN_NEW];
+
+    return na < nb ? 1 : na > nb ? -1 : 0;
+}
+
+static int report_generations(const struct generation *prev, struct generation *cur, const char *mount_file) {
+    struct gen_diff diff;
+    struct mount_table mounts;
+    unsigned long ages[sizeof age_brackets / sizeof *age_brackets] = {0};
+    unsigned long oldest = 0;
+    double hours;
+    char elapsed[32];
     int rc;
-    char errbuf[_POSIX2_LINE_MAX];
 
+    if (gen_diff(prev, cur, &diff) < 0) {
+        fprintf(stderr, "Failed to allocate generation statistics\n");
+        return -1;
+    }
+
+    rc = mount_file ? mount_table_load_file(&mounts, mount_file) : mount_table_load(&mounts);
+    if (rc < 0) {
+        gen_diff_free(&diff);
+        return -1;
+    }
+
+    // Both scans are instants, so the rates are only as precise as the
+    // interval between them is long.
+    hours = cur->scanned - prev->scanned >= MIN_RATE_INTERVAL ? (cur->scanned - prev->scanned) / 3600.0 : 0;
+    format_duration(cur->scanned - prev->scanned, elapsed, sizeof elapsed);
+    printf("\nLost lockfiles since the scan %s ago: %lu new, %lu surviving, %lu gone\n", elapsed,
+           diff.counts[GEN_NEW], diff.counts[GEN_SURVIVING], diff.counts[GEN_GONE]);
+    if (hours > 0) {
+        printf("Leak rate: %.1f per hour (net %.1f per hour)\n", diff.counts[GEN_NEW] / hours,
+               ((double)diff.counts[GEN_NEW] - diff.counts[GEN_GONE]) / hours);
+    }
+
+    qsort(diff.fsids, diff.nfsids, sizeof *diff.fsids, compare_gen_fsids);
+    printf("\n%10s %10s %10s %10s  %-17s  %s\n", "NEW/HOUR", "NEW", "SURVIVING", "GONE", "FSID", "MOUNT");
+    for (size_t i = 0; i < diff.nfsids; i++) {
+        const struct gen_fsid *f = &diff.fsids[i];
+        const char *path = mount_table_lookup(&mounts, &f->fsid);
+        char fsid[32];
+
+        mount_format_fsid(&f->fsid, fsid, sizeof fsid);
+        printf("%10.1f %10lu %10lu %10lu  %-17s  %s\n", hours > 0 ? f->counts[GEN_NEW] / hours : 0,
+               f->counts[GEN_NEW], f->counts[GEN_SURVIVING], f->counts[GEN_GONE], fsid,
+               path ? path : "(not mounted)");
+    }
+
+    for (size_t i = 0; i < cur->count; i++) {
+        int64_t age = cur->scanned - cur->records[i].first_seen;
+        size_t b = 0;
+
+        while (age >= age_brackets[b].max_age) {
+            b++;
+        }
+        ages[b]++;
+        if (cur->records[i].first_seen == cur->first_scan) {
+            oldest++;
+        }
+    }
+
+    printf("\n%10s  %s\n", "COUNT", "AGE");
+    for (size_t b = 0; b < sizeof ages / sizeof *ages; b++) {
+        printf("%10lu  %s\n", ages[b], age_brackets[b].name);
+    }
+
+    // Entries already present in the first scan may be older than it.
+    format_duration(cur->scanned - cur->first_scan, elapsed, sizeof elapsed);
+    printf("%lu entries date from the first scan and are at least %s old\n", oldest, elapsed);
+
+    mount_table_free(&mounts);
+    gen_diff_free(&diff);
+    return 0;
+}
+
+// Appends this scan to the history and forecasts from every scan since the
+// last restart. Lookups hash evenly over the buckets, so a miss costs the
+// mean chain length of compares: total / hashsize.
+static int report_forecast(const char *path, int64_t now, const struct scan *scan, const struct fsid_stats *by_fsid,
+                           double node_cost, double threshold_ms) {
+    struct history history;
+    struct fsid_entry *entries;
+    const struct series *all;
+    struct fit fit;
+    size_t count;
+    double miss_ms;
+    double limit;
+
+    entries = fsid_stats_sorted(by_fsid, &count);
+    if (!entries) {
+        fprintf(stderr, "Failed to sort the fsid table\n");
+        return -1;
+    }
+
+    if (history_append(path, now, HISTORY_ALL, scan->total, scan->leaked) < 0) {
+        free(entries);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        char fsid[32];
+
+        mount_format_fsid(&entries[i].fsid, fsid, sizeof fsid);
+        if (history_append(path, now, fsid, entries[i].total, entries[i].lost) < 0) {
+            free(entries);
+            return -1;
+        }
+    }
+
+    if (history_load(&history, path) < 0) {
+        free(entries);
+        return -1;
+    }
+
+    all = history_find(&history, HISTORY_ALL);
+    if (!all || series_fit(all, 0, &fit) < 0) {
+        printf("\nHistory %s has too few scans since the last restart to forecast; run again later\n", path);
+        history_free(&history);
+        free(entries);
+        return 0;
+    }
+
+    miss_ms = (double)scan->total / scan->hashsize * node_cost / 1e6;
+    limit = threshold_ms * 1e6 / node_cost * scan->hashsize;
+
+    printf("\nGrowth over %zu scans: %.1f entries per hour (r^2 %.3f)\n", fit.npoints, fit.slope * 3600, fit.r2);
+    printf("Predicted miss cost: %.3fms at %.0fns per entry\n", miss_ms, node_cost);
+    if (scan->total >= limit) {
+        printf("Bucket miss cost already exceeds %gms\n", threshold_ms);
+    } else if (fit.slope <= 0) {
+        printf("The table is not growing, so bucket miss cost will not reach %gms\n", threshold_ms);
+    } else {
+        printf("At the current leak rate, bucket miss cost reaches %gms in %.1f hours\n", threshold_ms,
+               (limit - scan->total) / fit.slope / 3600);
+    }
+
+    printf("\n%12s %10s %6s  %s\n", "LOST/HOUR", "LOST", "R^2", "FSID");
+    for (size_t i = 0; i < count; i++) {
+        const struct series *s;
+        char fsid[32];
+
+        mount_format_fsid(&entries[i].fsid, fsid, sizeof fsid);
+        s = history_find(&history, fsid);
+        if (s && series_fit(s, 1, &fit) == 0) {
+            printf("%12.1f %10lu %6.3f  %s\n", fit.slope * 3600, entries[i].lost, fit.r2, fsid);
+        } else {
+            printf("%12s %10lu %6s  %s\n", "-", entries[i].lost, "-", fsid);
+        }
+    }
+
+    history_free(&history);
+    free(entries);
+    return 0;
+}
+
+struct directory {
+    char *path;
+    unsigned long count;
+};
+
+static int compare_directory_paths(const void *a, const void *b) {
+    return strcmp(((const struct directory *)a)->path, ((const struct directory *)b)->path);
+}
+
+static int compare_directory_counts(const void *a, const void *b) {
+    unsigned long ca = ((const struct directory *)a)->count;
+    unsigned long cb = ((const struct directory *)b)->count;
+
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static int report_resolved(const struct resolver *r) {
+    struct directory *dirs;
+    unsigned long stale = 0;
+    unsigned long failed = 0;
+    unsigned long unnamed = 0;
+    size_t ndirs = 0;
+    size_t n = 0;
+
+    dirs = malloc((r->count ? r->count : 1) * sizeof *dirs);
+    if (!dirs) {
+        fprintf(stderr, "Failed to allocate the directory list\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < r->count; i++) {
+        const struct fh_info *info = &r->info[i];
+        char *slash;
+
+        if (info->error == ESTALE) {
+            stale += r->items[i].count;
+        } else if (info->error) {
+            failed += r->items[i].count;
+        } else if (!info->path || !(slash = strrchr(info->path, '/'))) {
+            unnamed += r->items[i].count;
+        } else {
+            dirs[ndirs].path = strndup(info->path, slash == info->path ? 1 : slash - info->path);
+            if (!dirs[ndirs].path) {
+                fprintf(stderr, "Failed to allocate the directory list\n");
+                goto fail;
+            }
+            dirs[ndirs++].count = r->items[i].count;
+        }
+    }
+
+    // Fold the entries of each directory into one.
+    qsort(dirs, ndirs, sizeof *dirs, compare_directory_paths);
+    for (size_t i = 0; i < ndirs; i++) {
+        if (n && strcmp(dirs[n - 1].path, dirs[i].path) == 0) {
+            dirs[n - 1].count += dirs[i].count;
+            free(dirs[i].path);
+        } else {
+            dirs[n++] = dirs[i];
+        }
+    }
+    ndirs = n;
+    qsort(dirs, ndirs, sizeof *dirs, compare_directory_counts);
+
+    printf("\nResolved %zu distinct handles (%lu from cache, %lu looked up with %s)\n", r->count, r->from_cache,
+           r->looked_up, r->backend->name);
+    printf("Lost entries: %lu stale, %lu failed, %lu without a path\n", stale, failed, unnamed);
+    if (ndirs) {
+        printf("\n%10s  %s\n", "LOST", "DIRECTORY");
+        for (size_t i = 0; i < ndirs && i < MAX_LISTED_DIRECTORIES; i++) {
+            printf("%10lu  %s\n", dirs[i].count, dirs[i].path);
+        }
+    }
+
+    for (size_t i = 0; i < ndirs; i++) {
+        free(dirs[i].path);
+    }
+    free(dirs);
+    return 0;
+
+fail:
+    for (size_t i = 0; i < ndirs; i++) {
+        free(dirs[i].path);
+    }
+    free(dirs);
+    return -1;
+}
+
+// Writes the nodes captured by the scan to a snapshot, with the completeness
+// and damage of every bucket.
+static int save_snapshot(const struct scan *scan, struct snapshot_writer *w, const char *path, int64_t now,
+                         unsigned int flags) {
+    struct snapshot_header h = {.flags = flags};
+    unsigned char *buckets;
+    int rc;
+
+    buckets = malloc(scan->hashsize);
+    if (!buckets) {
+        fprintf(stderr, "Failed to allocate the snapshot\n");
+        return -1;
+    }
+    for (int bucket = 0; bucket < scan->hashsize; bucket++) {
+        buckets[bucket] = (scan->complete[bucket] ? SNAPSHOT_BUCKET_COMPLETE : 0) |
+                          (scan->damage[bucket] & SNAPSHOT_BUCKET_DAMAGE);
+    }
+
+    snprintf(h.layout, sizeof h.layout, "%s", scan->layout->name);
+    h.table = scan->table;
+    h.taken = now;
+    h.hashsize = scan->hashsize;
+    h.total = scan->total;
+    h.lost = scan->leaked;
+    if (scan_complete_buckets(scan) == scan->hashsize && scan->visited_nodes == scan->total) {
+        h.flags |= SNAPSHOT_COMPLETE;
+    }
+
+    rc = snapshot_save(w, path, &h, buckets);
+    if (rc == 0) {
+        printf("\nSnapshot of %zu entries written to %s%s\n", w->count, path,
+               h.flags & SNAPSHOT_COMPLETE ? "" : " (incomplete scan)");
+    }
+    snapshot_writer_free(w);
+    free(buckets);
+    return rc;
+}
+
+// Finds the bucket array and size of a table in the running kernel. Returns 1
+// if the kernel does not have the table.
+static int locate_table(kvm_t *kd, const struct state_table *desc, unsigned long *table, int *hashsize) {
     struct nlist symbols[3] = {
-            {.n_name = SYMBOL_LOCKHASH},
-            {.n_name = SYMBOL_LOCKHASH_SIZE},
+            {.n_name = desc->hash_symbol},
+            {.n_name = desc->size_symbol},
             {.n_name = NULL},
     };
 
+    if (kvm_nlist(kd, symbols) < 0) {
+        fprintf(stderr, "Failed to read symbols: %s\n", kvm_geterr(kd));
+        return -1;
+    }
+    if (!symbols[0].n_value || !symbols[1].n_value) {
+        return 1;
+    }
+
+    if (kvm_read(kd, symbols[1].n_value, hashsize, sizeof *hashsize) != sizeof *hashsize) {
+        fprintf(stderr, "Failed to read %s size: %s\n", desc->name, kvm_geterr(kd));
+        return -1;
+    }
+
+    if (kvm_read(kd, symbols[0].n_value, table, sizeof *table) != sizeof *table) {
+        fprintf(stderr, "Failed to read %s pointer: %s\n", desc->name, kvm_geterr(kd));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Walks every table in state_tables with the settings of tmpl and prints one
+// line per table. The lockfile table is read with the layout chosen by -L.
+static int survey_tables(kvm_t *kd, const struct scan *tmpl) {
+    printf("%-10s %8s %10s %10s %8s %8s %8s %9s  %s\n", "TABLE", "BUCKETS", "ENTRIES", "IDLE", "MEAN", "P99", "MAX",
+           "DAMAGED", "IDLE MEANS");
+
+    for (const struct state_table *desc = state_tables; desc->name; desc++) {
+        struct scan t = {
+                .desc = desc,
+                .layout = desc == &state_tables[0] ? tmpl->layout : desc->layout,
+                .nworkers = tmpl->nworkers,
+                .cache_pages = tmpl->cache_pages,
+                .max_chain = tmpl->max_chain,
+        };
+        struct chain_stats cs;
+        unsigned long table;
+        int hashsize;
+        int damaged = 0;
+        int rc;
+
+        rc = locate_table(kd, desc, &table, &hashsize);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc > 0) {
+            printf("%-10s %8s\n", desc->name, "absent");
+            continue;
+        }
+
+        t.table = table;
+        if (scan_alloc(&t, hashsize) < 0) {
+            fprintf(stderr, "Failed to allocate state for %d buckets\n", hashsize);
+            return -1;
+        }
+        if (scan_read_heads(&t, kd) < 0 || scan_run(&t) < 0 ||
+            chain_stats_compute(t.chain_len, t.complete, hashsize, &cs) < 0) {
+            scan_free(&t);
+            return -1;
+        }
+
+        for (int bucket = 0; bucket < hashsize; bucket++) {
+            damaged += t.damage[bucket] != 0;
+        }
+
+        printf("%-10s %8d %10lu %10lu %8.1f %8lu %8lu %9d  %s\n", desc->name, hashsize, t.total, t.leaked, cs.mean,
+               cs.p99, cs.max, damaged, desc->idle_desc);
+        scan_free(&t);
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    kvm_t *kd;
+    struct scan scan = {.nworkers = 1, .desc = &state_tables[0], .layout = &lf_layouts[0],
+                        .max_chain = DEFAULT_MAX_CHAIN};
+
+    int rc;
+    char errbuf[_POSIX2_LINE_MAX];
+
     int lockfilehashsize;
     unsigned long lockfilehashtable;
 
+    struct analyses an = {0};
+    struct generation gen;
+    struct generation prev_gen;
+    const char *gen_store = NULL;
+    int have_prev_gen = 0;
+    const char *history = NULL;
+    double node_cost = DEFAULT_NODE_COST_NS;
+    double latency_threshold = DEFAULT_LATENCY_THRESHOLD_MS;
+    int64_t now = time(NULL);
+    struct resolver resolver;
+    const char *resolve = NULL;
+    const char *resolve_cache = NULL;
+    int resolve_jobs = DEFAULT_RESOLVE_JOBS;
+    struct emitter emitter;
+    const char *output = NULL;
+    int format = EMIT_NDJSON;
+    struct snapshot_writer snapshot;
+    const char *snapshot_path = NULL;
+    unsigned int snapshot_flags = 0;
+    struct filter filter;
+    int survey = 0;
+    int histogram = 0;
+    const char *profile = NULL;
+    const char *cursor = NULL;
+    int complete;
+    int sample = 0;
+    int sample_buckets = DEFAULT_SAMPLE_BUCKETS;
+    unsigned long sample_prefix = DEFAULT_SAMPLE_PREFIX;
+    int verbose = 0;
+    int ch;
+
+    while ((ch = getopt_long(argc, argv, ANALYSES_SHORT_OPTIONS "b:c:f:g:Hj:L:n:o:r:st:v", long_options, NULL)) != -1) {
+        rc = analyses_option(&an, ch, optarg);
+        if (rc < 0) {
+            return 1;
+        }
+        if (rc > 0) {
+            continue;
+        }
+
+        switch (ch) {
+            case 'b':
+                profile = optarg;
+                break;
+            case 'c':
+                scan.cache_pages = atoi(optarg);
+                break;
+            case 'j':
+                scan.nworkers = atoi(optarg);
+                if (scan.nworkers < 1) {
+                    fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'L':
+                scan.layout = lf_layout_find(optarg);
+                if (!scan.layout) {
+                    fprintf(stderr, "Unknown lockfile layout: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+                if (filter_compile(&filter, optarg) < 0) {
+                    return 1;
+                }
+                scan.filter = &filter;
+                scan.fields |= filter.fields;
+                break;
+            case 'g':
+                gen_store = optarg;
+                break;
+            case 'H':
+                histogram = 1;
+                break;
+            case 'n':
+                scan.max_nodes = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'r':
+                cursor = optarg;
+                break;
+            case 's':
+                sample = 1;
+                break;
+            case 't':
+                scan.max_time = strtod(optarg, NULL);
+                break;
+            case OPT_SAMPLE_BUCKETS:
+                sample_buckets = atoi(optarg);
+                break;
+            case OPT_SAMPLE_PREFIX:
+                sample_prefix = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_HISTORY:
+                history = optarg;
+                break;
+            case OPT_NODE_COST:
+                node_cost = strtod(optarg, NULL);
+                if (node_cost <= 0) {
+                    fprintf(stderr, "Invalid node cost: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_LATENCY_THRESHOLD:
+                latency_threshold = strtod(optarg, NULL);
+                break;
+            case OPT_FORMAT:
+                format = emitter_format(optarg);
+                if (format < 0) {
+                    fprintf(stderr, "Unknown output format: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_TABLES:
+                survey = 1;
+                break;
+            case OPT_RESOLVE:
+                resolve = optarg;
+                break;
+            case OPT_RESOLVE_CACHE:
+                resolve_cache = optarg;
+                break;
+            case OPT_RESOLVE_JOBS:
+                resolve_jobs = atoi(optarg);
+                if (resolve_jobs < 1) {
+                    fprintf(stderr, "Invalid number of resolver jobs: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_SNAPSHOT:
+                snapshot_path = optarg;
+                break;
+            case OPT_SNAPSHOT_FORMAT:
+                if (strcmp(optarg, "columns") == 0) {
+                    snapshot_flags = SNAPSHOT_COLUMNAR;
+                } else if (strcmp(optarg, "compressed") == 0) {
+                    snapshot_flags = SNAPSHOT_COMPRESSED;
+                } else if (strcmp(optarg, "rows") == 0) {
+                    snapshot_flags = 0;
+                } else {
+                    fprintf(stderr, "Unknown snapshot format: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_MAX_CHAIN:
+                scan.max_chain = strtoul(optarg, NULL, 10);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    // The history records every fsid, whether or not they are reported.
+    an.want_by_fsid = history != NULL;
+
+    if (output) {
+        if (emitter_open(&emitter, output, format) < 0) {
+            return 1;
+        }
+        if (strcmp(output, "-") == 0 && dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "Failed to redirect the report: %s\n", strerror(errno));
+            return 1;
+        }
+        an.emitter = &emitter;
+    }
+
+    if (snapshot_path) {
+        if (snapshot_writer_init(&snapshot) < 0) {
+            fprintf(stderr, "Failed to allocate the snapshot\n");
+            return 1;
+        }
+        an.snapshot = &snapshot;
+    }
+
+    if (resolve) {
+        if (resolver_init(&resolver, resolve, resolve_jobs) < 0) {
+            return 1;
+        }
+        an.resolver = &resolver;
+    }
+
+    scan.visit = analyses_visit;
+    scan.visit_arg = &an;
+
+    if (sample && cursor) {
+        fprintf(stderr, "A sampled scan cannot be resumed\n");
+        return 1;
+    }
+
+    // A generation must hold every lost entry, or the ones not visited would
+    // be counted as gone.
+    if (gen_store && (sample || cursor)) {
+        fprintf(stderr, "A generation store needs a complete scan in a single run\n");
+        return 1;
+    }
+
+    if (history && (sample || cursor)) {
+        fprintf(stderr, "A history needs a complete scan in a single run\n");
+        return 1;
+    }
+
+    // Both compare whole tables between runs.
+    if ((gen_store || history) && scan.filter) {
+        fprintf(stderr, "A generation store or history cannot be combined with a filter\n");
+        return 1;
+    }
+
+    // A snapshot holds whole chains, so it can be analysed as the table.
+    if (snapshot_path && (sample || cursor || scan.filter)) {
+        fprintf(stderr, "A snapshot needs every node of a single run, unfiltered\n");
+        return 1;
+    }
+
+    if (gen_store) {
+        have_prev_gen = gen_load(&prev_gen, gen_store);
+        if (have_prev_gen < 0) {
+            return 1;
+        }
+        if (gen_init(&gen, now) < 0) {
+            fprintf(stderr, "Failed to allocate the generation\n");
+            return 1;
+        }
+        an.gen = &gen;
+    }
+
     kd = kvm_openfiles(NULL, NULL, NULL, O_RDONLY, &errbuf[0]);
     if (!kd) {
-        fprintf(stderr, "Failed to open files for KVM: %s", kvm_geterr(kd));
+        fprintf(stderr, "Failed to open files for KVM: %s\n", errbuf);
         return 1;
     }
 
-    rc = kvm_nlist(kd, symbols);
-    if (rc < 0) {
-        fprintf(stderr, "Failed to read symbols: %s", kvm_geterr(kd));
+    if (survey) {
+        rc = survey_tables(kd, &scan);
+        kvm_close(kd);
+        return rc < 0 ? 1 : 0;
+    }
+
+    rc = locate_table(kd, scan.desc, &lockfilehashtable, &lockfilehashsize);
+    if (rc != 0) {
+        if (rc > 0) {
+            fprintf(stderr, "The kernel has no %s table\n", scan.desc->name);
+        }
         return 1;
     }
 
-    rc = kvm_read(kd, symbols[1].n_value, &lockfilehashsize, sizeof lockfilehashsize);
-    if (rc < 0) {
-        fprintf(stderr, "Failed to read lockfilehash size: %s", kvm_geterr(kd));
+    scan.table = lockfilehashtable;
+    if (scan_alloc(&scan, lockfilehashsize) < 0) {
+        fprintf(stderr, "Failed to allocate state for %d buckets\n", lockfilehashsize);
         return 1;
     }
 
-    rc = kvm_read(kd, symbols[0].n_value, &lockfilehashtable, sizeof lockfilehashtable);
-    if (rc < 0) {
-        fprintf(stderr, "Failed to read lockfilehash pointer: %s", kvm_geterr(kd));
+    if (scan_read_heads(&scan, kd) < 0) {
+        return 1;
+    }
+
+    if (analyses_init(&an, lockfilehashsize) < 0) {
         return 1;
     }
+    scan.fields |= analyses_fields(&an);
 
-    int total_lockfiles = 0;
-    int leaked_lockfiles = 0;
-    for (int bucket = 0; bucket < lockfilehashsize; bucket++) {
-        unsigned long cur;
+    if (profile && load_profile(profile, scan.order, lockfilehashsize) < 0) {
+        return 1;
+    }
 
-        rc = kvm_read(kd, lockfilehashtable + (bucket * sizeof(void *)), &cur, sizeof cur);
+    if (cursor) {
+        rc = scan_load_cursor(&scan, cursor);
         if (rc < 0) {
-            fprintf(stderr, "Failed to read bucket pointer: %s", kvm_geterr(kd));
             return 1;
         }
 
-        while (cur) {
-            struct nfslockfile lockfile;
+        if (rc > 0) {
+            rc = scan_validate_cursor(&scan, kd);
+            if (rc > 0) {
+                fprintf(stderr, "%d partially walked buckets changed since the cursor was written and were restarted\n", rc);
+            }
+        }
+    }
+
+    if (sample && setup_sample(&scan, sample_buckets, sample_prefix) < 0) {
+        fprintf(stderr, "Failed to allocate sample limits\n");
+        return 1;
+    }
 
-            rc = kvm_read(kd, cur, &lockfile, sizeof lockfile);
-            if (rc < 0) {
-                fprintf(stderr, "Failed to read lockfile: %s", kvm_geterr(kd));
+    if (scan_run(&scan) < 0) {
+        return 1;
+    }
+
+    if (an.emitter && emitter_close(an.emitter) < 0) {
+        return 1;
+    }
+
+    complete = scan_complete_buckets(&scan) == lockfilehashsize;
+
+    if (sample) {
+        report_sample(&scan);
+    } else {
+        printf("Total file handles: %lu\n", scan.total);
+        printf("Lost file handles: %lu\n", scan.leaked);
+        if (!complete) {
+            printf("Scan incomplete: %d of %d buckets walked\n", scan_complete_buckets(&scan), lockfilehashsize);
+        }
+    }
+
+    if (scan.filter) {
+        printf("Matching file handles: %lu (%lu lost)\n", scan.matched, scan.matched_lost);
+    }
+
+    report_damage(&scan);
+
+    // Only buckets walked to the end have a known length. A sampled or
+    // budgeted scan is summarised over those alone.
+    if (histogram) {
+        struct chain_stats cs;
+
+        if (chain_stats_compute(scan.chain_len, scan.complete, lockfilehashsize, &cs) < 0) {
+            fprintf(stderr, "Failed to allocate chain statistics\n");
+            return 1;
+        }
+
+        printf("\n");
+        chain_stats_print_histogram(scan.chain_len, scan.complete, lockfilehashsize, stdout);
+        chain_stats_print(&cs, stdout);
+    }
+
+    if (analyses_report(&an, scan.filter ? scan.matched : scan.visited_nodes,
+                        complete && scan.visited_nodes == scan.total) < 0) {
+        return 1;
+    }
+
+    if (an.snapshot && save_snapshot(&scan, an.snapshot, snapshot_path, now, snapshot_flags) < 0) {
+        return 1;
+    }
+
+    if (an.resolver) {
+        if (resolver_run(an.resolver, resolve_cache) < 0 || report_resolved(an.resolver) < 0) {
+            return 1;
+        }
+        resolver_free(an.resolver);
+    }
+
+    if (an.gen) {
+        if (!complete || scan.visited_nodes != scan.total) {
+            fprintf(stderr, "The scan was incomplete, so the generation store %s was not updated\n", gen_store);
+        } else {
+            gen_sort(&gen);
+            if (have_prev_gen) {
+                if (report_generations(&prev_gen, &gen, an.mount_file) < 0) {
+                    return 1;
+                }
+            } else {
+                printf("\nGeneration store %s created with %zu lost lockfiles; run again to measure the leak rate\n",
+                       gen_store, gen.count);
+            }
+            if (gen_save(&gen, gen_store) < 0) {
                 return 1;
             }
+        }
+    }
 
-            total_lockfiles++;
+    if (history) {
+        if (!complete || scan.visited_nodes != scan.total) {
+            fprintf(stderr, "The scan was incomplete, so it was not added to the history %s\n", history);
+        } else if (report_forecast(history, now, &scan, an.by_fsid, node_cost, latency_threshold) < 0) {
+            return 1;
+        }
+    }
 
-            // A file handle is considered lost if it has no reference to an open file or lock.
-            if (!lockfile.lf_open.lh_first && !lockfile.lf_lock.lh_first) {
-                leaked_lockfiles++;
+    if (cursor) {
+        if (!complete) {
+            if (scan_save_cursor(&scan, cursor) < 0) {
+                return 1;
             }
+            printf("Progress saved to %s; run again with -r %s to continue\n", cursor, cursor);
+        } else if (unlink(cursor) < 0 && errno != ENOENT) {
+            fprintf(stderr, "Failed to remove cursor %s: %s\n", cursor, strerror(errno));
+        }
+    }
 
-            cur = lockfile.lf_hash.le_next;
+    if (verbose) {
+        fprintf(stderr, "Pages fetched: %lu (%lu bytes)\n", scan.pages_fetched, scan.bytes_fetched);
+        fprintf(stderr, "Structs served: %lu\n", scan.structs_served);
+        if (scan.cache_pages > 0) {
+            fprintf(stderr, "Page cache: %lu hits, %lu misses, %lu evictions\n",
+                    scan.cache_hits, scan.cache_misses, scan.cache_evictions);
         }
     }
 
-    printf("Total file handles: %d\n", total_lockfiles);
-    printf("Lost file handles: %d\n", leaked_lockfiles);
+    // Only a scan that reached the end of every chain describes the table.
+    if (profile && !sample && complete && save_profile(profile, scan.chain_len, lockfilehashsize) < 0) {
+        return 1;
+    }
+
+    kvm_close(kd);
 }
@@ -0,0 +1,464 @@
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "emit.h"
+#include "extsort.h"
+#include "lockfile.h"
+#include "mount-table.h"
+#include "snapshot.h"
+
+// This program compares two snapshots taken with nfs-lockfile-counter
+// --snapshot and reports the entries added, removed and changed between them,
+// in total and per fsid. Like nfs-lockfile-snapshot it does not use libkvm.
+//
+// Both snapshots are sorted on the same key and merge joined in one pass over
+// each. The key is chosen with -k:
+//
+//   handle   The fsid and the whole struct fid: fid_len, fid_data0 and all
+//            of fid_data, which NFSVNO_CMPFH() compares to find a handle's
+//            lockfile. An entry matches whatever address it is at, so a
+//            lockfile that was freed and created again between the snapshots
+//            is one changed entry. Duplicate handles are paired in address
+//            order.
+//   addr     The kernel address and the handle, as the generation store
+//            matches entries. A lockfile freed and created again is one entry
+//            removed and one added, even if the memory was reused for it.
+//
+// Matched entries are changed if their lf_state() bits differ. A snapshot
+// holds tens of millions of rows when the table has been leaking for long,
+// so the rows are sorted with extsort, which spills sorted runs to a
+// temporary file ($TMPDIR or /tmp) once --memory megabytes are used, split
+// between the two snapshots.
+
+#define DEFAULT_MEMORY_MB 256
+
+#define DIFF_ADDED 0
+#define DIFF_REMOVED 1
+#define DIFF_CHANGED 2
+#define DIFF_UNCHANGED 3
+#define DIFF_NOW_LOST 4         // Added or changed, lost now and not before
+#define DIFF_NKINDS 5
+
+#define KEY_HANDLE 0
+#define KEY_ADDR 1
+
+enum {
+    OPT_MEMORY = 256,
+};
+
+struct diff_fsid {
+    fsid_t fsid;
+    unsigned long counts[DIFF_NKINDS];
+};
+
+struct diff {
+    unsigned long counts[DIFF_NKINDS];
+    unsigned long moved;        // Matched by handle at another address
+    struct diff_fsid *fsids;
+    size_t nfsids;
+    size_t cap;
+    size_t last;
+};
+
+struct side {
+    const char *path;
+    struct snapshot snap;
+    struct extsort sort;
+    const struct emit_record *cur;
+};
+
+static const struct option long_options[] = {
+        {"key", required_argument, NULL, 'k'},
+        {"list", no_argument, NULL, 'l'},
+        {"memory", required_argument, NULL, OPT_MEMORY},
+        {NULL, 0, NULL, 0},
+};
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-k|--key handle|addr] [-l|--list] [-m] [-M mount-table]\n"
+                    "       [--memory megabytes] [-v] old-snapshot new-snapshot\n", name);
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static uint64_t record_fsid(const struct emit_record *r) {
+    return (uint64_t)(uint32_t)r->fsid[0] << 32 | (uint32_t)r->fsid[1];
+}
+
+// Orders records by handle, comparing what NFSVNO_CMPFH() compares: the fsid
+// and every field of the struct fid, as the record splits it.
+static int compare_handles(const struct emit_record *a, const struct emit_record *b) {
+    uint64_t fa = record_fsid(a);
+    uint64_t fb = record_fsid(b);
+
+    if (fa != fb) {
+        return fa < fb ? -1 : 1;
+    }
+    if (a->fid_len != b->fid_len) {
+        return a->fid_len < b->fid_len ? -1 : 1;
+    }
+    if (a->fid_data0 != b->fid_data0) {
+        return a->fid_data0 < b->fid_data0 ? -1 : 1;
+    }
+    return memcmp(a->fid, b->fid, MAXFIDSZ);
+}
+
+static int compare_addrs(const struct emit_record *a, const struct emit_record *b) {
+    if (a->addr != b->addr) {
+        return a->addr < b->addr ? -1 : 1;
+    }
+    return compare_handles(a, b);
+}
+
+static int sort_by_handle(const void *a, const void *b) {
+    int c = compare_handles(a, b);
+
+    if (c != 0) {
+        return c;
+    }
+    return compare_addrs(a, b);
+}
+
+static int sort_by_addr(const void *a, const void *b) {
+    return compare_addrs(a, b);
+}
+
+// A server exports few filesystems, so the fsids are searched linearly,
+// starting with the one matched last.
+static int count_fsid(struct diff *diff, const struct emit_record *r, int kind) {
+    size_t i;
+
+    diff->counts[kind]++;
+
+    if (diff->last < diff->nfsids && memcmp(&diff->fsids[diff->last].fsid, r->fsid, sizeof r->fsid) == 0) {
+        diff->fsids[diff->last].counts[kind]++;
+        return 0;
+    }
+
+    for (i = 0; i < diff->nfsids; i++) {
+        if (memcmp(&diff->fsids[i].fsid, r->fsid, sizeof r->fsid) == 0) {
+            break;
+        }
+    }
+
+    if (i == diff->nfsids) {
+        if (diff->nfsids == diff->cap) {
+            size_t cap = diff->cap ? diff->cap * 2 : 16;
+            struct diff_fsid *fsids = realloc(diff->fsids, cap * sizeof *fsids);
+
+            if (!fsids) {
+                fprintf(stderr, "Failed to allocate fsid statistics\n");
+                return -1;
+            }
+            diff->fsids = fsids;
+            diff->cap = cap;
+        }
+        memset(&diff->fsids[i], 0, sizeof diff->fsids[i]);
+        memcpy(&diff->fsids[i].fsid, r->fsid, sizeof r->fsid);
+        diff->nfsids++;
+    }
+
+    diff->last = i;
+    diff->fsids[i].counts[kind]++;
+    return 0;
+}
+
+static int is_lost(unsigned int state) {
+    return !(state & (LF_STATE_OPEN | LF_STATE_LOCK));
+}
+
+static void list_entry(char sign, const struct emit_record *r, const struct emit_record *prev) {
+    struct lf_node node;
+    char handle[128];
+    char state[128];
+    char old[128];
+
+    emit_record_node(r, &node);
+    mount_format_handle(&node.fh, handle, sizeof handle);
+    lf_state_format(r->state, state, sizeof state);
+    if (prev) {
+        lf_state_format(prev->state, old, sizeof old);
+        printf("%c %s: bucket %u at %#llx, %s -> %s\n", sign, handle, r->bucket, (unsigned long long)r->addr, old,
+               state);
+    } else {
+        printf("%c %s: bucket %u at %#llx, %s\n", sign, handle, r->bucket, (unsigned long long)r->addr, state);
+    }
+}
+
+static int load_side(struct side *side, size_t mem, int key, int verbose) {
+    struct snapshot_cursor cursor;
+    const struct emit_record *r;
+    struct timespec start;
+    int rc;
+
+    if (snapshot_open(&side->snap, side->path) < 0) {
+        return -1;
+    }
+    if (!(side->snap.header->flags & SNAPSHOT_COMPLETE)) {
+        fprintf(stderr, "Snapshot %s is incomplete; entries in the buckets it missed show as added or removed\n",
+                side->path);
+    }
+
+    if (extsort_init(&side->sort, sizeof *r, mem, key == KEY_HANDLE ? sort_by_handle : sort_by_addr) < 0) {
+        fprintf(stderr, "Failed to allocate the sort buffer\n");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (snapshot_cursor_init(&cursor, &side->snap) < 0) {
+        return -1;
+    }
+    while ((rc = snapshot_cursor_record(&cursor, &r)) > 0) {
+        if (extsort_add(&side->sort, r) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+    snapshot_cursor_free(&cursor);
+    if (rc < 0 || extsort_finish(&side->sort) < 0) {
+        return -1;
+    }
+    if (verbose) {
+        fprintf(stderr, "Sorted %llu rows of %s in %zu runs in %.3fms\n", (unsigned long long)side->sort.records,
+                side->path, side->sort.nruns ? side->sort.nruns : 1, elapsed_ms(&start));
+    }
+    return 0;
+}
+
+static int advance(struct side *side) {
+    const void *r;
+    int rc = extsort_next(&side->sort, &r);
+
+    side->cur = rc > 0 ? r : NULL;
+    return rc;
+}
+
+// Joins the two sorted streams, counting and optionally listing every entry.
+// Both cursors point into their sort's buffers, so the old entry of a match
+// is copied before the next one is read.
+static int join(struct side *old, struct side *new, int key, int list, struct diff *diff) {
+    int (*compare)(const struct emit_record *, const struct emit_record *) =
+            key == KEY_HANDLE ? compare_handles : compare_addrs;
+
+    if (advance(old) < 0 || advance(new) < 0) {
+        return -1;
+    }
+
+    while (old->cur || new->cur) {
+        int c;
+
+        if (!old->cur) {
+            c = 1;
+        } else if (!new->cur) {
+            c = -1;
+        } else {
+            c = compare(old->cur, new->cur);
+        }
+
+        if (c < 0) {
+            if (list) {
+                list_entry('-', old->cur, NULL);
+            }
+            if (count_fsid(diff, old->cur, DIFF_REMOVED) < 0 || advance(old) < 0) {
+                return -1;
+            }
+        } else if (c > 0) {
+            if (list) {
+                list_entry('+', new->cur, NULL);
+            }
+            if (count_fsid(diff, new->cur, DIFF_ADDED) < 0 ||
+                (is_lost(new->cur->state) && count_fsid(diff, new->cur, DIFF_NOW_LOST) < 0) ||
+                advance(new) < 0) {
+                return -1;
+            }
+        } else {
+            struct emit_record prev = *old->cur;
+
+            diff->moved += prev.addr != new->cur->addr;
+            if (prev.state == new->cur->state) {
+                if (count_fsid(diff, new->cur, DIFF_UNCHANGED) < 0) {
+                    return -1;
+                }
+            } else {
+                if (list) {
+                    list_entry('~', new->cur, &prev);
+                }
+                if (count_fsid(diff, new->cur, DIFF_CHANGED) < 0 ||
+                    (is_lost(new->cur->state) && !is_lost(prev.state) &&
+                     count_fsid(diff, new->cur, DIFF_NOW_LOST) < 0)) {
+                    return -1;
+                }
+            }
+            if (advance(old) < 0 || advance(new) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void report_snapshot(const char *label, const struct snapshot *s) {
+    const struct snapshot_header *h = s->header;
+    time_t taken = h->taken;
+    struct tm *tm;
+    char when[64];
+
+    tm = localtime(&taken);
+    // A corrupt header can hold a time that localtime() cannot represent.
+    if (!tm || !strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S %Z", tm)) {
+        snprintf(when, sizeof when, "at time %lld", (long long)h->taken);
+    }
+    printf("%s snapshot: taken %s, %llu entries, %llu lost\n", label, when, (unsigned long long)h->nrecords,
+           (unsigned long long)h->lost);
+}
+
+static unsigned long fsid_changes(const struct diff_fsid *f) {
+    return f->counts[DIFF_ADDED] + f->counts[DIFF_REMOVED] + f->counts[DIFF_CHANGED];
+}
+
+static int compare_diff_fsids(const void *a, const void *b) {
+    unsigned long na = fsid_changes(a);
+    unsigned long nb = fsid_changes(b);
+
+    return na < nb ? 1 : na > nb ? -1 : 0;
+}
+
+static int report_diff(struct diff *diff, const struct side *old, const struct side *new, int key, int by_mount,
+                       const char *mount_file) {
+    struct mount_table mounts;
+    int64_t elapsed = new->snap.header->taken - old->snap.header->taken;
+
+    if (by_mount) {
+        int rc = mount_file ? mount_table_load_file(&mounts, mount_file) : mount_table_load(&mounts);
+
+        if (rc < 0) {
+            return -1;
+        }
+    }
+
+    report_snapshot("Old", &old->snap);
+    report_snapshot("New", &new->snap);
+    printf("Matched by %s over %lld seconds: %lu added, %lu removed, %lu changed, %lu unchanged\n",
+           key == KEY_HANDLE ? "handle" : "address", (long long)elapsed, diff->counts[DIFF_ADDED],
+           diff->counts[DIFF_REMOVED], diff->counts[DIFF_CHANGED], diff->counts[DIFF_UNCHANGED]);
+    if (key == KEY_HANDLE && diff->moved) {
+        printf("Handles matched at a different address: %lu\n", diff->moved);
+    }
+    printf("Newly lost file handles: %lu\n", diff->counts[DIFF_NOW_LOST]);
+
+    qsort(diff->fsids, diff->nfsids, sizeof *diff->fsids, compare_diff_fsids);
+    printf("\n%10s %10s %10s %10s %10s  ", "ADDED", "REMOVED", "CHANGED", "UNCHANGED", "NOW LOST");
+    printf(by_mount ? "%-17s  MOUNT\n" : "%s\n", "FSID");
+    for (size_t i = 0; i < diff->nfsids; i++) {
+        const struct diff_fsid *f = &diff->fsids[i];
+        char fsid[32];
+
+        mount_format_fsid(&f->fsid, fsid, sizeof fsid);
+        printf("%10lu %10lu %10lu %10lu %10lu  ", f->counts[DIFF_ADDED], f->counts[DIFF_REMOVED],
+               f->counts[DIFF_CHANGED], f->counts[DIFF_UNCHANGED], f->counts[DIFF_NOW_LOST]);
+        if (by_mount) {
+            const char *path = mount_table_lookup(&mounts, &f->fsid);
+
+            printf("%-17s  %s\n", fsid, path ? path : "(not mounted)");
+        } else {
+            printf("%s\n", fsid);
+        }
+    }
+
+    if (by_mount) {
+        mount_table_free(&mounts);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct side old = {0};
+    struct side new = {0};
+    struct diff diff = {0};
+    const char *mount_file = NULL;
+    unsigned long memory = DEFAULT_MEMORY_MB;
+    int key = KEY_HANDLE;
+    int by_mount = 0;
+    int list = 0;
+    int verbose = 0;
+    char *end;
+    int ch;
+
+    while ((ch = getopt_long(argc, argv, "k:lmM:v", long_options, NULL)) != -1) {
+        switch (ch) {
+            case 'k':
+                if (strcmp(optarg, "handle") == 0) {
+                    key = KEY_HANDLE;
+                } else if (strcmp(optarg, "addr") == 0) {
+                    key = KEY_ADDR;
+                } else {
+                    fprintf(stderr, "Unknown key: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'l':
+                list = 1;
+                break;
+            case 'm':
+                by_mount = 1;
+                break;
+            case 'M':
+                by_mount = 1;
+                mount_file = optarg;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case OPT_MEMORY:
+                memory = strtoul(optarg, &end, 10);
+                if (*end || memory < 1) {
+                    fprintf(stderr, "Invalid memory limit: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    old.path = argv[optind];
+    new.path = argv[optind + 1];
+
+    if (load_side(&old, memory * 1024 * 1024 / 2, key, verbose) < 0 ||
+        load_side(&new, memory * 1024 * 1024 / 2, key, verbose) < 0) {
+        return 1;
+    }
+
+    if (join(&old, &new, key, list, &diff) < 0) {
+        return 1;
+    }
+    if (list && (diff.counts[DIFF_ADDED] || diff.counts[DIFF_REMOVED] || diff.counts[DIFF_CHANGED])) {
+        printf("\n");
+    }
+
+    if (report_diff(&diff, &old, &new, key, by_mount, mount_file) < 0) {
+        return 1;
+    }
+
+    free(diff.fsids);
+    extsort_free(&old.sort);
+    extsort_free(&new.sort);
+    snapshot_close(&old.snap);
+    snapshot_close(&new.snap);
+    return 0;
+}
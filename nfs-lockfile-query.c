@@ -0,0 +1,288 @@
+#include <ctype.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filter.h"
+#include "lockfile.h"
+#include "mount-table.h"
+#include "query.h"
+#include "snapshot.h"
+
+// This program answers ad hoc questions about a snapshot without a new
+// analysis being written for each of them. A query is a filter (-f, the
+// filter language of nfs-lockfile-counter), the keys to group by (-g) and the
+// aggregates to compute for each group (-a), as described in query.h. For
+// example, the fsid with the most lost entries in bucket 7:
+//
+//   nfs-lockfile-query -f bucket=7,state=lost -g fsid -l 1 lockhash.snp
+//
+// The groups are printed by their first aggregate, largest first, and -l
+// keeps only the first ones. The scan runs on -j threads, all the processors
+// by default. It is fastest on a columnar snapshot, which is read in place;
+// the rows of other snapshots are decoded first. With -v, the time the scan
+// took is printed.
+
+static const struct option long_options[] = {
+        {"filter", required_argument, NULL, 'f'},
+        {"group", required_argument, NULL, 'g'},
+        {"aggregate", required_argument, NULL, 'a'},
+        {"limit", required_argument, NULL, 'l'},
+        {NULL, 0, NULL, 0},
+};
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-f|--filter expr] [-g|--group fsid,bucket,state] [-a|--aggregate agg,...]\n"
+                    "       [-l|--limit groups] [-j threads] [-m] [-M mount-table] [-v] snapshot\n", name);
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// qsort() has no argument for the comparison, so the query it sorts for is
+// kept here.
+static const struct query *sort_query;
+static const struct query_result *sort_result;
+
+static int compare_groups(const void *a, const void *b) {
+    size_t i = *(const size_t *)a;
+    size_t j = *(const size_t *)b;
+    const struct query_group *gi = &sort_result->groups[i];
+    const struct query_group *gj = &sort_result->groups[j];
+    uint64_t vi = sort_result->values[i * sort_query->naggs];
+    uint64_t vj = sort_result->values[j * sort_query->naggs];
+
+    if (vi != vj) {
+        if (query_agg_signed(&sort_query->aggs[0])) {
+            return (int64_t)vi < (int64_t)vj ? 1 : -1;
+        }
+        return vi < vj ? 1 : -1;
+    }
+    if (gi->fsid != gj->fsid) {
+        return gi->fsid < gj->fsid ? -1 : 1;
+    }
+    if (gi->bucket != gj->bucket) {
+        return gi->bucket < gj->bucket ? -1 : 1;
+    }
+    return gi->state < gj->state ? -1 : gi->state > gj->state;
+}
+
+static void format_value(const struct query_agg *agg, const struct query_group *g, uint64_t v, char *buf,
+                         size_t len) {
+    if (agg->kind >= QUERY_MIN && !g->rows) {
+        snprintf(buf, len, "-");
+    } else if (agg->kind >= QUERY_MIN && agg->field == QUERY_ADDR) {
+        snprintf(buf, len, "%#llx", (unsigned long long)v);
+    } else if (query_agg_signed(agg)) {
+        snprintf(buf, len, "%lld", (long long)(int64_t)v);
+    } else {
+        snprintf(buf, len, "%llu", (unsigned long long)v);
+    }
+}
+
+// Prints one row of the report: the aggregates right aligned, then the group
+// keys, each left aligned unless it is the last column.
+static void print_row(const struct query *q, const char *const *values, const char *bucket, const char *fsid,
+                      const char *state, int state_width, const char *mount) {
+    for (int a = 0; a < q->naggs; a++) {
+        int width = strlen(q->aggs[a].name) > 10 ? (int)strlen(q->aggs[a].name) : 10;
+
+        printf("%s%*s", a ? " " : "", width, values[a]);
+    }
+    if (bucket) {
+        printf("  %10s", bucket);
+    }
+    if (fsid) {
+        printf("  %-*s", state || mount ? 17 : 0, fsid);
+    }
+    if (state) {
+        printf("  %-*s", mount ? state_width : 0, state);
+    }
+    if (mount) {
+        printf("  %s", mount);
+    }
+    printf("\n");
+}
+
+static int report(const struct query *q, const struct query_result *r, size_t limit, const struct mount_table *mounts) {
+    const char *values[QUERY_MAX_AGGS];
+    char names[QUERY_MAX_AGGS][sizeof q->aggs[0].name];
+    size_t count = r->ngroups < limit ? r->ngroups : limit;
+    int by_mount = mounts && q->group & QUERY_GROUP_FSID;
+    int state_width = 5;
+    size_t *order;
+
+    order = malloc(r->ngroups * sizeof *order + 1);
+    if (!order) {
+        fprintf(stderr, "Failed to allocate the query report\n");
+        return -1;
+    }
+    for (size_t i = 0; i < r->ngroups; i++) {
+        order[i] = i;
+    }
+    sort_query = q;
+    sort_result = r;
+    qsort(order, r->ngroups, sizeof *order, compare_groups);
+
+    for (size_t i = 0; i < count && q->group & QUERY_GROUP_STATE; i++) {
+        char state[128];
+
+        lf_state_format(r->groups[order[i]].state, state, sizeof state);
+        state_width = (int)strlen(state) > state_width ? (int)strlen(state) : state_width;
+    }
+
+    for (int a = 0; a < q->naggs; a++) {
+        for (size_t c = 0; c < sizeof names[a]; c++) {
+            names[a][c] = toupper((unsigned char)q->aggs[a].name[c]);
+        }
+        values[a] = names[a];
+    }
+    printf("\n");
+    print_row(q, values, q->group & QUERY_GROUP_BUCKET ? "BUCKET" : NULL, q->group & QUERY_GROUP_FSID ? "FSID" : NULL,
+              q->group & QUERY_GROUP_STATE ? "STATE" : NULL, state_width, by_mount ? "MOUNT" : NULL);
+
+    for (size_t i = 0; i < count; i++) {
+        const struct query_group *g = &r->groups[order[i]];
+        fsid_t fsid = {.val = {(int32_t)(g->fsid >> 32), (int32_t)g->fsid}};
+        const char *path = by_mount ? mount_table_lookup(mounts, &fsid) : NULL;
+        char text[QUERY_MAX_AGGS][32];
+        char bucket[16];
+        char fsid_text[32];
+        char state[128];
+
+        for (int a = 0; a < q->naggs; a++) {
+            format_value(&q->aggs[a], g, r->values[order[i] * q->naggs + a], text[a], sizeof text[a]);
+            values[a] = text[a];
+        }
+        snprintf(bucket, sizeof bucket, "%u", g->bucket);
+        mount_format_fsid(&fsid, fsid_text, sizeof fsid_text);
+        lf_state_format(g->state, state, sizeof state);
+        print_row(q, values, q->group & QUERY_GROUP_BUCKET ? bucket : NULL,
+                  q->group & QUERY_GROUP_FSID ? fsid_text : NULL, q->group & QUERY_GROUP_STATE ? state : NULL,
+                  state_width, by_mount ? path ? path : "(not mounted)" : NULL);
+    }
+    if (count < r->ngroups) {
+        printf("... and %zu more groups\n", r->ngroups - count);
+    }
+
+    free(order);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct snapshot snap;
+    struct query q = {0};
+    struct query_result result;
+    struct filter filter;
+    struct mount_table mounts;
+    const char *mount_file = NULL;
+    int by_mount = 0;
+    size_t limit = SIZE_MAX;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct timespec start;
+    int verbose = 0;
+    char *end;
+    int ch;
+
+    q.nworkers = cpus > 0 ? cpus : 1;
+    if (query_parse_aggs(&q, "count") < 0) {
+        return 1;
+    }
+
+    while ((ch = getopt_long(argc, argv, "a:f:g:j:l:mM:v", long_options, NULL)) != -1) {
+        switch (ch) {
+            case 'a':
+                if (query_parse_aggs(&q, optarg) < 0) {
+                    return 1;
+                }
+                break;
+            case 'f':
+                if (filter_compile(&filter, optarg) < 0) {
+                    return 1;
+                }
+                q.filter = &filter;
+                break;
+            case 'g':
+                if (query_parse_group(&q, optarg) < 0) {
+                    return 1;
+                }
+                break;
+            case 'j':
+                q.nworkers = atoi(optarg);
+                if (q.nworkers < 1) {
+                    fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'l':
+                limit = strtoul(optarg, &end, 10);
+                if (*end || limit < 1) {
+                    fprintf(stderr, "Invalid limit: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                by_mount = 1;
+                break;
+            case 'M':
+                by_mount = 1;
+                mount_file = optarg;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (snapshot_open(&snap, argv[optind]) < 0) {
+        return 1;
+    }
+    if (by_mount && (mount_file ? mount_table_load_file(&mounts, mount_file) : mount_table_load(&mounts)) < 0) {
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (query_run(&q, &snap, &result) < 0) {
+        return 1;
+    }
+    if (verbose) {
+        fprintf(stderr, "Scanned %s snapshot with %d thread%s in %.3fms\n",
+                snap.records ? "row" : snap.blocks ? "compressed" : "columnar", result.nworkers,
+                result.nworkers == 1 ? "" : "s", elapsed_ms(&start));
+    }
+
+    printf("Matched %llu of %llu entries", (unsigned long long)result.matched, (unsigned long long)result.scanned);
+    if (q.group) {
+        printf(" in %zu groups", result.ngroups);
+    }
+    printf("\n");
+    if (!(snap.header->flags & SNAPSHOT_COMPLETE)) {
+        printf("The snapshot is incomplete, so these are the entries it captured\n");
+    }
+    if (report(&q, &result, limit, by_mount ? &mounts : NULL) < 0) {
+        return 1;
+    }
+
+    if (by_mount) {
+        mount_table_free(&mounts);
+    }
+    query_result_free(&result);
+    snapshot_close(&snap);
+    return 0;
+}
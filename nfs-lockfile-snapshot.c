@@ -0,0 +1,278 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "analyses.h"
+#include "chain-stats.h"
+#include "emit.h"
+#include "filter.h"
+#include "lockfile.h"
+#include "snapshot.h"
+
+// This program runs the analyses of nfs-lockfile-counter against a snapshot
+// of the nfslockhash table captured with nfs-lockfile-counter --snapshot (see
+// snapshot.h). It does not use libkvm and builds on any system, so a capture
+// taken on a struggling server can be examined on another machine, as often
+// as needed, without walking kernel memory again.
+//
+// The snapshot is mapped into memory and its records are read in place, one
+// bucket after the other, or decompressed one block at a time. -H takes the
+// chain lengths from the bucket index, so it needs no pass over the records
+// at all. The lost and orphaned entries are counted with
+// snapshot_count_clear(), which for a columnar snapshot only reads the
+// bitmaps of the list heads. With -v, the time that took is printed.
+//
+// The analysis options are the counter's: -m and -M, -S, -T and --top-prefix,
+// -D and --duplicates, -A and its --audit-* options, -f, -o and --format. The
+// mount table given to -M should be the one of the captured server, as
+// getfsstat() would describe the machine the snapshot is read on.
+
+enum {
+    OPT_FORMAT = 256,
+};
+
+static const struct option long_options[] = {
+        {"histogram", no_argument, NULL, 'H'},
+        {"states", no_argument, NULL, 'S'},
+        {"top", required_argument, NULL, 'T'},
+        {"top-prefix", required_argument, NULL, OPT_TOP_PREFIX},
+        {"distinct", no_argument, NULL, 'D'},
+        {"duplicates", no_argument, NULL, OPT_DUPLICATES},
+        {"filter", required_argument, NULL, 'f'},
+        {"output", required_argument, NULL, 'o'},
+        {"format", required_argument, NULL, OPT_FORMAT},
+        {"audit", no_argument, NULL, 'A'},
+        {"audit-sizes", required_argument, NULL, OPT_AUDIT_SIZES},
+        {"audit-target", required_argument, NULL, OPT_AUDIT_TARGET},
+        {NULL, 0, NULL, 0},
+};
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-m] [-M mount-table] [-H|--histogram] [-S|--states]\n"
+                    "       [-T|--top k] [--top-prefix bytes] [-D|--distinct] [--duplicates]\n"
+                    "       [-o|--output file] [--format ndjson|binary] [-f|--filter expr]\n"
+                    "       [-A|--audit] [--audit-sizes n,...] [--audit-target nodes] [-v] snapshot\n", name);
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int report_header(const struct snapshot *s, int verbose) {
+    const struct snapshot_header *h = s->header;
+    time_t taken = h->taken;
+    unsigned long complete = 0;
+    unsigned long damaged = 0;
+    uint64_t lost;
+    uint64_t orphaned;
+    struct timespec start;
+    struct tm *tm;
+    char when[64];
+
+    for (uint32_t bucket = 0; bucket < h->hashsize; bucket++) {
+        complete += (s->buckets[bucket] & SNAPSHOT_BUCKET_COMPLETE) != 0;
+        damaged += (s->buckets[bucket] & SNAPSHOT_BUCKET_DAMAGE) != 0;
+    }
+
+    tm = localtime(&taken);
+    // A corrupt header can hold a time that localtime() cannot represent.
+    if (!tm || !strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S %Z", tm)) {
+        snprintf(when, sizeof when, "at time %lld", (long long)h->taken);
+    }
+    printf("Snapshot of %u buckets at %#llx, read with layout %.*s, taken %s\n", h->hashsize,
+           (unsigned long long)h->table, (int)sizeof h->layout, h->layout, when);
+    printf("Total file handles: %llu\n", (unsigned long long)h->total);
+    printf("Lost file handles: %llu\n", (unsigned long long)h->lost);
+    if (!(h->flags & SNAPSHOT_COMPLETE)) {
+        printf("Capture incomplete: %lu of %u buckets walked, %llu entries captured\n", complete, h->hashsize,
+               (unsigned long long)h->nrecords);
+    }
+    if (damaged) {
+        printf("Damaged buckets: %lu (their chains end where the damage was found)\n", damaged);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (snapshot_count_clear(s, LF_STATE_OPEN | LF_STATE_LOCK, &lost) < 0 ||
+        snapshot_count_clear(s, LF_NSTATES - 1, &orphaned) < 0) {
+        return -1;
+    }
+    if (verbose) {
+        fprintf(stderr, "Counted %s snapshot in %.3fms\n",
+                s->records ? "row" : s->blocks ? "compressed" : "columnar", elapsed_ms(&start));
+    }
+    printf("Captured entries: %llu (%llu lost, %llu orphaned)\n", (unsigned long long)h->nrecords,
+           (unsigned long long)lost, (unsigned long long)orphaned);
+    return 0;
+}
+
+static int report_histogram(const struct snapshot *s) {
+    uint32_t hashsize = s->header->hashsize;
+    unsigned long *len;
+    unsigned char *complete;
+    struct chain_stats cs;
+    int rc = -1;
+
+    len = malloc(hashsize * sizeof *len);
+    complete = malloc(hashsize);
+    if (!len || !complete) {
+        fprintf(stderr, "Failed to allocate chain statistics\n");
+        goto out;
+    }
+
+    for (uint32_t bucket = 0; bucket < hashsize; bucket++) {
+        len[bucket] = snapshot_chain_len(s, bucket);
+        complete[bucket] = (s->buckets[bucket] & SNAPSHOT_BUCKET_COMPLETE) != 0;
+    }
+
+    if (chain_stats_compute(len, complete, hashsize, &cs) < 0) {
+        fprintf(stderr, "Failed to allocate chain statistics\n");
+        goto out;
+    }
+
+    printf("\n");
+    chain_stats_print_histogram(len, complete, hashsize, stdout);
+    chain_stats_print(&cs, stdout);
+    rc = 0;
+
+out:
+    free(complete);
+    free(len);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    struct snapshot snap;
+    struct analyses an = {0};
+    struct emitter emitter;
+    const char *output = NULL;
+    int format = EMIT_NDJSON;
+    struct filter filter;
+    const struct filter *match = NULL;
+    unsigned long matched = 0;
+    unsigned long matched_lost = 0;
+    int histogram = 0;
+    int verbose = 0;
+    int complete;
+    int rc;
+    int ch;
+
+    while ((ch = getopt_long(argc, argv, ANALYSES_SHORT_OPTIONS "f:Ho:v", long_options, NULL)) != -1) {
+        rc = analyses_option(&an, ch, optarg);
+        if (rc < 0) {
+            return 1;
+        }
+        if (rc > 0) {
+            continue;
+        }
+
+        switch (ch) {
+            case 'f':
+                if (filter_compile(&filter, optarg) < 0) {
+                    return 1;
+                }
+                match = &filter;
+                break;
+            case 'H':
+                histogram = 1;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case OPT_FORMAT:
+                format = emitter_format(optarg);
+                if (format < 0) {
+                    fprintf(stderr, "Unknown output format: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (snapshot_open(&snap, argv[optind]) < 0) {
+        return 1;
+    }
+
+    if (output) {
+        if (emitter_open(&emitter, output, format) < 0) {
+            return 1;
+        }
+        if (strcmp(output, "-") == 0 && dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "Failed to redirect the report: %s\n", strerror(errno));
+            return 1;
+        }
+        an.emitter = &emitter;
+    }
+
+    if (analyses_init(&an, snap.header->hashsize) < 0) {
+        return 1;
+    }
+
+    // Only decode the rows if an analysis, the filter or the output needs them.
+    if (analyses_fields(&an) || match) {
+        struct snapshot_cursor cursor;
+        struct lf_node node;
+
+        if (snapshot_cursor_init(&cursor, &snap) < 0) {
+            return 1;
+        }
+        while ((rc = snapshot_cursor_next(&cursor, &node)) > 0) {
+            if (match) {
+                if (!filter_match(match, &node)) {
+                    continue;
+                }
+                matched++;
+                matched_lost += lf_is_lost(&node);
+            }
+            if (analyses_visit(&node, &an) < 0) {
+                return 1;
+            }
+        }
+        snapshot_cursor_free(&cursor);
+        if (rc < 0) {
+            return 1;
+        }
+    }
+
+    if (an.emitter && emitter_close(an.emitter) < 0) {
+        return 1;
+    }
+
+    if (report_header(&snap, verbose) < 0) {
+        return 1;
+    }
+    if (match) {
+        printf("Matching file handles: %lu (%lu lost)\n", matched, matched_lost);
+    }
+
+    if (histogram && report_histogram(&snap) < 0) {
+        return 1;
+    }
+
+    complete = (snap.header->flags & SNAPSHOT_COMPLETE) != 0;
+    if (analyses_report(&an, match ? matched : snap.header->nrecords, complete) < 0) {
+        return 1;
+    }
+
+    analyses_free(&an);
+    snapshot_close(&snap);
+    return 0;
+}
@@ -0,0 +1,874 @@
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "query.h"
+
+#define NSTATES (SNAPSHOT_NCOLUMNS - SNAPSHOT_COL_STATE)
+#define BATCH_WORDS (QUERY_BATCH / 64)
+
+// Rows claimed by a worker at a time. A compressed snapshot is claimed a
+// block at a time instead, so each block is decompressed once.
+#define QUERY_RANGE (64 * QUERY_BATCH)
+
+// Flips the sign bit of a signed value so that it orders as an unsigned one.
+#define SIGN_BIT (1ULL << 63)
+
+static const char *const field_names[QUERY_NFIELDS] = {
+        [QUERY_ADDR] = "addr",
+        [QUERY_BUCKET] = "bucket",
+        [QUERY_USECOUNT] = "usecount",
+        [QUERY_LCK_USECNT] = "lck_usecnt",
+        [QUERY_LCK_LOCK] = "lck_lock",
+        [QUERY_FID_LEN] = "fid_len",
+};
+
+// QUERY_BATCH rows, as columns. The value columns point either into a
+// columnar snapshot or at a batch_rows, and the state bitmaps hold row i as
+// bit i % 64 of word i / 64. `sel` marks the rows that are still selected.
+struct batch {
+    uint32_t n;
+    const uint64_t *addr;
+    const uint32_t *bucket;
+    const fsid_t *fsid;
+    const struct fid *fid;
+    const int32_t *usecount;
+    const uint32_t *lck_usecnt;
+    const uint8_t *lck_lock;
+    const uint64_t *state[NSTATES];
+    uint64_t sel[BATCH_WORDS];
+};
+
+// The rows of a snapshot that is not columnar, transposed into columns.
+struct batch_rows {
+    uint64_t addr[QUERY_BATCH];
+    uint32_t bucket[QUERY_BATCH];
+    fsid_t fsid[QUERY_BATCH];
+    struct fid fid[QUERY_BATCH];
+    int32_t usecount[QUERY_BATCH];
+    uint32_t lck_usecnt[QUERY_BATCH];
+    uint8_t lck_lock[QUERY_BATCH];
+    uint64_t state[NSTATES][BATCH_WORDS];
+};
+
+struct values {
+    uint64_t *v;
+    size_t count;
+    size_t cap;
+};
+
+// The groups found by one worker, in the order they were first seen. Each
+// group has naggs accumulators and a value list per percentile field.
+struct table {
+    struct query_group *groups;
+    uint64_t *acc;
+    struct values *lists;
+    size_t count;
+    size_t cap;
+    uint32_t *slots;            // Index of a group plus one, or zero
+    size_t nslots;
+};
+
+struct plan {
+    const struct query *q;
+    const struct snapshot *s;
+    int naggs;
+    int nlists;
+    int list_of[QUERY_MAX_AGGS];    // Value list of each percentile
+    enum query_field list_field[QUERY_MAX_AGGS];
+    int count_only;             // No groups and only count, lost and orphaned
+    uint64_t nrows;
+    uint64_t range_rows;
+    uint64_t nranges;
+    atomic_ulong next;
+    atomic_int failed;
+};
+
+struct worker {
+    pthread_t thread;
+    struct plan *plan;
+    struct table table;
+    struct snapshot_cursor cursor;
+    struct batch_rows *rows;
+    uint64_t scanned;
+    uint64_t matched;
+};
+
+int query_parse_aggs(struct query *q, const char *spec) {
+    const char *p = spec;
+
+    q->naggs = 0;
+    while (*p) {
+        const char *end = p + strcspn(p, ",");
+        struct query_agg *a = &q->aggs[q->naggs];
+        const char *open;
+        size_t len;
+        int field = -1;
+        char *num_end;
+
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        len = end - p;
+        while (len > 0 && isspace((unsigned char)p[len - 1])) {
+            len--;
+        }
+
+        if (q->naggs == QUERY_MAX_AGGS) {
+            fprintf(stderr, "A query can have at most %d aggregates\n", QUERY_MAX_AGGS);
+            return -1;
+        }
+        if (len == 0 || len >= sizeof a->name) {
+            fprintf(stderr, "Invalid aggregate: %.*s\n", (int)(end - p), p);
+            return -1;
+        }
+        memset(a, 0, sizeof *a);
+        memcpy(a->name, p, len);
+
+        open = memchr(p, '(', len);
+        if (!open) {
+            if (strcmp(a->name, "count") == 0) {
+                a->kind = QUERY_COUNT;
+            } else if (strcmp(a->name, "lost") == 0) {
+                a->kind = QUERY_LOST;
+            } else if (strcmp(a->name, "orphaned") == 0) {
+                a->kind = QUERY_ORPHANED;
+            } else {
+                fprintf(stderr, "Unknown aggregate: %s\n", a->name);
+                return -1;
+            }
+        } else {
+            size_t name_len = p + len - open - 2;
+
+            for (int i = 0; i < QUERY_NFIELDS; i++) {
+                if (strlen(field_names[i]) == name_len && strncmp(field_names[i], open + 1, name_len) == 0) {
+                    field = i;
+                }
+            }
+            if (p[len - 1] != ')' || field < 0) {
+                fprintf(stderr, "Invalid field in aggregate: %s\n", a->name);
+                return -1;
+            }
+            a->field = field;
+
+            if (open - p == 3 && strncmp(p, "min", 3) == 0) {
+                a->kind = QUERY_MIN;
+            } else if (open - p == 3 && strncmp(p, "max", 3) == 0) {
+                a->kind = QUERY_MAX;
+            } else if (*p == 'p' && open - p > 1) {
+                a->kind = QUERY_PERCENTILE;
+                a->percentile = strtod(p + 1, &num_end);
+                if (num_end != open || a->percentile < 0 || a->percentile > 100) {
+                    fprintf(stderr, "Invalid percentile: %s\n", a->name);
+                    return -1;
+                }
+            } else {
+                fprintf(stderr, "Unknown aggregate: %s\n", a->name);
+                return -1;
+            }
+        }
+
+        q->naggs++;
+        p = *end ? end + 1 : end;
+    }
+
+    if (q->naggs == 0) {
+        fprintf(stderr, "A query needs at least one aggregate\n");
+        return -1;
+    }
+    return 0;
+}
+
+int query_parse_group(struct query *q, const char *spec) {
+    const char *p = spec;
+
+    q->group = 0;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+
+        if (len == 4 && strncmp(p, "fsid", 4) == 0) {
+            q->group |= QUERY_GROUP_FSID;
+        } else if (len == 6 && strncmp(p, "bucket", 6) == 0) {
+            q->group |= QUERY_GROUP_BUCKET;
+        } else if (len == 5 && strncmp(p, "state", 5) == 0) {
+            q->group |= QUERY_GROUP_STATE;
+        } else {
+            fprintf(stderr, "Unknown group key: %.*s\n", (int)len, p);
+            return -1;
+        }
+        p += len;
+        p += *p == ',';
+    }
+    return 0;
+}
+
+int query_agg_signed(const struct query_agg *agg) {
+    return agg->kind >= QUERY_MIN && agg->field == QUERY_USECOUNT;
+}
+
+static uint64_t group_hash(uint64_t fsid, uint32_t bucket, uint32_t state) {
+    uint64_t h = fsid * 0x9e3779b97f4a7c15ULL ^ ((uint64_t)bucket << 8 | state);
+
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ h >> 32;
+}
+
+static int table_grow(struct table *t, const struct plan *p) {
+    if (t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 64;
+        struct query_group *groups = realloc(t->groups, cap * sizeof *groups);
+        uint64_t *acc;
+        struct values *lists;
+
+        if (!groups) {
+            return -1;
+        }
+        t->groups = groups;
+        acc = realloc(t->acc, cap * p->naggs * sizeof *acc);
+        if (!acc) {
+            return -1;
+        }
+        t->acc = acc;
+        if (p->nlists) {
+            lists = realloc(t->lists, cap * p->nlists * sizeof *lists);
+            if (!lists) {
+                return -1;
+            }
+            t->lists = lists;
+        }
+        t->cap = cap;
+    }
+
+    // Keep the load factor at one half.
+    if (2 * (t->count + 1) > t->nslots) {
+        size_t nslots = t->nslots ? t->nslots * 2 : 128;
+        uint32_t *slots = calloc(nslots, sizeof *slots);
+
+        if (!slots) {
+            return -1;
+        }
+        for (size_t i = 0; i < t->count; i++) {
+            const struct query_group *g = &t->groups[i];
+            size_t slot = group_hash(g->fsid, g->bucket, g->state) & (nslots - 1);
+
+            while (slots[slot]) {
+                slot = (slot + 1) & (nslots - 1);
+            }
+            slots[slot] = i + 1;
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->nslots = nslots;
+    }
+    return 0;
+}
+
+// Returns the index of the group with the given keys, adding it if it is new,
+// or -1 if memory runs out.
+static long table_find(struct table *t, const struct plan *p, uint64_t fsid, uint32_t bucket, uint32_t state) {
+    size_t slot;
+    struct query_group *g;
+    uint64_t *acc;
+
+    if (t->nslots) {
+        slot = group_hash(fsid, bucket, state) & (t->nslots - 1);
+        while (t->slots[slot]) {
+            g = &t->groups[t->slots[slot] - 1];
+            if (g->fsid == fsid && g->bucket == bucket && g->state == state) {
+                return t->slots[slot] - 1;
+            }
+            slot = (slot + 1) & (t->nslots - 1);
+        }
+    }
+
+    if (table_grow(t, p) < 0) {
+        return -1;
+    }
+    slot = group_hash(fsid, bucket, state) & (t->nslots - 1);
+    while (t->slots[slot]) {
+        slot = (slot + 1) & (t->nslots - 1);
+    }
+    t->slots[slot] = t->count + 1;
+
+    g = &t->groups[t->count];
+    *g = (struct query_group){.fsid = fsid, .bucket = bucket, .state = state};
+    acc = &t->acc[t->count * p->naggs];
+    for (int a = 0; a < p->naggs; a++) {
+        acc[a] = p->q->aggs[a].kind == QUERY_MIN ? UINT64_MAX : 0;
+    }
+    if (p->nlists) {
+        memset(&t->lists[t->count * p->nlists], 0, p->nlists * sizeof *t->lists);
+    }
+    return t->count++;
+}
+
+static void table_free(struct table *t, const struct plan *p) {
+    for (size_t i = 0; t->lists && i < t->count * p->nlists; i++) {
+        free(t->lists[i].v);
+    }
+    free(t->groups);
+    free(t->acc);
+    free(t->lists);
+    free(t->slots);
+    memset(t, 0, sizeof *t);
+}
+
+static int values_add(struct values *l, uint64_t v) {
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 16;
+        uint64_t *values = realloc(l->v, cap * sizeof *values);
+
+        if (!values) {
+            return -1;
+        }
+        l->v = values;
+        l->cap = cap;
+    }
+    l->v[l->count++] = v;
+    return 0;
+}
+
+// Sets bit j of set for each of the first n values that compares true
+// against value. The operator is chosen outside the loops, so that each loop
+// is a plain comparison over an array that the compiler can vectorise. Both
+// sides are compared as type, signed for the use count as in filter_match().
+#define COMPARE_LOOP(set, values, n, type, cmp, value)                                 \
+    for (size_t j_ = 0; j_ < (n); j_++) {                                              \
+        (set) |= (uint64_t)((type)(values)[j_] cmp (type)(value)) << j_;               \
+    }
+
+#define COMPARE_ROWS(set, values, n, op, value, type)                                  \
+    switch (op) {                                                                      \
+        case FILTER_EQ:                                                                \
+            COMPARE_LOOP(set, values, n, type, ==, value)                              \
+            break;                                                                     \
+        case FILTER_NE:                                                                \
+            COMPARE_LOOP(set, values, n, type, !=, value)                              \
+            break;                                                                     \
+        case FILTER_LT:                                                                \
+            COMPARE_LOOP(set, values, n, type, <, value)                               \
+            break;                                                                     \
+        case FILTER_LE:                                                                \
+            COMPARE_LOOP(set, values, n, type, <=, value)                              \
+            break;                                                                     \
+        case FILTER_GT:                                                                \
+            COMPARE_LOOP(set, values, n, type, >, value)                               \
+            break;                                                                     \
+        case FILTER_GE:                                                                \
+            COMPARE_LOOP(set, values, n, type, >=, value)                              \
+            break;                                                                     \
+    }
+
+static int state_index(unsigned int bit) {
+    return __builtin_ctz(bit);
+}
+
+// Tests a filter term against the n rows of word k of the batch.
+static uint64_t term_word(const struct filter_term *t, const struct batch *b, size_t k, size_t n) {
+    size_t base = k * 64;
+    uint64_t set = 0;
+
+    switch (t->field) {
+        case FILTER_BUCKET:
+            COMPARE_ROWS(set, b->bucket + base, n, t->op, t->value, uint64_t)
+            return set;
+        case FILTER_ADDR:
+            COMPARE_ROWS(set, b->addr + base, n, t->op, t->value, uint64_t)
+            return set;
+        case FILTER_USECOUNT:
+            COMPARE_ROWS(set, b->usecount + base, n, t->op, t->value, int64_t)
+            return set;
+        case FILTER_STATE:
+            if (t->value == FILTER_STATE_LOST) {
+                set = ~(b->state[state_index(LF_STATE_OPEN)][k] | b->state[state_index(LF_STATE_LOCK)][k]);
+            } else if (t->value == FILTER_STATE_ORPHANED) {
+                for (int s = 0; s < NSTATES; s++) {
+                    set |= b->state[s][k];
+                }
+                set = ~set;
+            } else {
+                set = b->state[state_index(t->value)][k];
+            }
+            break;
+        case FILTER_FSID:
+            for (size_t j = 0; j < n; j++) {
+                set |= (uint64_t)(lf_fsid_key(&b->fsid[base + j]) == t->value) << j;
+            }
+            break;
+        case FILTER_FID:
+            // As match_fid() does, from fid_data0 on.
+            for (size_t j = 0; j < n; j++) {
+                const struct fid *fid = &b->fid[base + j];
+
+                set |= (uint64_t)(fid->fid_len >= t->fid_len && memcmp(&fid->fid_data0, t->fid, t->fid_len) == 0) << j;
+            }
+            break;
+    }
+    return t->op == FILTER_EQ ? set : ~set;
+}
+
+static unsigned int row_state(const struct batch *b, size_t i) {
+    unsigned int state = 0;
+
+    for (int s = 0; s < NSTATES; s++) {
+        state |= (unsigned int)(b->state[s][i / 64] >> (i % 64) & 1) << s;
+    }
+    return state;
+}
+
+static uint64_t row_value(const struct batch *b, size_t i, enum query_field field) {
+    switch (field) {
+        case QUERY_ADDR:
+            return b->addr[i];
+        case QUERY_BUCKET:
+            return b->bucket[i];
+        case QUERY_USECOUNT:
+            return (uint64_t)(int64_t)b->usecount[i] ^ SIGN_BIT;
+        case QUERY_LCK_USECNT:
+            return b->lck_usecnt[i];
+        case QUERY_LCK_LOCK:
+            return b->lck_lock[i];
+        case QUERY_FID_LEN:
+            return b->fid[i].fid_len;
+        case QUERY_NFIELDS:
+            break;
+    }
+    return 0;
+}
+
+static int add_row(struct worker *w, const struct batch *b, size_t i) {
+    const struct plan *p = w->plan;
+    const struct query *q = p->q;
+    unsigned int state = row_state(b, i);
+    long g;
+    uint64_t *acc;
+
+    g = table_find(&w->table, p, q->group & QUERY_GROUP_FSID ? lf_fsid_key(&b->fsid[i]) : 0,
+                   q->group & QUERY_GROUP_BUCKET ? b->bucket[i] : 0, q->group & QUERY_GROUP_STATE ? state : 0);
+    if (g < 0) {
+        return -1;
+    }
+
+    w->table.groups[g].rows++;
+    acc = &w->table.acc[g * p->naggs];
+    for (int a = 0; a < p->naggs; a++) {
+        const struct query_agg *agg = &q->aggs[a];
+        uint64_t v;
+
+        switch (agg->kind) {
+            case QUERY_COUNT:
+                acc[a]++;
+                break;
+            case QUERY_LOST:
+                acc[a] += !(state & (LF_STATE_OPEN | LF_STATE_LOCK));
+                break;
+            case QUERY_ORPHANED:
+                acc[a] += state == 0;
+                break;
+            case QUERY_MIN:
+                v = row_value(b, i, agg->field);
+                acc[a] = v < acc[a] ? v : acc[a];
+                break;
+            case QUERY_MAX:
+                v = row_value(b, i, agg->field);
+                acc[a] = v > acc[a] ? v : acc[a];
+                break;
+            case QUERY_PERCENTILE:
+                break;
+        }
+    }
+    for (int l = 0; l < p->nlists; l++) {
+        if (values_add(&w->table.lists[g * p->nlists + l], row_value(b, i, p->list_field[l])) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int scan_batch(struct worker *w, struct batch *b) {
+    const struct plan *p = w->plan;
+    const struct filter *f = p->q->filter;
+    size_t nwords = (b->n + 63) / 64;
+    uint64_t matched = 0;
+
+    for (size_t k = 0; k < nwords; k++) {
+        size_t n = b->n - k * 64 < 64 ? b->n - k * 64 : 64;
+
+        b->sel[k] = n == 64 ? ~0ULL : (1ULL << n) - 1;
+    }
+
+    for (int t = 0; f && t < f->nterms; t++) {
+        uint64_t any = 0;
+
+        for (size_t k = 0; k < nwords; k++) {
+            size_t n = b->n - k * 64 < 64 ? b->n - k * 64 : 64;
+
+            if (b->sel[k]) {
+                b->sel[k] &= term_word(&f->terms[t], b, k, n);
+                any |= b->sel[k];
+            }
+        }
+        if (!any) {
+            break;
+        }
+    }
+
+    for (size_t k = 0; k < nwords; k++) {
+        matched += __builtin_popcountll(b->sel[k]);
+    }
+    w->scanned += b->n;
+    w->matched += matched;
+    if (!matched) {
+        return 0;
+    }
+
+    // Without groups, counts are taken from the selection and the state
+    // bitmaps a word at a time.
+    if (p->count_only) {
+        uint64_t lost = 0;
+        uint64_t orphaned = 0;
+        uint64_t *acc = w->table.acc;
+
+        for (size_t k = 0; k < nwords; k++) {
+            uint64_t any = 0;
+
+            for (int s = 0; s < NSTATES; s++) {
+                any |= b->state[s][k];
+            }
+            lost += __builtin_popcountll(
+                    b->sel[k] & ~(b->state[state_index(LF_STATE_OPEN)][k] | b->state[state_index(LF_STATE_LOCK)][k]));
+            orphaned += __builtin_popcountll(b->sel[k] & ~any);
+        }
+
+        w->table.groups[0].rows += matched;
+        for (int a = 0; a < p->naggs; a++) {
+            acc[a] += p->q->aggs[a].kind == QUERY_COUNT ? matched : p->q->aggs[a].kind == QUERY_LOST ? lost : orphaned;
+        }
+        return 0;
+    }
+
+    for (size_t k = 0; k < nwords; k++) {
+        uint64_t bits = b->sel[k];
+
+        while (bits) {
+            if (add_row(w, b, k * 64 + __builtin_ctzll(bits)) < 0) {
+                return -1;
+            }
+            bits &= bits - 1;
+        }
+    }
+    return 0;
+}
+
+// Points the batch at rows [row, row + n) of a columnar snapshot. row is a
+// multiple of 64, so the bitmaps can be used from the word it falls in.
+static void column_batch(struct batch *b, const struct snapshot *s, uint64_t row, uint32_t n) {
+    b->n = n;
+    b->addr = (const uint64_t *)s->columns[SNAPSHOT_COL_ADDR] + row;
+    b->bucket = (const uint32_t *)s->columns[SNAPSHOT_COL_BUCKET] + row;
+    b->fsid = (const fsid_t *)s->columns[SNAPSHOT_COL_FSID] + row;
+    b->fid = (const struct fid *)s->columns[SNAPSHOT_COL_FID] + row;
+    b->usecount = (const int32_t *)s->columns[SNAPSHOT_COL_USECOUNT] + row;
+    b->lck_usecnt = (const uint32_t *)s->columns[SNAPSHOT_COL_LCK_USECNT] + row;
+    b->lck_lock = (const uint8_t *)s->columns[SNAPSHOT_COL_LCK_LOCK] + row;
+    for (int st = 0; st < NSTATES; st++) {
+        b->state[st] = (const uint64_t *)s->columns[SNAPSHOT_COL_STATE + st] + row / 64;
+    }
+}
+
+// Reads the next n rows from the cursor and transposes them into the batch.
+static int cursor_batch(struct batch *b, struct worker *w, uint32_t n) {
+    struct batch_rows *rows = w->rows;
+
+    memset(rows->state, 0, sizeof rows->state);
+    for (uint32_t i = 0; i < n; i++) {
+        const struct emit_record *r;
+        int rc = snapshot_cursor_record(&w->cursor, &r);
+
+        if (rc <= 0) {
+            if (rc == 0) {
+                fprintf(stderr, "Snapshot ended before its last row\n");
+            }
+            return -1;
+        }
+        rows->addr[i] = r->addr;
+        rows->bucket[i] = r->bucket;
+        memcpy(&rows->fsid[i], r->fsid, sizeof rows->fsid[i]);
+        rows->fid[i].fid_len = r->fid_len;
+        rows->fid[i].fid_data0 = r->fid_data0;
+        memcpy(rows->fid[i].fid_data, r->fid, MAXFIDSZ);
+        rows->usecount[i] = r->usecount;
+        rows->lck_usecnt[i] = r->lck_usecnt;
+        rows->lck_lock[i] = r->lck_lock;
+        for (int s = 0; s < NSTATES; s++) {
+            rows->state[s][i / 64] |= (uint64_t)(r->state >> s & 1) << (i % 64);
+        }
+    }
+
+    b->n = n;
+    b->addr = rows->addr;
+    b->bucket = rows->bucket;
+    b->fsid = rows->fsid;
+    b->fid = rows->fid;
+    b->usecount = rows->usecount;
+    b->lck_usecnt = rows->lck_usecnt;
+    b->lck_lock = rows->lck_lock;
+    for (int s = 0; s < NSTATES; s++) {
+        b->state[s] = rows->state[s];
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    struct plan *p = w->plan;
+    const struct snapshot *s = p->s;
+    uint64_t range;
+
+    while (!atomic_load(&p->failed) && (range = atomic_fetch_add(&p->next, 1)) < p->nranges) {
+        uint64_t first = range * p->range_rows;
+        uint64_t end = first + p->range_rows < p->nrows ? first + p->range_rows : p->nrows;
+
+        if (!s->columns[0] && snapshot_cursor_seek(&w->cursor, first) < 0) {
+            atomic_store(&p->failed, 1);
+            break;
+        }
+
+        for (uint64_t row = first; row < end; row += QUERY_BATCH) {
+            uint32_t n = end - row < QUERY_BATCH ? end - row : QUERY_BATCH;
+            struct batch b;
+
+            if (s->columns[0]) {
+                column_batch(&b, s, row, n);
+            } else if (cursor_batch(&b, w, n) < 0) {
+                atomic_store(&p->failed, 1);
+                break;
+            }
+            if (scan_batch(w, &b) < 0) {
+                fprintf(stderr, "Failed to allocate query groups\n");
+                atomic_store(&p->failed, 1);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Adds the groups of src into dst.
+static int table_merge(struct table *dst, const struct table *src, const struct plan *p) {
+    for (size_t i = 0; i < src->count; i++) {
+        const struct query_group *g = &src->groups[i];
+        const uint64_t *from = &src->acc[i * p->naggs];
+        long j = table_find(dst, p, g->fsid, g->bucket, g->state);
+        uint64_t *to;
+
+        if (j < 0) {
+            return -1;
+        }
+        dst->groups[j].rows += g->rows;
+        to = &dst->acc[j * p->naggs];
+        for (int a = 0; a < p->naggs; a++) {
+            switch (p->q->aggs[a].kind) {
+                case QUERY_MIN:
+                    to[a] = from[a] < to[a] ? from[a] : to[a];
+                    break;
+                case QUERY_MAX:
+                    to[a] = from[a] > to[a] ? from[a] : to[a];
+                    break;
+                default:
+                    to[a] += from[a];
+                    break;
+            }
+        }
+        for (int l = 0; l < p->nlists; l++) {
+            const struct values *list = &src->lists[i * p->nlists + l];
+
+            for (size_t v = 0; v < list->count; v++) {
+                if (values_add(&dst->lists[j * p->nlists + l], list->v[v]) < 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Returns the k-th smallest of the n values, reordering them. Quickselect
+// takes linear time where sorting every list would not.
+static uint64_t select_nth(uint64_t *v, long n, long k) {
+    long lo = 0;
+    long hi = n - 1;
+
+    while (lo < hi) {
+        uint64_t pivot = v[lo + (hi - lo) / 2];
+        long i = lo;
+        long j = hi;
+
+        while (i <= j) {
+            while (v[i] < pivot) {
+                i++;
+            }
+            while (v[j] > pivot) {
+                j--;
+            }
+            if (i <= j) {
+                uint64_t tmp = v[i];
+
+                v[i++] = v[j];
+                v[j--] = tmp;
+            }
+        }
+        if (k <= j) {
+            hi = j;
+        } else if (k >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+    return v[k];
+}
+
+// Fills in the percentiles and turns the sortable values back into the
+// values of their fields.
+static void finish_groups(struct table *t, const struct plan *p) {
+    for (size_t i = 0; i < t->count; i++) {
+        uint64_t *acc = &t->acc[i * p->naggs];
+
+        for (int a = 0; a < p->naggs; a++) {
+            const struct query_agg *agg = &p->q->aggs[a];
+
+            if (agg->kind == QUERY_PERCENTILE && t->groups[i].rows) {
+                struct values *list = &t->lists[i * p->nlists + p->list_of[a]];
+                long rank = (long)ceil(agg->percentile / 100 * list->count);
+
+                acc[a] = select_nth(list->v, list->count, rank > 0 ? rank - 1 : 0);
+            }
+            if (query_agg_signed(agg)) {
+                acc[a] ^= SIGN_BIT;
+            }
+        }
+    }
+}
+
+int query_run(const struct query *q, const struct snapshot *s, struct query_result *r) {
+    struct plan p = {.q = q, .s = s, .naggs = q->naggs, .nrows = s->header->nrecords};
+    struct worker *workers;
+    int nworkers = q->nworkers > 0 ? q->nworkers : 1;
+    int started = 0;
+    int rc = -1;
+
+    memset(r, 0, sizeof *r);
+
+    p.count_only = !q->group;
+    for (int a = 0; a < q->naggs; a++) {
+        const struct query_agg *agg = &q->aggs[a];
+
+        if (agg->kind >= QUERY_MIN) {
+            p.count_only = 0;
+        }
+        if (agg->kind != QUERY_PERCENTILE) {
+            continue;
+        }
+        // Percentiles of the same field share its values.
+        p.list_of[a] = p.nlists;
+        for (int l = 0; l < p.nlists; l++) {
+            if (p.list_field[l] == agg->field) {
+                p.list_of[a] = l;
+            }
+        }
+        if (p.list_of[a] == p.nlists) {
+            p.list_field[p.nlists++] = agg->field;
+        }
+    }
+
+    p.range_rows = s->blocks ? s->header->block_rows : QUERY_RANGE;
+    p.nranges = (p.nrows + p.range_rows - 1) / p.range_rows;
+    if ((uint64_t)nworkers > p.nranges) {
+        nworkers = p.nranges ? p.nranges : 1;
+    }
+    atomic_init(&p.next, 0);
+    atomic_init(&p.failed, 0);
+
+    workers = calloc(nworkers, sizeof *workers);
+    if (!workers) {
+        fprintf(stderr, "Failed to allocate %d workers\n", nworkers);
+        return -1;
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        struct worker *w = &workers[i];
+
+        w->plan = &p;
+        // Without groups, every row goes to the one group there is.
+        if (!q->group && table_find(&w->table, &p, 0, 0, 0) < 0) {
+            fprintf(stderr, "Failed to allocate query groups\n");
+            atomic_store(&p.failed, 1);
+            break;
+        }
+        if (!s->columns[0]) {
+            w->rows = malloc(sizeof *w->rows);
+            if (!w->rows || snapshot_cursor_init(&w->cursor, s) < 0) {
+                fprintf(stderr, "Failed to allocate worker %d\n", i);
+                free(w->rows);
+                w->rows = NULL;
+                atomic_store(&p.failed, 1);
+                break;
+            }
+        }
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            fprintf(stderr, "Failed to start worker %d\n", i);
+            atomic_store(&p.failed, 1);
+            break;
+        }
+        started++;
+    }
+
+    r->nworkers = started;
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        r->scanned += workers[i].scanned;
+        r->matched += workers[i].matched;
+    }
+
+    if (!atomic_load(&p.failed)) {
+        rc = 0;
+        for (int i = 1; i < started && rc == 0; i++) {
+            if (table_merge(&workers[0].table, &workers[i].table, &p) < 0) {
+                fprintf(stderr, "Failed to allocate query groups\n");
+                rc = -1;
+            }
+        }
+    }
+
+    if (rc == 0) {
+        finish_groups(&workers[0].table, &p);
+        r->groups = workers[0].table.groups;
+        r->values = workers[0].table.acc;
+        r->ngroups = workers[0].table.count;
+        workers[0].table.groups = NULL;
+        workers[0].table.acc = NULL;
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        table_free(&workers[i].table, &p);
+        if (workers[i].rows) {
+            snapshot_cursor_free(&workers[i].cursor);
+            free(workers[i].rows);
+        }
+    }
+    free(workers);
+    return rc;
+}
+
+void query_result_free(struct query_result *r) {
+    free(r->groups);
+    free(r->values);
+    r->groups = NULL;
+    r->values = NULL;
+}
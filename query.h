@@ -0,0 +1,112 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "filter.h"
+#include "snapshot.h"
+
+// Answers ad hoc questions about a snapshot: the rows that pass a filter,
+// optionally grouped by fsid, bucket and lf_state() mask, summarised by a
+// list of aggregates:
+//
+//   count                  rows in the group
+//   lost, orphaned         rows in the group that are lost or orphaned
+//   min(f), max(f)         smallest and largest value of field f
+//   pN(f)                  the N-th percentile of f by nearest rank, with N
+//                          from 0 to 100, such as p50 or p99.9
+//
+// where f is one of addr, bucket, usecount, lck_usecnt, lck_lock and
+// fid_len. A percentile keeps every value of its field until the scan ends,
+// 8 bytes per matching row; the other aggregates take constant space per
+// group.
+//
+// The rows are scanned in batches of QUERY_BATCH. A columnar snapshot is read
+// in place: each filter term is tested against a whole column of the batch,
+// and its result is kept as a bitmap of the rows still selected, so every
+// loop is a plain pass over an array. State terms are evaluated on the state
+// bitmaps of the snapshot a word of 64 rows at a time, and a query that only
+// counts, without grouping, is answered from the selection bitmaps with
+// popcounts alone. The rows of other snapshots are decoded through a cursor
+// and transposed into the same batch layout first.
+//
+// The snapshot is split into ranges of rows that nworkers threads claim in
+// turn, so a snapshot with fewer ranges runs on fewer threads. Each worker
+// aggregates into a table of its own, and the tables are merged once all of
+// them are done.
+
+#define QUERY_BATCH 1024        // Rows per batch, a multiple of 64
+#define QUERY_MAX_AGGS 16
+
+#define QUERY_GROUP_FSID 0x01
+#define QUERY_GROUP_BUCKET 0x02
+#define QUERY_GROUP_STATE 0x04
+
+enum query_kind {
+    QUERY_COUNT,
+    QUERY_LOST,
+    QUERY_ORPHANED,
+    QUERY_MIN,
+    QUERY_MAX,
+    QUERY_PERCENTILE,
+};
+
+enum query_field {
+    QUERY_ADDR,
+    QUERY_BUCKET,
+    QUERY_USECOUNT,
+    QUERY_LCK_USECNT,
+    QUERY_LCK_LOCK,
+    QUERY_FID_LEN,
+    QUERY_NFIELDS
+};
+
+struct query_agg {
+    enum query_kind kind;
+    enum query_field field;
+    double percentile;
+    char name[32];              // As written, for the report
+};
+
+struct query {
+    const struct filter *filter;    // Optional
+    unsigned int group;         // QUERY_GROUP_* bits
+    struct query_agg aggs[QUERY_MAX_AGGS];
+    int naggs;
+    int nworkers;
+};
+
+// A group of the result. The keys the query does not group by are zero.
+struct query_group {
+    uint64_t fsid;              // lf_fsid_key()
+    uint32_t bucket;
+    uint32_t state;
+    uint64_t rows;
+};
+
+struct query_result {
+    struct query_group *groups;
+    uint64_t *values;           // naggs per group, in the order of the aggregates
+    size_t ngroups;
+    uint64_t scanned;
+    uint64_t matched;
+    int nworkers;               // Threads that ran, at most one per range of rows
+};
+
+// Parses a comma separated list of aggregates into q, or of the group keys
+// fsid, bucket and state. Returns -1 after reporting the first error.
+int query_parse_aggs(struct query *q, const char *spec);
+int query_parse_group(struct query *q, const char *spec);
+
+// Returns whether the values of an aggregate are signed, as those of
+// usecount are.
+int query_agg_signed(const struct query_agg *agg);
+
+// Runs q over s. Without grouping the result holds one group, even if no row
+// matched. Returns -1 after reporting why if memory runs out or a block of a
+// compressed snapshot is corrupt.
+int query_run(const struct query *q, const struct snapshot *s, struct query_result *r);
+void query_result_free(struct query_result *r);
+
+#endif
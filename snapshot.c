@@ -0,0 +1,966 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "fsid-stats.h"
+#include "snapshot.h"
+
+_Static_assert(SNAPSHOT_HEADER_V1 == 128, "the version 1 header must not change size");
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+// Bytes of a column buffered before they are written out.
+#define COLUMN_CHUNK (64 * 1024)
+
+// Bitmap words combined at a time by snapshot_count_clear(), small enough to
+// stay in L1.
+#define COUNT_BLOCK 512
+
+// The payload of a compressed block holds its rows, sorted by address, as a
+// series of sections, each with a value for every row in turn:
+//
+//   addr         varint; the first in full, then the difference to the last
+//   bucket       varint; the lowest bucket of the block first, then the
+//                difference of each row's bucket to it
+//   fsid         varint index into the dictionary
+//   state        one byte of lf_state() bits
+//   usecount     zigzag varint
+//   lck_usecnt   varint
+//   lck_lock     one byte
+//   fid_len      varint
+//   fid_data0    varint
+//   fid_data     MAXFIDSZ bytes, all of them, as the kernel hashes them all
+//
+// Keeping each field together lets zlib find the runs within it, such as the
+// zero bytes at the end of most fids.
+
+// The most bytes a row can take in a block payload, and the block header.
+#define BLOCK_ROW_MAX (10 + 5 + 5 + 1 + 5 + 5 + 1 + 3 + 3 + MAXFIDSZ)
+#define BLOCK_EXTRA 10
+
+// The largest block a reader will allocate for.
+#define MAX_BLOCK_ROWS (1 << 20)
+
+// The width of each value column, or 0 for a bitmap.
+static const size_t column_width[SNAPSHOT_NCOLUMNS] = {
+        [SNAPSHOT_COL_ADDR] = sizeof(uint64_t),
+        [SNAPSHOT_COL_BUCKET] = sizeof(uint32_t),
+        [SNAPSHOT_COL_FSID] = sizeof(fsid_t),
+        [SNAPSHOT_COL_FID] = sizeof(struct fid),
+        [SNAPSHOT_COL_USECOUNT] = sizeof(int32_t),
+        [SNAPSHOT_COL_LCK_USECNT] = sizeof(uint32_t),
+        [SNAPSHOT_COL_LCK_LOCK] = sizeof(uint8_t),
+};
+
+static uint64_t column_size(int column, uint64_t nrows) {
+    return column_width[column] ? column_width[column] * nrows : (nrows + 63) / 64 * sizeof(uint64_t);
+}
+
+int snapshot_writer_init(struct snapshot_writer *w) {
+    w->count = 0;
+    w->cap = 4096;
+    w->records = malloc(w->cap * sizeof *w->records);
+    return w->records ? 0 : -1;
+}
+
+void snapshot_writer_free(struct snapshot_writer *w) {
+    free(w->records);
+    w->records = NULL;
+}
+
+int snapshot_writer_add(struct snapshot_writer *w, const struct lf_node *node) {
+    if (w->count == w->cap) {
+        struct emit_record *records = realloc(w->records, w->cap * 2 * sizeof *records);
+
+        if (!records) {
+            return -1;
+        }
+        w->records = records;
+        w->cap *= 2;
+    }
+
+    emit_record_fill(&w->records[w->count++], node);
+    return 0;
+}
+
+static int write_all(FILE *f, const void *buf, size_t len) {
+    static const char zero[8];
+    size_t padding = ALIGN8(len) - len;
+
+    return fwrite(buf, 1, len, f) == len && fwrite(zero, 1, padding, f) == padding ? 0 : -1;
+}
+
+static void column_value(const struct emit_record *r, int column, unsigned char *out) {
+    struct fid fid;
+
+    switch (column) {
+        case SNAPSHOT_COL_ADDR:
+            memcpy(out, &r->addr, sizeof r->addr);
+            break;
+        case SNAPSHOT_COL_BUCKET:
+            memcpy(out, &r->bucket, sizeof r->bucket);
+            break;
+        case SNAPSHOT_COL_FSID:
+            memcpy(out, r->fsid, sizeof r->fsid);
+            break;
+        case SNAPSHOT_COL_FID:
+            memset(&fid, 0, sizeof fid);
+            fid.fid_len = r->fid_len;
+            fid.fid_data0 = r->fid_data0;
+            memcpy(fid.fid_data, r->fid, MAXFIDSZ);
+            memcpy(out, &fid, sizeof fid);
+            break;
+        case SNAPSHOT_COL_USECOUNT:
+            memcpy(out, &r->usecount, sizeof r->usecount);
+            break;
+        case SNAPSHOT_COL_LCK_USECNT:
+            memcpy(out, &r->lck_usecnt, sizeof r->lck_usecnt);
+            break;
+        case SNAPSHOT_COL_LCK_LOCK:
+            *out = r->lck_lock;
+            break;
+    }
+}
+
+// Transposes the records, taken in the given order, into one column after
+// the other. Each column is padded to 8 bytes as a whole.
+static int write_columns(FILE *f, const struct snapshot_writer *w, const size_t *order) {
+    unsigned char *buf;
+    int rc = -1;
+
+    buf = malloc(COLUMN_CHUNK);
+    if (!buf) {
+        return -1;
+    }
+
+    for (int column = 0; column < SNAPSHOT_NCOLUMNS; column++) {
+        size_t width = column_width[column];
+        uint64_t written = 0;
+        size_t len = 0;
+        size_t padding;
+
+        for (size_t i = 0; i < w->count; i += width ? 1 : 64) {
+            if (width) {
+                column_value(&w->records[order[i]], column, buf + len);
+                len += width;
+            } else {
+                unsigned int bit = 1u << (column - SNAPSHOT_COL_STATE);
+                uint64_t word = 0;
+
+                for (size_t j = 0; j < 64 && i + j < w->count; j++) {
+                    word |= (uint64_t)((w->records[order[i + j]].state & bit) != 0) << j;
+                }
+                memcpy(buf + len, &word, sizeof word);
+                len += sizeof word;
+            }
+
+            // Leaves room for the widest element and the padding.
+            if (COLUMN_CHUNK - len < sizeof(struct fid) + 8) {
+                if (fwrite(buf, 1, len, f) != len) {
+                    goto out;
+                }
+                written += len;
+                len = 0;
+            }
+        }
+
+        padding = ALIGN8(written + len) - (written + len);
+        memset(buf + len, 0, padding);
+        len += padding;
+        if (fwrite(buf, 1, len, f) != len) {
+            goto out;
+        }
+    }
+    rc = 0;
+
+out:
+    free(buf);
+    return rc;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+    uint64_t r = 0;
+
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = *(*p)++;
+
+        r |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = r;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// The distinct fsids of a snapshot, most lost entries first, and a copy
+// sorted by key to find the index of each.
+struct dict {
+    fsid_t *fsids;
+    struct fsid_entry *by_key;
+    size_t count;
+};
+
+static int compare_dict_keys(const void *a, const void *b) {
+    uint64_t ka = ((const struct fsid_entry *)a)->key;
+    uint64_t kb = ((const struct fsid_entry *)b)->key;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+static int dict_build(struct dict *d, const struct snapshot_writer *w) {
+    struct fsid_stats stats;
+    int rc = -1;
+
+    memset(d, 0, sizeof *d);
+    if (fsid_stats_init(&stats) < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < w->count; i++) {
+        fsid_t fsid = {.val = {w->records[i].fsid[0], w->records[i].fsid[1]}};
+
+        if (fsid_stats_add(&stats, &fsid, !(w->records[i].state & (LF_STATE_OPEN | LF_STATE_LOCK))) < 0) {
+            goto out;
+        }
+    }
+
+    d->by_key = fsid_stats_sorted(&stats, &d->count);
+    d->fsids = malloc((d->count ? d->count : 1) * sizeof *d->fsids);
+    if (!d->by_key || !d->fsids) {
+        goto out;
+    }
+
+    // The index of each fsid replaces its lost count in the sorted copy.
+    for (size_t i = 0; i < d->count; i++) {
+        d->fsids[i] = d->by_key[i].fsid;
+        d->by_key[i].total = i;
+    }
+    qsort(d->by_key, d->count, sizeof *d->by_key, compare_dict_keys);
+    rc = 0;
+
+out:
+    fsid_stats_free(&stats);
+    return rc;
+}
+
+static uint64_t dict_index(const struct dict *d, const int32_t fsid[2]) {
+    struct fsid_entry key = {.key = (uint64_t)(uint32_t)fsid[0] << 32 | (uint32_t)fsid[1]};
+    const struct fsid_entry *e = bsearch(&key, d->by_key, d->count, sizeof key, compare_dict_keys);
+
+    return e->total;
+}
+
+static void dict_free(struct dict *d) {
+    free(d->fsids);
+    free(d->by_key);
+}
+
+static int compare_addrs(const void *a, const void *b) {
+    uint64_t aa = ((const struct emit_record *)a)->addr;
+    uint64_t ab = ((const struct emit_record *)b)->addr;
+
+    return aa < ab ? -1 : aa > ab;
+}
+
+static size_t encode_block(const struct emit_record *rows, uint32_t n, const struct dict *d, unsigned char *out) {
+    unsigned char *p = out;
+    uint32_t min_bucket = UINT32_MAX;
+
+    for (uint32_t i = 0; i < n; i++) {
+        p = put_varint(p, i ? rows[i].addr - rows[i - 1].addr : rows[i].addr);
+        if (rows[i].bucket < min_bucket) {
+            min_bucket = rows[i].bucket;
+        }
+    }
+    p = put_varint(p, min_bucket);
+    for (uint32_t i = 0; i < n; i++) {
+        p = put_varint(p, rows[i].bucket - min_bucket);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        p = put_varint(p, dict_index(d, rows[i].fsid));
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        *p++ = rows[i].state;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        p = put_varint(p, (uint32_t)rows[i].usecount << 1 ^ (uint32_t)(rows[i].usecount >> 31));
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        p = put_varint(p, rows[i].lck_usecnt);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        *p++ = rows[i].lck_lock;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        p = put_varint(p, rows[i].fid_len);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        p = put_varint(p, rows[i].fid_data0);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        memcpy(p, rows[i].fid, MAXFIDSZ);
+        p += MAXFIDSZ;
+    }
+
+    return p - out;
+}
+
+// Decodes the n rows of a block that starts at row first. A row whose bucket
+// is not one the index places within the block is corrupt.
+static int decode_block(const unsigned char *p, size_t len, uint32_t n, uint64_t first, const struct snapshot *s,
+                        struct emit_record *rows) {
+    const unsigned char *end = p + len;
+    uint64_t v;
+    uint64_t min_bucket;
+
+    memset(rows, 0, n * sizeof *rows);
+    for (uint32_t i = 0; i < n; i++) {
+        if (get_varint(&p, end, &v) < 0) {
+            return -1;
+        }
+        rows[i].addr = i ? rows[i - 1].addr + v : v;
+    }
+    if (get_varint(&p, end, &min_bucket) < 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (get_varint(&p, end, &v) < 0 || v >= s->header->hashsize || min_bucket >= s->header->hashsize - v) {
+            return -1;
+        }
+        rows[i].bucket = min_bucket + v;
+        if (s->index[rows[i].bucket] >= first + n || s->index[rows[i].bucket + 1] <= first) {
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (get_varint(&p, end, &v) < 0 || v >= s->header->ndict) {
+            return -1;
+        }
+        rows[i].fsid[0] = s->dict[v].val[0];
+        rows[i].fsid[1] = s->dict[v].val[1];
+    }
+    if ((size_t)(end - p) < n) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        rows[i].state = *p++;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (get_varint(&p, end, &v) < 0) {
+            return -1;
+        }
+        rows[i].usecount = (int32_t)((uint32_t)v >> 1 ^ -(uint32_t)(v & 1));
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (get_varint(&p, end, &v) < 0) {
+            return -1;
+        }
+        rows[i].lck_usecnt = v;
+    }
+    if ((size_t)(end - p) < n) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        rows[i].lck_lock = *p++;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (get_varint(&p, end, &v) < 0) {
+            return -1;
+        }
+        rows[i].fid_len = v;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (get_varint(&p, end, &v) < 0) {
+            return -1;
+        }
+        rows[i].fid_data0 = v;
+    }
+    if ((size_t)(end - p) != (size_t)n * MAXFIDSZ) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        memcpy(rows[i].fid, p, MAXFIDSZ);
+        p += MAXFIDSZ;
+    }
+
+    return 0;
+}
+
+// Compresses the records, taken in the given order, a block of rows at a time.
+static int write_blocks(FILE *f, const struct snapshot_writer *w, const size_t *order, const struct dict *d,
+                        uint32_t block_rows) {
+    struct emit_record *rows;
+    unsigned char *raw;
+    unsigned char *comp;
+    uLongf comp_cap = compressBound((uLong)block_rows * BLOCK_ROW_MAX + BLOCK_EXTRA);
+    int rc = -1;
+
+    rows = malloc(block_rows * sizeof *rows);
+    raw = malloc((size_t)block_rows * BLOCK_ROW_MAX + BLOCK_EXTRA);
+    comp = malloc(comp_cap);
+    if (!rows || !raw || !comp) {
+        goto out;
+    }
+
+    for (size_t start = 0; start < w->count; start += block_rows) {
+        struct snapshot_block b = {0};
+        uLongf comp_len = comp_cap;
+
+        b.nrows = w->count - start < block_rows ? w->count - start : block_rows;
+        for (uint32_t i = 0; i < b.nrows; i++) {
+            rows[i] = w->records[order[start + i]];
+        }
+        qsort(rows, b.nrows, sizeof *rows, compare_addrs);
+
+        b.raw_len = encode_block(rows, b.nrows, d, raw);
+        if (compress2(comp, &comp_len, raw, b.raw_len, Z_BEST_SPEED) != Z_OK) {
+            goto out;
+        }
+        b.comp_len = comp_len;
+        b.crc = crc32(0, raw, b.raw_len);
+
+        if (fwrite(&b, sizeof b, 1, f) != 1 || fwrite(comp, 1, b.comp_len, f) != b.comp_len) {
+            goto out;
+        }
+    }
+    rc = 0;
+
+out:
+    free(comp);
+    free(raw);
+    free(rows);
+    return rc;
+}
+
+int snapshot_save(const struct snapshot_writer *w, const char *path, struct snapshot_header *h,
+                  const unsigned char *buckets) {
+    uint64_t *index = NULL;
+    uint64_t *fill = NULL;
+    size_t *order = NULL;
+    struct dict dict = {0};
+    char tmp[PATH_MAX];
+    FILE *f;
+    int rc = -1;
+
+    memcpy(h->magic, SNAPSHOT_MAGIC, sizeof h->magic);
+    h->version = SNAPSHOT_VERSION;
+    h->header_size = sizeof *h;
+    h->record_size = sizeof(struct emit_record);
+    h->nrecords = w->count;
+    h->index_offset = sizeof *h;
+    h->buckets_offset = h->index_offset + ALIGN8(((uint64_t)h->hashsize + 1) * sizeof *index);
+    h->records_offset = h->buckets_offset + ALIGN8(h->hashsize);
+    memset(h->columns, 0, sizeof h->columns);
+    if (h->flags & SNAPSHOT_COLUMNAR) {
+        uint64_t off = h->records_offset;
+
+        for (int column = 0; column < SNAPSHOT_NCOLUMNS; column++) {
+            h->columns[column] = off;
+            off += ALIGN8(column_size(column, w->count));
+        }
+        h->records_offset = 0;
+    }
+    h->dict_offset = h->ndict = h->block_rows = h->blocks_offset = h->nblocks = 0;
+    if (h->flags & SNAPSHOT_COMPRESSED) {
+        if (dict_build(&dict, w) < 0) {
+            fprintf(stderr, "Failed to allocate the snapshot dictionary\n");
+            goto out;
+        }
+        h->dict_offset = h->records_offset;
+        h->ndict = dict.count;
+        h->block_rows = SNAPSHOT_BLOCK_ROWS;
+        h->blocks_offset = h->dict_offset + ALIGN8(dict.count * sizeof(fsid_t));
+        h->nblocks = (w->count + SNAPSHOT_BLOCK_ROWS - 1) / SNAPSHOT_BLOCK_ROWS;
+        h->records_offset = 0;
+    }
+
+    index = calloc(h->hashsize + 1, sizeof *index);
+    fill = calloc(h->hashsize + 1, sizeof *fill);
+    order = malloc((w->count ? w->count : 1) * sizeof *order);
+    if (!index || !fill || !order) {
+        fprintf(stderr, "Failed to allocate the snapshot index\n");
+        goto out;
+    }
+
+    // A stable counting sort by bucket. Each bucket is walked by one worker,
+    // so its records already appear in chain order.
+    for (size_t i = 0; i < w->count; i++) {
+        index[w->records[i].bucket + 1]++;
+    }
+    for (uint32_t b = 0; b < h->hashsize; b++) {
+        index[b + 1] += index[b];
+    }
+    memcpy(fill, index, (h->hashsize + 1) * sizeof *fill);
+    for (size_t i = 0; i < w->count; i++) {
+        order[fill[w->records[i].bucket]++] = i;
+    }
+
+    // Written beside the snapshot and renamed over it, so an interrupted
+    // capture never leaves a truncated file under the final name.
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        fprintf(stderr, "Failed to write snapshot %s: %s\n", tmp, strerror(errno));
+        goto out;
+    }
+
+    if (write_all(f, h, sizeof *h) < 0 || write_all(f, index, (h->hashsize + 1) * sizeof *index) < 0 ||
+        write_all(f, buckets, h->hashsize) < 0) {
+        goto write_failed;
+    }
+    if (h->flags & SNAPSHOT_COLUMNAR) {
+        if (write_columns(f, w, order) < 0) {
+            goto write_failed;
+        }
+    } else if (h->flags & SNAPSHOT_COMPRESSED) {
+        if (write_all(f, dict.fsids, dict.count * sizeof(fsid_t)) < 0 ||
+            write_blocks(f, w, order, &dict, h->block_rows) < 0) {
+            goto write_failed;
+        }
+    } else {
+        for (size_t i = 0; i < w->count; i++) {
+            if (fwrite(&w->records[order[i]], sizeof *w->records, 1, f) != 1) {
+                goto write_failed;
+            }
+        }
+    }
+
+    if (fclose(f) != 0 || rename(tmp, path) < 0) {
+        fprintf(stderr, "Failed to write snapshot %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        goto out;
+    }
+    rc = 0;
+    goto out;
+
+write_failed:
+    fprintf(stderr, "Failed to write snapshot %s: %s\n", tmp, strerror(errno));
+    fclose(f);
+    unlink(tmp);
+out:
+    dict_free(&dict);
+    free(order);
+    free(fill);
+    free(index);
+    return rc;
+}
+
+// Walks the block headers of a compressed snapshot, checking that every
+// block lies within the file and that together they hold every row. The
+// payloads are only checked as they are decompressed.
+static int validate_blocks(const struct snapshot *s) {
+    const struct snapshot_header *h = s->header;
+    uint64_t off = h->blocks_offset;
+    uint64_t rows = 0;
+
+    if (h->dict_offset % 8 || h->dict_offset > s->len || h->ndict > (s->len - h->dict_offset) / sizeof(fsid_t) ||
+        h->block_rows == 0 || h->block_rows > MAX_BLOCK_ROWS) {
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < h->nblocks; i++) {
+        struct snapshot_block b;
+
+        if (off > s->len || sizeof b > s->len - off) {
+            return -1;
+        }
+        memcpy(&b, (const char *)s->map + off, sizeof b);
+        off += sizeof b;
+        if (b.nrows == 0 || b.nrows > h->block_rows || b.raw_len > (size_t)b.nrows * BLOCK_ROW_MAX + BLOCK_EXTRA ||
+            b.comp_len > s->len - off) {
+            return -1;
+        }
+        off += b.comp_len;
+        rows += b.nrows;
+    }
+
+    return rows == h->nrecords ? 0 : -1;
+}
+
+// Checks that the sections of a mapped snapshot lie within it and that the
+// index is consistent, so the reader can trust it without further checks.
+static int validate(const struct snapshot *s, const char *path) {
+    const struct snapshot_header *h = s->header;
+    uint64_t index_len = ((uint64_t)h->hashsize + 1) * sizeof(uint64_t);
+
+    size_t min_header = h->version == 1 ? SNAPSHOT_HEADER_V1 : h->version == 2 ? SNAPSHOT_HEADER_V2 : sizeof *h;
+
+    if (h->header_size < min_header || h->header_size > s->len ||
+        h->record_size != sizeof(struct emit_record) || h->hashsize == 0 ||
+        h->index_offset % 8 || h->records_offset % 8 ||
+        h->index_offset > s->len || index_len > s->len - h->index_offset ||
+        h->buckets_offset > s->len || h->hashsize > s->len - h->buckets_offset) {
+        fprintf(stderr, "Snapshot %s is truncated or corrupt\n", path);
+        return -1;
+    }
+
+    if ((h->flags & SNAPSHOT_COLUMNAR && h->version < 2) || (h->flags & SNAPSHOT_COMPRESSED && h->version < 3) ||
+        (h->flags & SNAPSHOT_COLUMNAR && h->flags & SNAPSHOT_COMPRESSED)) {
+        fprintf(stderr, "Snapshot %s is truncated or corrupt\n", path);
+        return -1;
+    }
+
+    if (!(h->flags & (SNAPSHOT_COLUMNAR | SNAPSHOT_COMPRESSED)) &&
+        (h->records_offset > s->len || h->nrecords > (s->len - h->records_offset) / h->record_size)) {
+        fprintf(stderr, "Snapshot %s is truncated or corrupt\n", path);
+        return -1;
+    }
+
+    if (h->flags & SNAPSHOT_COLUMNAR) {
+        for (int column = 0; column < SNAPSHOT_NCOLUMNS; column++) {
+            if (h->columns[column] % 8 || h->columns[column] > s->len ||
+                column_size(column, h->nrecords) > s->len - h->columns[column]) {
+                fprintf(stderr, "Snapshot %s is truncated or corrupt\n", path);
+                return -1;
+            }
+        }
+    }
+
+    if (h->flags & SNAPSHOT_COMPRESSED && validate_blocks(s) < 0) {
+        fprintf(stderr, "Snapshot %s is truncated or corrupt\n", path);
+        return -1;
+    }
+
+    if (s->index[0] != 0 || s->index[h->hashsize] != h->nrecords) {
+        fprintf(stderr, "Snapshot %s has a corrupt index\n", path);
+        return -1;
+    }
+    for (uint32_t b = 0; b < h->hashsize; b++) {
+        if (s->index[b + 1] < s->index[b]) {
+            fprintf(stderr, "Snapshot %s has a corrupt index\n", path);
+            return -1;
+        }
+    }
+
+    // Every row must be in the range of the index its bucket gives, which
+    // also keeps the bucket below hashsize. The rows of a compressed snapshot
+    // are checked as their blocks are decompressed.
+    if (!(h->flags & SNAPSHOT_COMPRESSED)) {
+        const char *map = s->map;
+        int columnar = (h->flags & SNAPSHOT_COLUMNAR) != 0;
+        const uint32_t *column = columnar ? (const uint32_t *)(map + h->columns[SNAPSHOT_COL_BUCKET]) : NULL;
+        const struct emit_record *records = columnar ? NULL : (const struct emit_record *)(map + h->records_offset);
+
+        for (uint32_t b = 0; b < h->hashsize; b++) {
+            for (uint64_t i = s->index[b]; i < s->index[b + 1]; i++) {
+                if ((columnar ? column[i] : records[i].bucket) != b) {
+                    fprintf(stderr, "Snapshot %s has a record outside its bucket\n", path);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+int snapshot_open(struct snapshot *s, const char *path) {
+    struct stat st;
+    int fd;
+
+    memset(s, 0, sizeof *s);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open snapshot %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Failed to open snapshot %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < SNAPSHOT_HEADER_V1) {
+        fprintf(stderr, "%s is not a snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+
+    s->len = st.st_size;
+    s->map = mmap(NULL, s->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map snapshot %s: %s\n", path, strerror(errno));
+        s->map = NULL;
+        return -1;
+    }
+
+    s->header = s->map;
+    if (memcmp(s->header->magic, SNAPSHOT_MAGIC, sizeof s->header->magic) != 0) {
+        fprintf(stderr, "%s is not a snapshot\n", path);
+        goto fail;
+    }
+    if (s->header->version < 1 || s->header->version > SNAPSHOT_VERSION) {
+        uint32_t swapped = s->header->version >> 24;
+
+        if (swapped >= 1 && swapped <= SNAPSHOT_VERSION && !(s->header->version & 0xffffff)) {
+            fprintf(stderr, "Snapshot %s was captured on a host of the other byte order\n", path);
+        } else {
+            fprintf(stderr, "Snapshot %s has unsupported version %u\n", path, s->header->version);
+        }
+        goto fail;
+    }
+
+    s->index = (const uint64_t *)((const char *)s->map + s->header->index_offset);
+    s->buckets = (const unsigned char *)s->map + s->header->buckets_offset;
+
+    // The records, columns and blocks are read front to back, starting with
+    // the checks of validate().
+    madvise(s->map, s->len, MADV_SEQUENTIAL);
+    if (validate(s, path) < 0) {
+        goto fail;
+    }
+    if (s->header->flags & SNAPSHOT_COLUMNAR) {
+        for (int column = 0; column < SNAPSHOT_NCOLUMNS; column++) {
+            s->columns[column] = (const char *)s->map + s->header->columns[column];
+        }
+    } else if (s->header->flags & SNAPSHOT_COMPRESSED) {
+        s->dict = (const fsid_t *)((const char *)s->map + s->header->dict_offset);
+        s->blocks = (const unsigned char *)s->map + s->header->blocks_offset;
+    } else {
+        s->records = (const struct emit_record *)((const char *)s->map + s->header->records_offset);
+    }
+    return 0;
+
+fail:
+    snapshot_close(s);
+    return -1;
+}
+
+void snapshot_close(struct snapshot *s) {
+    if (s->map) {
+        munmap(s->map, s->len);
+        s->map = NULL;
+    }
+}
+
+// Gathers row i of a columnar snapshot into a record.
+static void column_record(const struct snapshot *s, uint64_t i, struct emit_record *r) {
+    struct fid fid;
+
+    memset(r, 0, sizeof *r);
+    r->addr = ((const uint64_t *)s->columns[SNAPSHOT_COL_ADDR])[i];
+    r->bucket = ((const uint32_t *)s->columns[SNAPSHOT_COL_BUCKET])[i];
+    memcpy(r->fsid, (const char *)s->columns[SNAPSHOT_COL_FSID] + i * sizeof(fsid_t), sizeof r->fsid);
+    memcpy(&fid, (const char *)s->columns[SNAPSHOT_COL_FID] + i * sizeof fid, sizeof fid);
+    r->fid_len = fid.fid_len;
+    r->fid_data0 = fid.fid_data0;
+    memcpy(r->fid, fid.fid_data, MAXFIDSZ);
+    r->usecount = ((const int32_t *)s->columns[SNAPSHOT_COL_USECOUNT])[i];
+    r->lck_usecnt = ((const uint32_t *)s->columns[SNAPSHOT_COL_LCK_USECNT])[i];
+    r->lck_lock = ((const uint8_t *)s->columns[SNAPSHOT_COL_LCK_LOCK])[i];
+    for (int b = 0; b < SNAPSHOT_NCOLUMNS - SNAPSHOT_COL_STATE; b++) {
+        const uint64_t *bitmap = s->columns[SNAPSHOT_COL_STATE + b];
+
+        r->state |= (bitmap[i / 64] >> (i % 64) & 1) << b;
+    }
+}
+
+int snapshot_cursor_init(struct snapshot_cursor *c, const struct snapshot *s) {
+    const struct snapshot_header *h = s->header;
+
+    memset(c, 0, sizeof *c);
+    c->s = s;
+    if (!(h->flags & SNAPSHOT_COMPRESSED)) {
+        return 0;
+    }
+
+    c->next_block = s->blocks;
+    c->rows = malloc(h->block_rows * sizeof *c->rows);
+    c->raw = malloc((size_t)h->block_rows * BLOCK_ROW_MAX + BLOCK_EXTRA);
+    if (!c->rows || !c->raw) {
+        fprintf(stderr, "Failed to allocate a snapshot block\n");
+        snapshot_cursor_free(c);
+        return -1;
+    }
+    return 0;
+}
+
+void snapshot_cursor_free(struct snapshot_cursor *c) {
+    free(c->rows);
+    free(c->raw);
+    c->rows = NULL;
+    c->raw = NULL;
+}
+
+// Decompresses the next block into c->rows.
+static int next_block(struct snapshot_cursor *c) {
+    struct snapshot_block b;
+    uLongf raw_len;
+
+    memcpy(&b, c->next_block, sizeof b);
+    raw_len = (uLongf)b.nrows * BLOCK_ROW_MAX + BLOCK_EXTRA;
+    if (uncompress(c->raw, &raw_len, c->next_block + sizeof b, b.comp_len) != Z_OK || raw_len != b.raw_len ||
+        crc32(0, c->raw, raw_len) != b.crc || decode_block(c->raw, raw_len, b.nrows, c->row, c->s, c->rows) < 0) {
+        fprintf(stderr, "Snapshot block %llu is corrupt\n", (unsigned long long)c->block);
+        return -1;
+    }
+
+    c->next_block += sizeof b + b.comp_len;
+    c->block++;
+    c->row += b.nrows;
+    c->nrows = b.nrows;
+    c->next = 0;
+    return 0;
+}
+
+int snapshot_cursor_seek(struct snapshot_cursor *c, uint64_t row) {
+    const struct snapshot *s = c->s;
+    uint64_t first = 0;
+
+    if (!s->blocks) {
+        c->row = row;
+        return 0;
+    }
+
+    // The block headers were checked when the snapshot was opened, so they
+    // can be walked without decompressing anything.
+    c->next_block = s->blocks;
+    c->block = 0;
+    c->row = 0;
+    c->nrows = 0;
+    c->next = 0;
+    while (c->block < s->header->nblocks) {
+        struct snapshot_block b;
+
+        memcpy(&b, c->next_block, sizeof b);
+        if (row < first + b.nrows) {
+            break;
+        }
+        first += b.nrows;
+        c->next_block += sizeof b + b.comp_len;
+        c->block++;
+    }
+    c->row = first;
+
+    if (row > first && c->block < s->header->nblocks) {
+        if (next_block(c) < 0) {
+            return -1;
+        }
+        c->next = row - first;
+    }
+    return 0;
+}
+
+// Returns the next row as a record, NULL after the last one, or NULL with
+// *err set if a block is corrupt.
+static const struct emit_record *next_record(struct snapshot_cursor *c, int *err) {
+    const struct snapshot *s = c->s;
+
+    *err = 0;
+    if (s->records) {
+        return c->row < s->header->nrecords ? &s->records[c->row++] : NULL;
+    }
+    if (!s->blocks) {
+        if (c->row == s->header->nrecords) {
+            return NULL;
+        }
+        column_record(s, c->row++, &c->scratch);
+        return &c->scratch;
+    }
+
+    if (c->next == c->nrows) {
+        if (c->block == s->header->nblocks) {
+            return NULL;
+        }
+        if (next_block(c) < 0) {
+            *err = 1;
+            return NULL;
+        }
+    }
+    return &c->rows[c->next++];
+}
+
+int snapshot_cursor_record(struct snapshot_cursor *c, const struct emit_record **record) {
+    int err;
+
+    *record = next_record(c, &err);
+    if (!*record) {
+        return err ? -1 : 0;
+    }
+    return 1;
+}
+
+int snapshot_cursor_next(struct snapshot_cursor *c, struct lf_node *node) {
+    const struct emit_record *r;
+    int rc;
+
+    rc = snapshot_cursor_record(c, &r);
+    if (rc > 0) {
+        emit_record_node(r, node);
+    }
+    return rc;
+}
+
+int snapshot_count_clear(const struct snapshot *s, unsigned int mask, uint64_t *countp) {
+    const uint64_t *maps[SNAPSHOT_NCOLUMNS - SNAPSHOT_COL_STATE];
+    uint64_t nrows = s->header->nrecords;
+    uint64_t nwords = (nrows + 63) / 64;
+    uint64_t count = 0;
+    int nmaps = 0;
+
+    if (!s->columns[0]) {
+        struct snapshot_cursor c;
+        const struct emit_record *r;
+        int err;
+
+        if (snapshot_cursor_init(&c, s) < 0) {
+            return -1;
+        }
+        while ((r = next_record(&c, &err))) {
+            count += !(r->state & mask);
+        }
+        snapshot_cursor_free(&c);
+        *countp = count;
+        return err ? -1 : 0;
+    }
+
+    for (int b = 0; b < SNAPSHOT_NCOLUMNS - SNAPSHOT_COL_STATE; b++) {
+        if (mask & 1u << b) {
+            maps[nmaps++] = s->columns[SNAPSHOT_COL_STATE + b];
+        }
+    }
+    if (!nmaps) {
+        *countp = nrows;
+        return 0;
+    }
+
+    // The bitmaps are ORed together a block at a time, one bitmap after the
+    // other, so every inner loop is a plain pass over contiguous words that
+    // the compiler can vectorise. The padding bits of the last word are
+    // clear, so they are counted and subtracted again.
+    for (uint64_t w = 0; w < nwords; w += COUNT_BLOCK) {
+        uint64_t block[COUNT_BLOCK];
+        size_t n = nwords - w < COUNT_BLOCK ? nwords - w : COUNT_BLOCK;
+
+        memcpy(block, maps[0] + w, n * sizeof *block);
+        for (int m = 1; m < nmaps; m++) {
+            for (size_t j = 0; j < n; j++) {
+                block[j] |= maps[m][w + j];
+            }
+        }
+        for (size_t j = 0; j < n; j++) {
+            count += __builtin_popcountll(~block[j]);
+        }
+    }
+
+    *countp = count - (nwords * 64 - nrows);
+    return 0;
+}
@@ -0,0 +1,200 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emit.h"
+#include "lockfile.h"
+
+// A capture of the nfslockhash table, written by nfs-lockfile-counter
+// --snapshot on the server and analysed anywhere by nfs-lockfile-snapshot.
+//
+// The file is laid out so a reader can mmap it and use it in place:
+//
+//   snapshot_header
+//   uint64_t index[hashsize + 1]       first record of each bucket, then nrecords
+//                                      (only counts them in a compressed one)
+//   uint8_t buckets[hashsize]          SNAPSHOT_BUCKET_COMPLETE and damage flags
+//   emit_record records[nrecords]      grouped by bucket, each in chain order
+//
+// Every section starts on an 8-byte boundary and the offsets of all of them
+// are in the header, so later versions can add sections without moving the
+// existing ones. Integers are in the byte order of the capturing host, which
+// the reader checks through the version field.
+//
+// Version 2 adds a columnar variant, flagged SNAPSHOT_COLUMNAR, which replaces
+// the records with one contiguous column per field, in the same row order.
+// The list heads, the use count and the local lock are kept only as presence
+// bitmaps, one bit per row in 64-bit words, so the lost and orphaned
+// predicates reduce to ORing a few bitmaps and counting the bits left clear:
+// a pass over 2 bits per row rather than 56 bytes. Version 1 files, which
+// only have records, are still read.
+//
+// Version 3 adds a compressed variant for keeping a long history of
+// snapshots, flagged SNAPSHOT_COMPRESSED. The index and bucket flags are kept
+// as they are, so chain lengths are still read without decompressing
+// anything. The records are replaced by a dictionary of the distinct fsids,
+// followed by blocks of up to block_rows rows in bucket order. Each block is a
+// snapshot_block and its payload, compressed with zlib at its fastest level.
+// Within a block the rows are sorted by address, so that the addresses can be
+// stored as varint deltas, and each fsid is stored as its varint index in the
+// dictionary. A block still holds the same rows as in the other formats, but
+// their order within it is lost, chain order included. The index of a
+// compressed snapshot therefore only counts the rows of each bucket:
+// index[b] is not the position of the first row of bucket b, and the rows of
+// one bucket cannot be read by slicing. Blocks are decompressed one at a
+// time, so reading a compressed snapshot takes memory for one block whatever
+// its size. The layout of the payload is described in snapshot.c.
+
+#define SNAPSHOT_MAGIC "NFSLKSNP"
+#define SNAPSHOT_VERSION 3
+
+#define SNAPSHOT_COMPLETE 0x01          // Every bucket was walked to the end of its chain
+#define SNAPSHOT_COLUMNAR 0x02          // Columns instead of records
+#define SNAPSHOT_COMPRESSED 0x04        // Compressed blocks instead of records
+
+#define SNAPSHOT_BLOCK_ROWS 65536
+
+#define SNAPSHOT_BUCKET_COMPLETE 0x80   // The bucket's chain was walked to the end
+#define SNAPSHOT_BUCKET_DAMAGE 0x7f     // The scan's BUCKET_* damage flags
+
+// The columns of a columnar snapshot. The value columns hold one element per
+// row. Bitmap column SNAPSHOT_COL_STATE + b holds the lf_state() bit 1 << b,
+// with row i as bit i % 64 of word i / 64.
+enum snapshot_column {
+    SNAPSHOT_COL_ADDR,          // uint64_t
+    SNAPSHOT_COL_BUCKET,        // uint32_t
+    SNAPSHOT_COL_FSID,          // fsid_t
+    SNAPSHOT_COL_FID,           // struct fid
+    SNAPSHOT_COL_USECOUNT,      // int32_t
+    SNAPSHOT_COL_LCK_USECNT,    // uint32_t
+    SNAPSHOT_COL_LCK_LOCK,      // uint8_t
+    SNAPSHOT_COL_STATE,         // Bitmaps, one per lf_state() bit
+    SNAPSHOT_NCOLUMNS = SNAPSHOT_COL_STATE + 7
+};
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t flags;
+    char layout[32];            // The lf_layout the table was read with
+    uint64_t table;             // Kernel address of the bucket array
+    int64_t taken;
+    uint32_t hashsize;
+    uint32_t pad;
+    uint64_t total;             // Entries counted by the scan
+    uint64_t lost;
+    uint64_t nrecords;
+    uint64_t index_offset;
+    uint64_t buckets_offset;
+    uint64_t records_offset;    // Zero in a columnar or compressed snapshot
+
+    // Version 2
+    uint64_t columns[SNAPSHOT_NCOLUMNS];    // Offset of each column, if columnar
+
+    // Version 3
+    uint64_t dict_offset;       // fsid_t[ndict], if compressed
+    uint32_t ndict;
+    uint32_t block_rows;
+    uint64_t blocks_offset;
+    uint64_t nblocks;
+};
+
+// The sizes of the version 1 and 2 headers, which end before the fields the
+// next version added.
+#define SNAPSHOT_HEADER_V1 offsetof(struct snapshot_header, columns)
+#define SNAPSHOT_HEADER_V2 offsetof(struct snapshot_header, dict_offset)
+
+// Precedes the payload of each block of a compressed snapshot. Blocks follow
+// each other without padding.
+struct snapshot_block {
+    uint32_t nrows;
+    uint32_t raw_len;
+    uint32_t comp_len;
+    uint32_t crc;               // crc32() of the uncompressed payload
+};
+
+// Collects the records of a scan in visit order, which may interleave the
+// buckets of several workers.
+struct snapshot_writer {
+    struct emit_record *records;
+    size_t count;
+    size_t cap;
+};
+
+int snapshot_writer_init(struct snapshot_writer *w);
+void snapshot_writer_free(struct snapshot_writer *w);
+int snapshot_writer_add(struct snapshot_writer *w, const struct lf_node *node);
+
+// Groups the records by bucket and writes them to path with the index, as
+// records, or as columns or compressed blocks if h->flags has
+// SNAPSHOT_COLUMNAR or SNAPSHOT_COMPRESSED. The caller fills
+// in the layout, table, time, hashsize, counts and flags of h, and passes one
+// SNAPSHOT_BUCKET_* byte per bucket.
+int snapshot_save(const struct snapshot_writer *w, const char *path, struct snapshot_header *h,
+                  const unsigned char *buckets);
+
+// A snapshot mapped into memory.
+struct snapshot {
+    void *map;
+    size_t len;
+    const struct snapshot_header *header;
+    const uint64_t *index;
+    const unsigned char *buckets;
+    const struct emit_record *records;     // NULL if columnar or compressed
+    const void *columns[SNAPSHOT_NCOLUMNS];
+    const fsid_t *dict;
+    const unsigned char *blocks;
+};
+
+// Maps path and checks that its sections, and the headers of its blocks, fit
+// in the file, and that every row of a row or columnar snapshot is in the
+// bucket the index places it in. Returns -1 on failure after reporting why.
+int snapshot_open(struct snapshot *s, const char *path);
+void snapshot_close(struct snapshot *s);
+
+// Reads the rows of a snapshot of any format in order. The rows of a
+// compressed snapshot are decompressed a block at a time into `rows`.
+struct snapshot_cursor {
+    const struct snapshot *s;
+    uint64_t row;                   // Next row, or first row of the next block
+    uint64_t block;                 // Next block of a compressed snapshot
+    const unsigned char *next_block;
+    unsigned char *raw;
+    struct emit_record *rows;
+    uint32_t nrows;
+    uint32_t next;
+    struct emit_record scratch;     // The current row of a columnar snapshot
+};
+
+int snapshot_cursor_init(struct snapshot_cursor *c, const struct snapshot *s);
+void snapshot_cursor_free(struct snapshot_cursor *c);
+
+// Decodes the next row into node as emit_record_node() would. Returns 1, 0
+// after the last row, or -1 if a block is corrupt.
+int snapshot_cursor_next(struct snapshot_cursor *c, struct lf_node *node);
+
+// As snapshot_cursor_next(), but points record at the row itself, valid until
+// the next call, for readers that work on records rather than nodes.
+int snapshot_cursor_record(struct snapshot_cursor *c, const struct emit_record **record);
+
+// Moves the cursor to row, so that several cursors can each read a range of
+// the rows. Only the block holding row is decompressed. Returns -1 if it is
+// corrupt.
+int snapshot_cursor_seek(struct snapshot_cursor *c, uint64_t row);
+
+// Counts the rows in which none of the lf_state() bits in mask is set: those
+// that are lost for LF_STATE_OPEN | LF_STATE_LOCK, and those that are
+// orphaned for every bit. A columnar snapshot is counted a word of 64 rows at
+// a time from its bitmaps. Returns -1 if a block is corrupt.
+int snapshot_count_clear(const struct snapshot *s, unsigned int mask, uint64_t *count);
+
+// Returns the number of records in bucket, in any format.
+static inline uint64_t snapshot_chain_len(const struct snapshot *s, uint32_t bucket) {
+    return s->index[bucket + 1] - s->index[bucket];
+}
+
+#endif
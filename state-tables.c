@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "state-tables.h"
+
+// The leading members of struct nfsclient and struct nfsdsession from
+// <fs/nfs/nfsrvstate.h>, as far as the walk and the idle tests need them.
+// Pointers are converted to unsigned long, as for struct nfslockfile.
+struct nfsclient_head {
+    struct { unsigned long le_next; unsigned long le_prev; } lc_hash;    /* Clientid hash list */
+    unsigned long lc_stateid;       /* Stateid hash */
+    struct { unsigned long lh_first; } lc_open;    /* Open owner list */
+    struct { unsigned long lh_first; } lc_deleg;    /* Delegations */
+    struct { unsigned long lh_first; } lc_olddeleg;    /* and old delegations */
+    struct { unsigned long lh_first; } lc_session;    /* List of NFSv4.1 sessions */
+};
+
+struct nfsdsession_head {
+    uint64_t sess_refcnt;           /* Reference count */
+    struct { unsigned long le_next; unsigned long le_prev; } sess_hash;    /* Hash list of sessions */
+};
+
+// struct nfssessionhash puts a struct mtx ahead of each LIST_HEAD. It is four
+// pointers on 64-bit kernels: a struct lock_object and mtx_lock.
+#define MTX_SIZE (4 * sizeof(unsigned long))
+
+#define FIELD(type, member) {offsetof(type, member), sizeof(((type *)0)->member)}
+
+static const struct lf_layout client_layout = {
+        .name = "freebsd-client",
+        .size = sizeof(struct nfsclient_head),
+        .fields = {
+                [LF_HASH_NEXT] = FIELD(struct nfsclient_head, lc_hash.le_next),
+                [LF_HASH_PREV] = FIELD(struct nfsclient_head, lc_hash.le_prev),
+                [LF_OPEN] = FIELD(struct nfsclient_head, lc_open.lh_first),
+                [LF_DELEG] = FIELD(struct nfsclient_head, lc_deleg.lh_first),
+                [LF_LOCK] = FIELD(struct nfsclient_head, lc_olddeleg.lh_first),
+                [LF_LOCALLOCK] = FIELD(struct nfsclient_head, lc_session.lh_first),
+        },
+};
+
+static const struct lf_layout session_layout = {
+        .name = "freebsd-session",
+        .size = sizeof(struct nfsdsession_head),
+        .fields = {
+                [LF_HASH_NEXT] = FIELD(struct nfsdsession_head, sess_hash.le_next),
+                [LF_HASH_PREV] = FIELD(struct nfsdsession_head, sess_hash.le_prev),
+                [LF_OPEN] = FIELD(struct nfsdsession_head, sess_refcnt),
+        },
+};
+
+const struct state_table state_tables[] = {
+        {
+                .name = "lockfile",
+                .hash_symbol = SYMBOL_LOCKHASH,
+                .size_symbol = SYMBOL_LOCKHASH_SIZE,
+                .bucket_stride = sizeof(unsigned long),
+                .layout = &lf_layouts[0],
+                .idle_fields = LF_BIT(LF_OPEN) | LF_BIT(LF_LOCK),
+                .idle_desc = "no opens or locks",
+        },
+        {
+                .name = "client",
+                .hash_symbol = "_nfsclienthash",
+                .size_symbol = "_nfsrv_clienthashsize",
+                .bucket_stride = sizeof(unsigned long),
+                .layout = &client_layout,
+                .idle_fields = LF_BIT(LF_OPEN) | LF_BIT(LF_DELEG) | LF_BIT(LF_LOCK) | LF_BIT(LF_LOCALLOCK),
+                .idle_desc = "no open owners, delegations or sessions",
+        },
+        {
+                .name = "session",
+                .hash_symbol = "_nfssessionhash",
+                .size_symbol = "_nfsrv_sessionhashsize",
+                .bucket_stride = MTX_SIZE + sizeof(unsigned long),
+                .head_offset = MTX_SIZE,
+                .layout = &session_layout,
+                .idle_fields = LF_BIT(LF_OPEN),
+                .idle_desc = "no references",
+        },
+        {.name = NULL},
+};
+
+const struct state_table *state_table_find(const char *name) {
+    for (const struct state_table *t = state_tables; t->name; t++) {
+        if (strcmp(t->name, name) == 0) {
+            return t;
+        }
+    }
+    return NULL;
+}
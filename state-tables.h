@@ -0,0 +1,41 @@
+#ifndef STATE_TABLES_H
+#define STATE_TABLES_H
+
+#include <stddef.h>
+
+#include "lockfile.h"
+
+// Describes one of the NFSv4 server's hash tables of state. They share the
+// layout of nfslockhash: an array of buckets, each holding a LIST_HEAD, whose
+// entries are linked through a LIST_ENTRY. The scan engine walks any table
+// described here.
+//
+// A bucket is bucket_stride bytes long and holds its LIST_HEAD head_offset
+// bytes in. The node layout places the LIST_ENTRY in LF_HASH_NEXT and
+// LF_HASH_PREV. An entry is counted as idle, the analogue of a lost lockfile,
+// when every field in idle_fields is zero.
+//
+// The lockfile table uses the lockfile layout chosen with -L. The other
+// tables have no file handle, so their layouts only describe the hash links
+// and the fields their idle test reads. Those fields go in the pointer-sized
+// list-head slots, LF_OPEN to LF_ROLLBACK, in the order the kernel declares
+// them, whatever their meaning for a lockfile.
+
+struct state_table {
+    const char *name;
+    const char *hash_symbol;
+    const char *size_symbol;
+    size_t bucket_stride;
+    size_t head_offset;
+    const struct lf_layout *layout;
+    unsigned int idle_fields;
+    const char *idle_desc;      // What an idle entry is, for the report
+};
+
+// The lockfile table comes first.
+extern const struct state_table state_tables[];
+
+// Returns the table with the given name, or NULL if there is none.
+const struct state_table *state_table_find(const char *name);
+
+#endif
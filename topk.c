@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "topk.h"
+
+static unsigned int key_hash(const struct topk *tk, const unsigned char *key) {
+    unsigned int h = 2166136261u;
+
+    for (size_t i = 0; i < tk->keylen; i++) {
+        h = (h ^ key[i]) * 16777619u;
+    }
+    return h & (tk->hashsize - 1);
+}
+
+int topk_init(struct topk *tk, int cap, size_t keylen) {
+    memset(tk, 0, sizeof *tk);
+
+    if (cap < 1 || keylen == 0 || keylen > TOPK_KEY_MAX) {
+        return -1;
+    }
+
+    tk->keylen = keylen;
+    tk->cap = cap;
+    tk->hashsize = 1;
+    while (tk->hashsize < cap * 2) {
+        tk->hashsize <<= 1;
+    }
+
+    tk->counters = calloc(cap, sizeof *tk->counters);
+    tk->heap = calloc(cap, sizeof *tk->heap);
+    tk->hash = malloc(tk->hashsize * sizeof *tk->hash);
+    if (!tk->counters || !tk->heap || !tk->hash) {
+        topk_free(tk);
+        return -1;
+    }
+
+    for (int i = 0; i < tk->hashsize; i++) {
+        tk->hash[i] = -1;
+    }
+    return 0;
+}
+
+void topk_free(struct topk *tk) {
+    free(tk->counters);
+    free(tk->heap);
+    free(tk->hash);
+    tk->counters = NULL;
+    tk->heap = NULL;
+    tk->hash = NULL;
+}
+
+static void heap_swap(struct topk *tk, int a, int b) {
+    int ca = tk->heap[a];
+    int cb = tk->heap[b];
+
+    tk->heap[a] = cb;
+    tk->heap[b] = ca;
+    tk->counters[cb].heap = a;
+    tk->counters[ca].heap = b;
+}
+
+// Restores the heap after the count at position pos grew.
+static void sift_down(struct topk *tk, int pos) {
+    for (;;) {
+        int left = 2 * pos + 1;
+        int right = left + 1;
+        int smallest = pos;
+
+        if (left < tk->used && tk->counters[tk->heap[left]].count < tk->counters[tk->heap[smallest]].count) {
+            smallest = left;
+        }
+        if (right < tk->used && tk->counters[tk->heap[right]].count < tk->counters[tk->heap[smallest]].count) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            return;
+        }
+        heap_swap(tk, pos, smallest);
+        pos = smallest;
+    }
+}
+
+static void sift_up(struct topk *tk, int pos) {
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+
+        if (tk->counters[tk->heap[parent]].count <= tk->counters[tk->heap[pos]].count) {
+            return;
+        }
+        heap_swap(tk, pos, parent);
+        pos = parent;
+    }
+}
+
+static void hash_remove(struct topk *tk, int c) {
+    int *link = &tk->hash[key_hash(tk, tk->counters[c].key)];
+
+    while (*link != c) {
+        link = &tk->counters[*link].hnext;
+    }
+    *link = tk->counters[c].hnext;
+}
+
+void topk_add(struct topk *tk, const void *key) {
+    unsigned int h = key_hash(tk, key);
+    struct topk_counter *counter;
+    int c;
+
+    tk->seen++;
+
+    for (c = tk->hash[h]; c >= 0; c = tk->counters[c].hnext) {
+        if (memcmp(tk->counters[c].key, key, tk->keylen) == 0) {
+            tk->counters[c].count++;
+            sift_down(tk, tk->counters[c].heap);
+            return;
+        }
+    }
+
+    if (tk->used < tk->cap) {
+        c = tk->used++;
+        counter = &tk->counters[c];
+        counter->count = 1;
+        counter->error = 0;
+        counter->heap = c;
+        tk->heap[c] = c;
+        memcpy(counter->key, key, tk->keylen);
+        counter->hnext = tk->hash[h];
+        tk->hash[h] = c;
+        sift_up(tk, c);
+        return;
+    }
+
+    // Replace the least counted key, which sits at the root of the heap.
+    c = tk->heap[0];
+    counter = &tk->counters[c];
+    hash_remove(tk, c);
+    counter->error = counter->count;
+    counter->count++;
+    memcpy(counter->key, key, tk->keylen);
+    counter->hnext = tk->hash[h];
+    tk->hash[h] = c;
+    sift_down(tk, 0);
+}
+
+static int compare_count(const void *a, const void *b) {
+    const struct topk_counter *ca = a;
+    const struct topk_counter *cb = b;
+
+    return (ca->count < cb->count) - (ca->count > cb->count);
+}
+
+struct topk_counter *topk_sorted(const struct topk *tk, int *count) {
+    struct topk_counter *sorted = malloc((tk->used ? tk->used : 1) * sizeof *sorted);
+
+    if (!sorted) {
+        return NULL;
+    }
+
+    memcpy(sorted, tk->counters, tk->used * sizeof *sorted);
+    qsort(sorted, tk->used, sizeof *sorted, compare_count);
+    *count = tk->used;
+    return sorted;
+}
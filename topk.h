@@ -0,0 +1,45 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stddef.h>
+
+// Streaming top-K over fixed-size byte keys with the space-saving algorithm.
+// At most `cap` keys are monitored at once. A key that is not monitored
+// replaces the one with the lowest count and inherits that count, which is
+// kept as the error bound of the new key. Any key occurring more than N / cap
+// times in a stream of N is guaranteed to be monitored, and its true count lies
+// between count - error and count. Memory is fixed by cap no matter how many
+// keys are seen.
+
+#define TOPK_KEY_MAX 32
+
+struct topk_counter {
+    unsigned char key[TOPK_KEY_MAX];
+    unsigned long count;
+    unsigned long error;
+    int heap;       // Position in the min-heap
+    int hnext;      // Next counter in the same hash bucket
+};
+
+struct topk {
+    size_t keylen;
+    int cap;
+    int used;
+    unsigned long seen;
+    struct topk_counter *counters;
+    int *heap;      // Counter indices ordered by count, lowest first
+    int *hash;
+    int hashsize;
+};
+
+int topk_init(struct topk *tk, int cap, size_t keylen);
+void topk_free(struct topk *tk);
+
+// Counts one occurrence of the keylen bytes at key.
+void topk_add(struct topk *tk, const void *key);
+
+// Returns a copy of the monitored counters sorted by count, highest first,
+// and stores their number in count. The caller frees the array.
+struct topk_counter *topk_sorted(const struct topk *tk, int *count);
+
+#endif